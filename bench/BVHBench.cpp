@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <glm/glm.hpp>
+#include "R3.h"
+#include "BV.h"
+#include "BenchUtil.h"
+#include "BVH.h"
+#include "Ray.h"
+
+/*******************************************************************************
+ * Bounding volume hierarchy benchmark
+ *
+ * Scatters the given numbers of small boxes (puffs) through a unit cube and
+ * times finding the boxes that random rays pass through, both by testing
+ * every box with BoundingBox::isHit() and with a BVH query. Both must find
+ * the same boxes.
+ *
+ * USAGE: BVHBench [rays = 20000] [object count = 100 1000 10000 ...]
+ ******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    vector<int> sizes;
+
+    for (int a=2; a<argc; a++) {
+        sizes.push_back(atoi(argv[a]));
+    }
+    if (sizes.empty()) {
+        sizes.push_back(100);
+        sizes.push_back(1000);
+        sizes.push_back(10000);
+    }
+
+    for (auto si = sizes.begin(); si != sizes.end(); si++) {
+
+        int size = *si;
+        mt19937 rng(1337);
+        uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        uniform_real_distribution<float> radius(0.005f, 0.03f);
+        vector<BoundingBox> bounds;
+
+        for (int o=0; o<size; o++) {
+            bounds.push_back(BoundingBox::fromCenter(P(unit(rng), unit(rng), unit(rng)), radius(rng)));
+        }
+
+        // Rays from random points around the cube through random points in it:
+        vector<Ray> rays;
+
+        while (static_cast<int>(rays.size()) < count) {
+
+            V from(unit(rng), unit(rng), unit(rng));
+            if (glm::length(from) < 1.0e-3f) {
+                continue;
+            }
+
+            P origin = P(0.0f, 0.0f, 0.0f) + (glm::normalize(from) * 3.0f);
+            P target(unit(rng), unit(rng), unit(rng));
+            rays.push_back(Ray(origin, target - origin));
+        }
+
+        auto start = Clock::now();
+        BVH bvh(bounds);
+        double tBuild = seconds(start);
+
+        vector<BVHHit> hits(size);
+        vector<int> expected, found;
+        long long checksumAll = 0, checksumBVH = 0;
+        bool differ = false;
+
+        // Every box, every ray:
+        start = Clock::now();
+        for (size_t r=0; r<rays.size(); r++) {
+            P entered, exited;
+            for (int o=0; o<size; o++) {
+                if (bounds[o].isHit(rays[r], entered, exited)) {
+                    checksumAll += o + 1;
+                }
+            }
+        }
+        double tAll = seconds(start);
+
+        // BVH:
+        start = Clock::now();
+        for (size_t r=0; r<rays.size(); r++) {
+            int n = bvh.intersect(rays[r], hits.data());
+            for (int h=0; h<n; h++) {
+                checksumBVH += hits[h].object + 1;
+            }
+        }
+        double tBVH = seconds(start);
+
+        // Both must find the same boxes, and the BVH must order them:
+        for (size_t r=0; r<rays.size() && !differ; r++) {
+
+            P entered, exited;
+            expected.clear();
+            found.clear();
+
+            for (int o=0; o<size; o++) {
+                if (bounds[o].isHit(rays[r], entered, exited)) {
+                    expected.push_back(o);
+                }
+            }
+
+            int n = bvh.intersect(rays[r], hits.data());
+
+            for (int h=0; h<n; h++) {
+                found.push_back(hits[h].object);
+                differ |= h > 0 && hits[h].tNear < hits[h - 1].tNear;
+            }
+
+            sort(found.begin(), found.end());
+            differ |= found != expected;
+        }
+
+        double perRay = 1.0e9 / static_cast<double>(rays.size());
+
+        cout << "BVH: " << size << " objects, " << bvh.getNodeCount() << " nodes, depth " << bvh.getDepth()
+             << ", built in " << fixed << setprecision(2) << tBuild * 1.0e3 << " ms" << endl
+             << setprecision(1)
+             << "  every object " << setw(10) << tAll * perRay << " ns/ray" << endl
+             << "  BVH          " << setw(10) << tBVH * perRay << " ns/ray"
+             << " (" << setprecision(2) << tAll / tBVH << "x)"
+             << (!differ && checksumAll == checksumBVH ? "" : "  *** RESULTS DIFFER ***")
+             << endl
+             << defaultfloat << setprecision(6);
+    }
+
+    return 0;
+}
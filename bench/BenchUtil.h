@@ -0,0 +1,108 @@
+#ifndef _BENCH_UTIL_H
+#define _BENCH_UTIL_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "R3.h"
+#include "BV.h"
+#include "Ray.h"
+#include "Voxel.h"
+
+/*******************************************************************************
+ * Fixtures shared by the benchmarks: timing, the procedural volume they
+ * march through and the random rays they march along
+ ******************************************************************************/
+
+typedef std::chrono::steady_clock Clock;
+
+// Straight segment of a ray through a volume's bounds
+typedef struct MarchRay
+{
+    P start;
+    P end;
+} MarchRay;
+
+// Shadow ray as Q() takes it: iterations steps of N from X
+typedef struct ShadowRay
+{
+    P X;
+    V N;
+    int iterations;
+} ShadowRay;
+
+/******************************************************************************/
+
+inline double seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * A lumpy ball with an empty border, cheap enough to fill a 512^3 grid with.
+ * Voxel (i,j,k) of the size^3 grid is written, so the buffer should be that
+ * size already
+ */
+inline void fill(VoxelBuffer& vb, int size)
+{
+    float scale = 1.0f / static_cast<float>(size);
+
+    for (int k=0; k<size; k++) {
+        for (int j=0; j<size; j++) {
+            for (int i=0; i<size; i++) {
+                float x = (static_cast<float>(i) + 0.5f) * scale - 0.5f;
+                float y = (static_cast<float>(j) + 0.5f) * scale - 0.5f;
+                float z = (static_cast<float>(k) + 0.5f) * scale - 0.5f;
+                float r = std::sqrt((x * x) + (y * y) + (z * z));
+                float n = std::sin(23.0f * x) * std::sin(19.0f * y) * std::sin(17.0f * z);
+                vb(i, j, k) = std::max(0.0f, 4.0f * (0.4f - r + (0.1f * n)));
+            }
+        }
+    }
+}
+
+/**
+ * Ray from a random point at distance 2 from the origin through a random
+ * point inside the ball fill() makes
+ */
+inline Ray randomRay(std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    for (;;) {
+
+        V from(unit(rng), unit(rng), unit(rng));
+        if (glm::length(from) < 1.0e-3f) {
+            continue;
+        }
+
+        P origin = P(0.0f, 0.0f, 0.0f) + (glm::normalize(from) * 2.0f);
+        P target(0.4f * unit(rng), 0.4f * unit(rng), 0.4f * unit(rng));
+
+        return Ray(origin, target - origin);
+    }
+}
+
+/**
+ * The segments of count random rays that lie within bounds
+ */
+inline std::vector<MarchRay> marchRays(BoundingBox bounds, int count, std::mt19937& rng)
+{
+    std::vector<MarchRay> rays;
+
+    while (static_cast<int>(rays.size()) < count) {
+
+        Ray ray = randomRay(rng);
+        MarchRay mr;
+
+        if (bounds.isHit(ray, mr.start, mr.end)) {
+            rays.push_back(mr);
+        }
+    }
+
+    return rays;
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <vector>
+#include <glm/glm.hpp>
+#include "R3.h"
+#include "BV.h"
+#include "BenchUtil.h"
+#include "Color.h"
+#include "Context.h"
+#include "Ray.h"
+#include "Voxel.h"
+
+/*******************************************************************************
+ * Voxel layout benchmark
+ *
+ * Times primary (trilinear) and shadow (nearest voxel) marches through the
+ * same procedural volume stored in the linear and in the bricked layout, at
+ * each of the given grid sizes. Both layouts must give identical results.
+ *
+ * USAGE: LayoutBench [rays = 2000] [grid size = 256 512 ...]
+ ******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * Runs f over every ray, returning the average time per call in nanoseconds
+ * and summing the results into checksum
+ */
+template<typename R, typename F> double timeRays(const vector<R>& rays, double& checksum, F f)
+{
+    checksum   = 0.0;
+    auto start = Clock::now();
+
+    for (size_t r=0; r<rays.size(); r++) {
+        checksum += f(rays[r]);
+    }
+
+    double ns = chrono::duration<double, nano>(Clock::now() - start).count();
+
+    return ns / static_cast<double>(rays.size());
+}
+
+static void report(const char* name, double tLinear, double tBricked, double cLinear, double cBricked)
+{
+    cout << "  " << name
+         << fixed << setprecision(1)
+         << " linear " << setw(9) << tLinear << " ns/ray"
+         << ", bricked " << setw(9) << tBricked << " ns/ray"
+         << " (" << setprecision(2) << tLinear / tBricked << "x)"
+         << (cLinear == cBricked ? "" : "  *** RESULTS DIFFER ***")
+         << endl;
+}
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    vector<int> sizes;
+
+    for (int a=2; a<argc; a++) {
+        sizes.push_back(atoi(argv[a]));
+    }
+    if (sizes.empty()) {
+        sizes.push_back(256);
+        sizes.push_back(512);
+    }
+
+    BoundingBox bounds = BoundingBox::fromCenter(P(0.0f, 0.0f, 0.0f), 0.5f);
+    P light(3.0f, 1.0f, 3.0f);
+
+    for (auto si = sizes.begin(); si != sizes.end(); si++) {
+
+        int size   = *si;
+        float step = 1.0f / static_cast<float>(size);
+
+        VoxelBuffer linear(ivec3(size, size, size), bounds, Color::WHITE);
+        fill(linear, size);
+        linear.setDimensions(ivec3(size, size, size));
+
+        VoxelBuffer bricked(linear);
+        bricked.setLayout(LAYOUT_BRICKED);
+
+        // Reads go through a const reference, since the non-const accessors
+        // would invalidate the macrocells:
+        const VoxelBuffer& volume = linear;
+
+        // Primary rays from random points around the volume through random
+        // points inside it:
+        mt19937 rng(1337);
+        vector<MarchRay> primary = marchRays(bounds, count, rng);
+
+        // Shadow rays from the centers of random non-empty voxels:
+        uniform_int_distribution<int> pick(0, size - 1);
+        vector<ShadowRay> shadow;
+        float offset = (2.0f * step) + MARCH_EPSILON;
+
+        while (static_cast<int>(shadow.size()) < count) {
+
+            int i = pick(rng), j = pick(rng), k = pick(rng);
+
+            if (volume(i, j, k) <= 0.0f) {
+                continue;
+            }
+
+            P center;
+            ShadowRay ray;
+            volume.center(i, j, k, center);
+            ray.iterations = traverse(step, offset, center, light, ray.X, ray.N);
+            shadow.push_back(ray);
+        }
+
+        RenderScene scene;
+        RenderContext context(step, scene);
+        context.setInterpolation(true);
+        context.setCutoff(0.0f);
+
+        double cLinear, cBricked;
+
+        cout << defaultfloat << setprecision(6)
+             << "Voxel layout: " << size << "^3 grid, step " << step << ", " << count << " rays" << endl;
+
+        double tLinear = timeRays(primary, cLinear, [&](const MarchRay& r) {
+            return rayMarch(context, linear, r.start, r.end).transmittance;
+        });
+        double tBricked = timeRays(primary, cBricked, [&](const MarchRay& r) {
+            return rayMarch(context, bricked, r.start, r.end).transmittance;
+        });
+        report("primary", tLinear, tBricked, cLinear, cBricked);
+
+        tLinear = timeRays(shadow, cLinear, [&](const ShadowRay& r) {
+            return Q(linear, KAPPA, step, r.iterations, r.X, r.N, 0.0f);
+        });
+        tBricked = timeRays(shadow, cBricked, [&](const ShadowRay& r) {
+            return Q(bricked, KAPPA, step, r.iterations, r.X, r.N, 0.0f);
+        });
+        report("shadow ", tLinear, tBricked, cLinear, cBricked);
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "BenchUtil.h"
+#include "Config.h"
+#include "MappedFile.h"
+#include "Utils.h"
+
+/*******************************************************************************
+ * Density parsing benchmark
+ *
+ * Writes a body of the old configuration format, one density per line, in
+ * the mix of forms density tools write: zeros, short decimals, full float
+ * precision and exponents. It is then parsed the way the reader used to,
+ * a line and an istringstream at a time, and by the mapped parallel parser,
+ * whose densities must match the old ones exactly.
+ *
+ * USAGE: ParseBench [densities = 16777216] [file = ParseBench.txt]
+ ******************************************************************************/
+
+using namespace std;
+
+/******************************************************************************/
+
+/**
+ * Exposes the reader's parser
+ */
+class BenchReader : public OldConfigurationReader
+{
+    public:
+        BenchReader(int width) : OldConfigurationReader() { this->XYZC = ivec3(width, width, width); }
+
+        void parse(const MappedFile& file, vector<float>& densities) const
+        {
+            const char* text = reinterpret_cast<const char*>(file.data());
+            this->readDensities(text, text + file.size(), densities);
+        }
+};
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int count       = argc > 1 ? atoi(argv[1]) : 16777216;
+    string filename = argc > 2 ? string(argv[2]) : string("ParseBench.txt");
+    int width       = 100;
+
+    {
+        ofstream out(filename.c_str());
+        mt19937 rng(1337);
+        uniform_real_distribution<float> unit(0.0f, 1.0f);
+        char line[64];
+
+        for (int n=0; n<count; n++) {
+
+            float density = unit(rng);
+
+            switch (n % 8) {
+                case 0: case 1: case 2:
+                    snprintf(line, sizeof(line), "0\n");
+                    break;
+                case 3: case 4:
+                    snprintf(line, sizeof(line), "%.2f\n", density);
+                    break;
+                case 5:
+                    snprintf(line, sizeof(line), "%.6f\n", density);
+                    break;
+                case 6:
+                    snprintf(line, sizeof(line), "%.9g\n", density);
+                    break;
+                default:
+                    snprintf(line, sizeof(line), "%.4e\n", density);
+                    break;
+            }
+
+            out << line;
+        }
+    }
+
+    MappedFile file(filename, true);
+    double megabytes = static_cast<double>(file.size()) / (1024.0 * 1024.0);
+
+    cout << fixed << setprecision(1)
+         << "Parsing: " << count << " densities, " << megabytes << " MB" << endl;
+
+    // A line and a stream at a time:
+    vector<float> expected;
+    expected.reserve(count);
+
+    auto start = Clock::now();
+    {
+        ifstream in(filename.c_str());
+        string line;
+
+        while (getline(in, line)) {
+            istringstream is(Utils::trim(line));
+            float value = 0.0f;
+            is >> value;
+            expected.push_back(value * width);
+        }
+    }
+    double streamTime = seconds(start);
+
+    cout << "  istringstream  " << setw(8) << streamTime << " s " << setw(8) << megabytes / streamTime << " MB/s" << endl;
+
+    // Mapped and in parallel, best of three:
+    BenchReader reader(width);
+    vector<float> densities;
+    double parseTime = 0.0;
+
+    for (int r=0; r<3; r++) {
+        densities.clear();
+        start     = Clock::now();
+        reader.parse(file, densities);
+        double t  = seconds(start);
+        parseTime = r == 0 ? t : std::min(parseTime, t);
+    }
+
+    int mismatches = densities.size() == expected.size() ? 0 : count;
+
+    for (size_t n=0; n<densities.size() && n<expected.size(); n++) {
+        mismatches += densities[n] != expected[n];
+    }
+
+    cout << "  mapped         " << setw(8) << parseTime << " s " << setw(8) << megabytes / parseTime << " MB/s"
+         << ", " << mismatches << " mismatches" << endl;
+
+    remove(filename.c_str());
+
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <glm/glm.hpp>
+#include "R3.h"
+#include "BV.h"
+#include "BenchUtil.h"
+#include "Color.h"
+#include "Context.h"
+#include "Ray.h"
+#include "Voxel.h"
+
+/*******************************************************************************
+ * Density quantization benchmark
+ *
+ * Stores the same procedural volume as floats and as 16 and 8-bit codes, in
+ * the linear layout (one range for the volume) and the bricked one (a range
+ * per brick), at each of the given grid sizes. For every combination it
+ * reports the storage taken, the largest and RMS error in voxel densities
+ * and in trilinearly interpolated ones along primary rays, and the time and
+ * the largest transmittance error of marching those rays.
+ *
+ * USAGE: QuantizeBench [rays = 2000] [grid size = 256 512 ...]
+ ******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+/******************************************************************************/
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    vector<int> sizes;
+
+    for (int a=2; a<argc; a++) {
+        sizes.push_back(atoi(argv[a]));
+    }
+    if (sizes.empty()) {
+        sizes.push_back(256);
+        sizes.push_back(512);
+    }
+
+    const VoxelLayout layouts[]  = { LAYOUT_LINEAR, LAYOUT_BRICKED };
+    const char* layoutNames[]    = { "linear ", "bricked" };
+    const VoxelFormat formats[]  = { FORMAT_FLOAT, FORMAT_UINT16, FORMAT_UINT8 };
+    const char* formatNames[]    = { "float ", "16-bit", "8-bit " };
+
+    BoundingBox bounds = BoundingBox::fromCenter(P(0.0f, 0.0f, 0.0f), 0.5f);
+
+    for (auto si = sizes.begin(); si != sizes.end(); si++) {
+
+        int size   = *si;
+        float step = 1.0f / static_cast<float>(size);
+
+        // Primary rays from random points around the volume through random
+        // points inside it:
+        mt19937 rng(1337);
+        vector<MarchRay> primary = marchRays(bounds, count, rng);
+
+        RenderScene scene;
+        RenderContext context(step, scene);
+        context.setInterpolation(true);
+        context.setCutoff(0.0f);
+
+        cout << defaultfloat << setprecision(6)
+             << "Quantization: " << size << "^3 grid, step " << step << ", " << count << " rays" << endl;
+
+        for (int l=0; l<2; l++) {
+
+            VoxelBuffer reference(ivec3(size, size, size), bounds, Color::WHITE);
+            fill(reference, size);
+            reference.setDimensions(ivec3(size, size, size));
+            reference.setLayout(layouts[l]);
+
+            // Float densities and transmittances to measure against:
+            vector<float> expected(primary.size());
+
+            for (size_t r=0; r<primary.size(); r++) {
+                expected[r] = rayMarch(context, reference, primary[r].start, primary[r].end).transmittance;
+            }
+
+            for (int f=0; f<3; f++) {
+
+                VoxelBuffer quantized(reference);
+                quantized.setFormat(formats[f]);
+
+                float maxError, rmsError;
+                quantized.getQuantizationError(maxError, rmsError);
+
+                // Interpolated densities at a few points along every ray:
+                float maxSampleError = 0.0f;
+                double sumSquares    = 0.0;
+                int samples          = 0;
+
+                for (size_t r=0; r<primary.size(); r++) {
+                    for (int s=1; s<16; s++) {
+                        P X = primary[r].start + ((primary[r].end - primary[r].start) * (static_cast<float>(s) / 16.0f));
+                        float error = std::abs(quantized.getInterpolatedDensity(X) - reference.getInterpolatedDensity(X));
+                        maxSampleError = std::max(maxSampleError, error);
+                        sumSquares    += static_cast<double>(error) * error;
+                        samples++;
+                    }
+                }
+
+                // Marching:
+                float maxTError = 0.0f;
+                auto start      = Clock::now();
+
+                for (size_t r=0; r<primary.size(); r++) {
+                    float T   = rayMarch(context, quantized, primary[r].start, primary[r].end).transmittance;
+                    maxTError = std::max(maxTError, std::abs(T - expected[r]));
+                }
+
+                double ns = chrono::duration<double, nano>(Clock::now() - start).count() / static_cast<double>(primary.size());
+
+                cout << "  " << layoutNames[l] << " " << formatNames[f]
+                     << fixed << setprecision(1)
+                     << setw(9) << static_cast<double>(quantized.storageBytes()) / (1024.0 * 1024.0) << " MB"
+                     << scientific << setprecision(2)
+                     << "  voxel max " << maxError << " rms " << rmsError
+                     << ", sample max " << maxSampleError << " rms " << std::sqrt(sumSquares / samples)
+                     << ", T max " << maxTError
+                     << fixed << setprecision(1)
+                     << ", " << setw(9) << ns << " ns/ray"
+                     << endl;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <vector>
+#include <glm/glm.hpp>
+#include "R3.h"
+#include "BV.h"
+#include "BenchUtil.h"
+#include "Color.h"
+#include "Utils.h"
+#include "Voxel.h"
+#include "VoxelCloud.h"
+
+/*******************************************************************************
+ * Shadow march micro-benchmark
+ *
+ * Times Q() against the recursive shadow march it replaced on shadow rays
+ * cast from the center of random non-empty voxels of a cloud toward a light.
+ *
+ * USAGE: ShadowBench [grid size = 100] [step = 0.005] [rays = 20000]
+ ******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * The original shadow march: one recursive call and one exp() per step
+ */
+static float recursiveQ(const VoxelBuffer& vb
+                       ,float kappa
+                       ,float step
+                       ,int iterations
+                       ,const P& X
+                       ,const V& N)
+{
+    int i = -1;
+    int j = -1;
+    int k = -1;
+
+    if (!vb.positionToIndex(X, i, j, k) || iterations <= 0) {
+        return 1.0f;
+    }
+
+    return exp(-kappa * step * vb(i, j, k)) *
+           recursiveQ(vb, kappa, step, iterations - 1, X + N, N);
+}
+
+/**
+ * Runs f over every ray, returning the average time per call in nanoseconds
+ */
+template<typename F> double timeRays(const vector<ShadowRay>& rays, vector<float>& results, F f)
+{
+    auto start = Clock::now();
+
+    for (size_t r=0; r<rays.size(); r++) {
+        results[r] = f(rays[r]);
+    }
+
+    double ns = chrono::duration<double, nano>(Clock::now() - start).count();
+
+    return ns / static_cast<double>(rays.size());
+}
+
+static float maxError(const vector<float>& a, const vector<float>& b)
+{
+    float error = 0.0f;
+
+    for (size_t r=0; r<a.size(); r++) {
+        error = std::max(error, std::abs(a[r] - b[r]));
+    }
+
+    return error;
+}
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int size   = argc > 1 ? atoi(argv[1]) : 100;
+    float step = argc > 2 ? static_cast<float>(atof(argv[2])) : 0.005f;
+    int count  = argc > 3 ? atoi(argv[3]) : 20000;
+
+    BoundingBox bounds = BoundingBox::fromCenter(P(0.0f, 0.0f, 0.0f), 0.5f);
+    VoxelCloud cloud(0.5f, 4.0f, ivec3(size, size, size), bounds, Color::WHITE, 1337, 4, 2.0f, 0.5f);
+    P light(3.0f, 1.0f, 3.0f);
+
+    // Shadow rays from the centers of random non-empty voxels, set up the
+    // same way rayMarch() does:
+    mt19937 rng(1337);
+    uniform_int_distribution<int> pick(0, size - 1);
+    vector<ShadowRay> rays;
+    float offset = (2.0f * step) + MARCH_EPSILON;
+
+    while (static_cast<int>(rays.size()) < count) {
+
+        int i = pick(rng), j = pick(rng), k = pick(rng);
+
+        if (cloud(i, j, k) <= 0.0f) {
+            continue;
+        }
+
+        P center;
+        ShadowRay ray;
+        cloud.center(i, j, k, center);
+        ray.iterations = traverse(step, offset, center, light, ray.X, ray.N);
+        rays.push_back(ray);
+    }
+
+    vector<float> reference(rays.size()), flat(rays.size()), early(rays.size());
+
+    double tRecursive = timeRays(rays, reference, [&](const ShadowRay& r) {
+        return recursiveQ(cloud, KAPPA, step, r.iterations, r.X, r.N);
+    });
+    double tFlat = timeRays(rays, flat, [&](const ShadowRay& r) {
+        return Q(cloud, KAPPA, step, r.iterations, r.X, r.N, 0.0f);
+    });
+    double tEarly = timeRays(rays, early, [&](const ShadowRay& r) {
+        return Q(cloud, KAPPA, step, r.iterations, r.X, r.N, 1.0e-3f);
+    });
+
+    cout << "Shadow march: " << size << "^3 grid, step " << step << ", " << rays.size() << " rays" << endl
+         << fixed << setprecision(1)
+         << "  recursive         " << tRecursive << " ns/call" << endl
+         << "  iterative         " << tFlat  << " ns/call (" << setprecision(2) << tRecursive / tFlat  << "x)"
+                                   << ", max error " << scientific << maxError(reference, flat) << endl
+         << fixed << setprecision(1)
+         << "  iterative, 1e-3   " << tEarly << " ns/call (" << setprecision(2) << tRecursive / tEarly << "x)"
+                                   << ", max error " << scientific << maxError(reference, early) << endl;
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "R3.h"
+#include "BV.h"
+#include "BenchUtil.h"
+#include "Color.h"
+#include "Context.h"
+#include "Ray.h"
+#include "StreamedVolume.h"
+#include "VolumeFile.h"
+#include "Voxel.h"
+
+/*******************************************************************************
+ * Brick streaming benchmark
+ *
+ * Saves a procedural volume as a bricked volume file, then marches the same
+ * rays through it mapped whole and streamed through brick caches of shrinking
+ * size, down to the smallest the render threads allow. For every cache it
+ * reports the time per ray, the hit rate, evictions and prefetches, and the
+ * largest difference in transmittance from the mapped volume, which should
+ * be 0.
+ *
+ * USAGE: StreamBench [rays = 20000] [grid size = 256] [file = StreamBench.vol]
+ ******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+/******************************************************************************/
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int count       = argc > 1 ? atoi(argv[1]) : 20000;
+    int size        = argc > 2 ? atoi(argv[2]) : 256;
+    string filename = argc > 3 ? string(argv[3]) : string("StreamBench.vol");
+
+    BoundingBox bounds = BoundingBox::fromCenter(P(0.0f, 0.0f, 0.0f), 0.5f);
+
+    {
+        VoxelBuffer vb(ivec3(size, size, size), bounds, Color::WHITE);
+        fill(vb, size);
+        vb.setDimensions(ivec3(size, size, size));
+        vb.setLayout(LAYOUT_BRICKED);
+
+        ofstream out(filename.c_str(), ios::binary);
+        vb.save(out, "");
+    }
+
+    // Rays from random points around the volume through random points in it:
+    mt19937 rng(1337);
+    vector<Ray> rays;
+
+    while (static_cast<int>(rays.size()) < count) {
+        rays.push_back(randomRay(rng));
+    }
+
+    RenderScene scene;
+    RenderContext context(1.0f / static_cast<float>(size), scene);
+    context.setInterpolation(true);
+    context.setCutoff(0.0f);
+
+    auto file    = make_shared<VolumeFile>(filename);
+    size_t bytes = static_cast<size_t>(file->getHeader().data.bytes);
+
+    cout << "Streaming: " << size << "^3 grid, " << (bytes >> 20) << " MB of bricks, " << count << " rays" << endl;
+
+    // Mapped whole:
+    VoxelBuffer mapped(file, Color::WHITE);
+    mapped.prepare(context);
+
+    vector<float> expected(rays.size());
+    auto start = Clock::now();
+
+    for (size_t r=0; r<rays.size(); r++) {
+        Hit hit;
+        mapped.intersects(rays[r], context, hit);
+        expected[r] = hit.transmittance;
+    }
+
+    double ns = chrono::duration<double, nano>(Clock::now() - start).count() / static_cast<double>(rays.size());
+
+    cout << fixed << setprecision(1)
+         << "  mapped    " << setw(10) << ns << " ns/ray" << endl;
+
+    // Streamed, with a quarter as much memory every time:
+    for (size_t budget = bytes; ; budget /= 4) {
+
+        StreamedVolume streamed(file, Color::WHITE, budget);
+        streamed.prepare(context);
+
+        float maxError = 0.0f;
+        start          = Clock::now();
+
+        for (size_t r=0; r<rays.size(); r++) {
+            Hit hit;
+            streamed.intersects(rays[r], context, hit);
+            maxError = std::max(maxError, std::abs(hit.transmittance - expected[r]));
+        }
+
+        ns = chrono::duration<double, nano>(Clock::now() - start).count() / static_cast<double>(rays.size());
+
+        BrickCacheStats stats = streamed.getCacheStats();
+        long long requests    = stats.hits + stats.misses;
+
+        cout << fixed << setprecision(1)
+             << "  " << setw(6) << ((static_cast<size_t>(stats.capacity) * BRICK_VOXELS * sizeof(float)) >> 10) << " KB"
+             << setw(10) << ns << " ns/ray"
+             << ", hits " << setw(5) << (requests > 0 ? (100.0 * stats.hits) / requests : 0.0) << "%"
+             << ", " << stats.evictions << " evictions"
+             << ", " << stats.prefetches << " prefetched"
+             << scientific << setprecision(2)
+             << ", T max error " << maxError
+             << endl;
+
+        // Down to the smallest cache the threads can have:
+        if (static_cast<size_t>(stats.capacity) * BRICK_VOXELS * sizeof(float) > budget) {
+            break;
+        }
+    }
+
+    remove(filename.c_str());
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include "AdaptiveMarch.h"
+#include "Scheduler.h"
+#include "Utils.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace Utils;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * Picks a step length for every macrocell from the densest voxel and the
+ * steepest density gradient in and around it, the gradient being the largest
+ * jump between neighboring voxels per unit of length. A step of length h is
+ * off by about kappa * g * h^2 / 2 in optical depth where density changes by
+ * g per unit length, and by about (kappa * d * h)^2 / 2 in the light it
+ * scatters where density is d, since lighting falls off at that rate too.
+ * Each cell gets the longest step that keeps both under tolerance. Steps run
+ * from ADAPTIVE_MIN_STEP of a voxel, so the densest cells can't take more
+ * samples than the tolerance is worth, up to one voxel, so no voxel is
+ * stepped over
+ */
+AdaptiveMarch::AdaptiveMarch(const VoxelBuffer& vb, float tolerance) :
+    macrocellDim(vb.getMacrocellDimensions())
+{
+    assert(vb.hasMacrocells());
+
+    float maxStep = vb.voxelSize();
+    float minStep = maxStep * ADAPTIVE_MIN_STEP;
+    int mx        = this->macrocellDim.x;
+    int my        = this->macrocellDim.y;
+    int count     = mx * my * this->macrocellDim.z;
+    ivec3 dim     = vb.getDimensions();
+
+    this->steps.resize(count);
+
+    parallelFor(count, 1, [&](int begin, int end) {
+
+        for (int c=begin; c<end; c++) {
+
+            ivec3 cell(c % mx, (c / mx) % my, c / (mx * my));
+            float densest = vb.getMacrocell(cell.x * MACROCELL_SIZE, cell.y * MACROCELL_SIZE, cell.z * MACROCELL_SIZE).maxDensity;
+
+            if (densest <= 0.0f) {
+                this->steps[c] = maxStep;
+                continue;
+            }
+
+            // Neighbors off the grid are in the apron:
+            ivec3 lo   = (cell * MACROCELL_SIZE) - 1;
+            ivec3 hi   = glm::min((cell + 1) * MACROCELL_SIZE, dim);
+            float jump = 0.0f;
+
+            for (int k=lo.z; k<hi.z; k++) {
+                for (int j=lo.y; j<hi.y; j++) {
+                    for (int i=lo.x; i<hi.x; i++) {
+                        float d = vb(i, j, k);
+                        jump = std::max(jump, std::abs(vb(i + 1, j, k) - d));
+                        jump = std::max(jump, std::abs(vb(i, j + 1, k) - d));
+                        jump = std::max(jump, std::abs(vb(i, j, k + 1) - d));
+                    }
+                }
+            }
+
+            float gradient = jump / maxStep;
+            float step     = std::sqrt(2.0f * tolerance) / (KAPPA * densest);
+
+            if (gradient > 0.0f) {
+                step = std::min(step, std::sqrt((2.0f * tolerance) / (KAPPA * gradient)));
+            }
+
+            this->steps[c] = std::min(std::max(step, minStep), maxStep);
+        }
+    });
+}
+
+float AdaptiveMarch::firstStep(const VoxelBuffer& vb, const P& X) const
+{
+    int i = -1;
+    int j = -1;
+    int k = -1;
+
+    return vb.positionToIndex(X, i, j, k) ? this->step(i, j, k) : 0.0f;
+}
+
+/**
+ * Adaptive step at distance s along a march of the given length that has
+ * taken the given number of samples: the cell's own step, stretched once the
+ * samples left to ADAPTIVE_MAX_SAMPLES would not cover the rest of the march
+ */
+static inline float budgetStep(float step, float s, float distance, int samples)
+{
+    float rest = distance - s;
+    float left = static_cast<float>(std::max(ADAPTIVE_MAX_SAMPLES - samples, 1));
+
+    return rest > step * left ? rest / left : step;
+}
+
+/**
+ * Transmittance from X towards the point to, or to where that path leaves
+ * the volume if sooner, marched with the adaptive steps: long through smooth
+ * regions, short through ones whose density changes quickly, and at most
+ * ADAPTIVE_MAX_SAMPLES of them. Empty macrocells are skipped, and if
+ * epsilon > 0 the march stops as soon as the transmittance is known to be
+ * below epsilon. jitter moves the first sample along by that fraction of
+ * the first step
+ */
+float AdaptiveMarch::transmittance(const VoxelBuffer& vb
+                                  ,const P& X
+                                  ,const P& to
+                                  ,float jitter
+                                  ,float epsilon) const
+{
+    float kappa    = KAPPA;
+    V N            = to - X;
+    float distance = glm::length(N);
+    float tau      = 0.0f;
+    int samples    = 0;
+
+    if (distance <= 0.0f) {
+        return 1.0f;
+    }
+
+    N /= distance;
+
+    auto& dim = vb.getDimensions();
+    vec3 G    = vb.positionToGrid(X);
+    vec3 dG   = vb.directionToGrid(N);
+
+    // exp(-kappa * tau) < epsilon <=> tau > maxTau
+    float maxTau = epsilon > 0.0f
+        ? -log(epsilon) / kappa
+        : numeric_limits<float>::infinity();
+
+    for (float s=MARCH_EPSILON + ((2.0f + jitter) * this->firstStep(vb, X)); s<distance; ) {
+
+        int i = -1;
+        int j = -1;
+        int k = -1;
+
+        if (!vb.positionToIndex(X + (N * s), i, j, k)) {
+            break;
+        }
+
+        float step = budgetStep(this->step(i, j, k), s, distance, samples);
+        vec3 Gs    = G + (dG * s);
+        vec3 dGs   = dG * step;
+        int skip   = vb.emptySteps(i, j, k, Gs, dGs);
+
+        if (skip > 0) {
+            s += step * static_cast<float>(skip);
+            continue;
+        }
+
+        // The step holds until the ray leaves the macrocell, so the samples
+        // in it are taken the way Q() takes them:
+        int run = std::min(vb.cellSteps(i, j, k, Gs, dGs), static_cast<int>(ceil((distance - s) / step)));
+
+        for (int n=0; n<run; n++, Gs += dGs) {
+
+            i = static_cast<int>(Gs.x);
+            j = static_cast<int>(Gs.y);
+            k = static_cast<int>(Gs.z);
+
+            if (i < 0 || i >= dim.x || j < 0 || j >= dim.y || k < 0 || k >= dim.z) {
+                return exp(-kappa * tau);
+            }
+
+            tau += vb(i, j, k) * step;
+
+            if (tau > maxTau) {
+                return exp(-kappa * tau);
+            }
+        }
+
+        samples += run;
+        s       += step * static_cast<float>(run);
+    }
+
+    return exp(-kappa * tau);
+}
+
+float AdaptiveMarch::shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const
+{
+    return this->transmittance(vb, X, to, jitter, epsilon);
+}
+
+/**
+ * Same as FixedStepKernel, with the step length picked per macrocell in place
+ * of the fixed step, and at most ADAPTIVE_MAX_SAMPLES samples
+ */
+typedef struct AdaptiveKernel
+{
+    template<bool Interpolate, typename Shading, int Lights>
+    static RayMarch march(const MarchParams& params
+                         ,const VoxelBuffer& vb
+                         ,const P& start
+                         ,const P& end)
+    {
+        auto& policy     = static_cast<const AdaptiveMarch&>(*params.policy);
+        float kappa      = KAPPA;
+        float T          = 1.0f;
+        int samples      = 0;
+        int samplesSaved = 0;
+        float accum[3]   = { 0.0f, 0.0f, 0.0f };
+        V N              = end - start;
+        float distance   = glm::length(N);
+
+        if (distance <= 0.0f) {
+            return RayMarch(Color(0.0f, 0.0f, 0.0f), T);
+        }
+
+        N /= distance;
+
+        vec3 G0 = vb.positionToGrid(start);
+        vec3 dG = vb.directionToGrid(N);
+
+        for (float s=MARCH_EPSILON + (params.jitter * policy.firstStep(vb, start)); s<distance; ) {
+
+            P X = start + (N * s);
+
+            int vi = -1;
+            int vj = -1;
+            int vk = -1;
+
+            if (!vb.positionToIndex(X, vi, vj, vk)) {
+                break;
+            }
+
+            float step = budgetStep(policy.step(vi, vj, vk), s, distance, samples);
+            int skip   = vb.emptySteps(vi, vj, vk, G0 + (dG * s), dG * step);
+
+            if (skip > 0) {
+                s += step * static_cast<float>(skip);
+                continue;
+            }
+
+            float density     = Interpolate ? vb.getInterpolatedDensity(X) : vb(vi, vj, vk);
+            float deltaT      = exp(-kappa * step * density);
+            float attenuation = (1.0f - deltaT) / kappa;
+
+            T *= deltaT;
+
+            typename Shading::Sample material = Shading::at(params, X);
+
+            for (int k=0; k<Lights; k++) {
+
+                float lightT = vb.light(k, vi, vj, vk);
+
+                if (lightT < 0.0f) {
+                    P center;
+                    vb.center(X, center);
+                    lightT = policy.transmittance(vb, center, params.lightPosition[k], params.context->getJitter(vi, vj, vk), params.shadowEpsilon);
+                }
+
+                const Color& c = Shading::light(params, material, k);
+                accum[0] = std::min(accum[0] + (((c.fR() * attenuation) * T) * lightT), 1.0f);
+                accum[1] = std::min(accum[1] + (((c.fG() * attenuation) * T) * lightT), 1.0f);
+                accum[2] = std::min(accum[2] + (((c.fB() * attenuation) * T) * lightT), 1.0f);
+            }
+
+            samples++;
+            s += step;
+
+            if (T < params.cutoff) {
+
+                if (params.roulette && unitHash(X, samples) * params.cutoff < T) {
+                    T = params.cutoff;
+                    continue;
+                }
+
+                if (params.roulette) {
+                    T = 0.0f;
+                }
+
+                // Steps left, had they all been as long as this one:
+                samplesSaved = static_cast<int>(std::max(distance - s, 0.0f) / step);
+                break;
+            }
+        }
+
+        return RayMarch(Color(accum[0], accum[1], accum[2]), T, samples, samplesSaved);
+    }
+
+} AdaptiveKernel;
+
+MarchKernel AdaptiveMarch::kernel(bool interpolate, bool textured, int lights) const
+{
+    return composeKernel<AdaptiveKernel>(interpolate, textured, lights);
+}
@@ -0,0 +1,56 @@
+#ifndef _ADAPTIVE_MARCH_H
+#define _ADAPTIVE_MARCH_H
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "MarchPolicy.h"
+#include "Voxel.h"
+
+/******************************************************************************/
+
+// Most samples an adaptive march takes along one ray. Past that, steps
+// stretch to cover what is left of the ray in the samples remaining
+#define ADAPTIVE_MAX_SAMPLES 1024
+
+// Shortest adaptive step, as a fraction of a voxel
+#define ADAPTIVE_MIN_STEP (1.0f / 16.0f)
+
+/*******************************************************************************
+ * Adaptive steps: a step length for every macrocell of a buffer, derived from
+ * how quickly density changes across it, so rays and shadow rays stride
+ * through smooth regions and slow down where density changes quickly. Steps
+ * run from ADAPTIVE_MIN_STEP of a voxel up to a whole one, whatever the
+ * context's fixed step. Needs
+ * the buffer's macrocells, which also bound the steps to their cells
+ ******************************************************************************/
+
+class AdaptiveMarch : public MarchPolicy
+{
+    protected:
+        std::vector<float> steps;
+        glm::ivec3 macrocellDim;
+
+    public:
+        AdaptiveMarch(const VoxelBuffer& vb, float tolerance);
+
+        // Step length at voxel (i,j,k)
+        float step(int i, int j, int k) const
+        {
+            return this->steps[(i / MACROCELL_SIZE) +
+                               (j / MACROCELL_SIZE) * this->macrocellDim.x +
+                               (k / MACROCELL_SIZE) * this->macrocellDim.x * this->macrocellDim.y];
+        }
+
+        // Step length at X, or 0 off the grid
+        float firstStep(const VoxelBuffer& vb, const P& X) const;
+
+        float transmittance(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const;
+
+        virtual MarchKernel kernel(bool interpolate, bool textured, int lights) const;
+        virtual float shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const;
+
+        std::string getTypeName() const { return "AdaptiveMarch"; };
+};
+
+#endif
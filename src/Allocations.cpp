@@ -0,0 +1,67 @@
+#include <cstdlib>
+#include <new>
+#include "Allocations.h"
+
+/******************************************************************************/
+
+#ifdef COUNT_ALLOCATIONS
+
+// Plain integers, so the counters need no construction and are safe to touch
+// from inside operator new itself:
+static thread_local long long allocationCount   = 0;
+static thread_local long long deallocationCount = 0;
+
+static void* countedAllocate(std::size_t size)
+{
+    allocationCount++;
+
+    void* p = std::malloc(size == 0 ? 1 : size);
+
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+static void countedFree(void* p)
+{
+    if (p != nullptr) {
+        deallocationCount++;
+        std::free(p);
+    }
+}
+
+void* operator new(std::size_t size)                                  { return countedAllocate(size); }
+void* operator new[](std::size_t size)                                { return countedAllocate(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    allocationCount++;
+    return std::malloc(size == 0 ? 1 : size);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    allocationCount++;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* p) noexcept                                { countedFree(p); }
+void operator delete[](void* p) noexcept                              { countedFree(p); }
+void operator delete(void* p, std::size_t) noexcept                   { countedFree(p); }
+void operator delete[](void* p, std::size_t) noexcept                 { countedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept         { countedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept       { countedFree(p); }
+
+bool Allocations::enabled()        { return true; }
+long long Allocations::allocated() { return allocationCount; }
+long long Allocations::freed()     { return deallocationCount; }
+
+#else
+
+bool Allocations::enabled()        { return false; }
+long long Allocations::allocated() { return 0; }
+long long Allocations::freed()     { return 0; }
+
+#endif
+
+/******************************************************************************/
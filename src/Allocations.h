@@ -0,0 +1,28 @@
+#ifndef _ALLOCATIONS_H
+#define _ALLOCATIONS_H
+
+/*******************************************************************************
+ * Heap allocation counting
+ *
+ * Built with COUNT_ALLOCATIONS defined (see CMakeLists.txt), the global
+ * operator new and delete are replaced by versions that count every call
+ * made on the calling thread. Differencing the counts around a block of code
+ * gives the number of allocations it made, which is how render() checks that
+ * marching rays never touches the heap.
+ *
+ * Without COUNT_ALLOCATIONS the counts are always 0
+ ******************************************************************************/
+
+namespace Allocations {
+
+    // True if this build counts allocations
+    extern bool enabled();
+
+    // Number of calls to operator new made so far by the calling thread
+    extern long long allocated();
+
+    // Number of calls to operator delete made so far by the calling thread
+    extern long long freed();
+}
+
+#endif
@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <cfloat>
+#include <limits>
+#include <mutex>
+#include "BVH.h"
+#include "Packet.h"
+#include "Scheduler.h"
+
+/******************************************************************************/
+
+using namespace std;
+
+/*******************************************************************************
+ * Build helpers
+ ******************************************************************************/
+
+/**
+ * An axis-aligned box and the number of objects that went into it
+ */
+typedef struct Bin
+{
+    int count;
+    float lo[3], hi[3];
+
+    Bin() : count(0)
+    {
+        for (int a=0; a<3; a++) {
+            this->lo[a] = numeric_limits<float>::max();
+            this->hi[a] = -numeric_limits<float>::max();
+        }
+    };
+
+    void add(const float* _lo, const float* _hi)
+    {
+        this->count++;
+        for (int a=0; a<3; a++) {
+            this->lo[a] = std::min(this->lo[a], _lo[a]);
+            this->hi[a] = std::max(this->hi[a], _hi[a]);
+        }
+    }
+
+    void add(const Bin& other)
+    {
+        this->count += other.count;
+        for (int a=0; a<3; a++) {
+            this->lo[a] = std::min(this->lo[a], other.lo[a]);
+            this->hi[a] = std::max(this->hi[a], other.hi[a]);
+        }
+    }
+
+    float area() const
+    {
+        if (this->count == 0) {
+            return 0.0f;
+        }
+
+        float dx = this->hi[0] - this->lo[0];
+        float dy = this->hi[1] - this->lo[1];
+        float dz = this->hi[2] - this->lo[2];
+
+        return 2.0f * ((dx * dy) + (dy * dz) + (dz * dx));
+    }
+
+} Bin;
+
+/**
+ * Runs f(begin, end) over [first, first + count), in parallel if there are
+ * enough objects to be worth it. f accumulates into the Bins of its own
+ * block, which are then merged into the n bins given
+ */
+template<typename F> static void binObjects(int first, int count, Bin* bins, int n, F f)
+{
+    if (count < BVH_PARALLEL_BIN) {
+        f(first, first + count, bins);
+        return;
+    }
+
+    mutex lock;
+    int grain = std::max(BVH_PARALLEL_BIN / 4, count / (4 * TileScheduler::defaultThreadCount()));
+
+    parallelFor(count, grain, [&](int begin, int end) {
+
+        vector<Bin> local(n);
+        f(first + begin, first + end, local.data());
+
+        lock_guard<mutex> guard(lock);
+        for (int b=0; b<n; b++) {
+            bins[b].add(local[b]);
+        }
+    });
+}
+
+/**
+ * Bin of a centroid along one axis, given the centroid bounds on that axis
+ */
+static inline int binOf(float c, float lo, float scale)
+{
+    return std::min(BVH_BINS - 1, static_cast<int>((c - lo) * scale));
+}
+
+/*******************************************************************************
+ * BVH
+ ******************************************************************************/
+
+BVH::BVH() :
+    depth(0)
+{
+
+}
+
+BVH::BVH(const vector<BoundingBox>& bounds) :
+    depth(0)
+{
+    int count = static_cast<int>(bounds.size());
+
+    this->index.resize(count);
+    this->objectLo.resize(3 * count);
+    this->objectHi.resize(3 * count);
+
+    for (int o=0; o<count; o++) {
+
+        auto& p1 = bounds[o].getP1();
+        auto& p2 = bounds[o].getP2();
+
+        this->index[o] = o;
+
+        for (int a=0; a<3; a++) {
+            this->objectLo[(3 * o) + a] = std::min(p1.p[a], p2.p[a]);
+            this->objectHi[(3 * o) + a] = std::max(p1.p[a], p2.p[a]);
+        }
+    }
+
+    if (count > 0) {
+        this->nodes.reserve(2 * count);
+        this->build(0, count, 1);
+    }
+}
+
+/**
+ * Builds the subtree over index[first, first + count) and returns the index
+ * of its root node
+ */
+int BVH::build(int first, int count, int level)
+{
+    int node = static_cast<int>(this->nodes.size());
+
+    this->nodes.push_back(BVHNode());
+    this->depth = std::max(this->depth, level);
+
+    const float* lo = this->objectLo.data();
+    const float* hi = this->objectHi.data();
+
+    // Bounds of the objects, and of their centroids:
+    Bin extent[2];
+
+    binObjects(first, count, extent, 2, [&](int begin, int end, Bin* acc) {
+        for (int i=begin; i<end; i++) {
+            int o = 3 * this->index[i];
+            float c[3] = { 0.5f * (lo[o] + hi[o]), 0.5f * (lo[o + 1] + hi[o + 1]), 0.5f * (lo[o + 2] + hi[o + 2]) };
+            acc[0].add(lo + o, hi + o);
+            acc[1].add(c, c);
+        }
+    });
+
+    Bin& box       = extent[0];
+    Bin& centroids = extent[1];
+
+    for (int a=0; a<3; a++) {
+        this->nodes[node].lo[a] = box.lo[a];
+        this->nodes[node].hi[a] = box.hi[a];
+    }
+
+    this->nodes[node].offset = first;
+    this->nodes[node].count  = count;
+
+    if (count <= 1 || level >= BVH_MAX_DEPTH) {
+        return node;
+    }
+
+    // Bin the centroids along every axis they spread out over, and find the
+    // split with the lowest surface area heuristic cost:
+    float scale[3];
+    Bin bins[3 * BVH_BINS];
+
+    for (int a=0; a<3; a++) {
+        float width = centroids.hi[a] - centroids.lo[a];
+        scale[a]    = width > 0.0f ? static_cast<float>(BVH_BINS) / width : 0.0f;
+    }
+
+    binObjects(first, count, bins, 3 * BVH_BINS, [&](int begin, int end, Bin* acc) {
+        for (int i=begin; i<end; i++) {
+            int o = 3 * this->index[i];
+            for (int a=0; a<3; a++) {
+                if (scale[a] > 0.0f) {
+                    float c = 0.5f * (lo[o + a] + hi[o + a]);
+                    acc[(a * BVH_BINS) + binOf(c, centroids.lo[a], scale[a])].add(lo + o, hi + o);
+                }
+            }
+        }
+    });
+
+    int bestAxis   = -1;
+    int bestBin    = -1;
+    float bestCost = numeric_limits<float>::max();
+
+    for (int a=0; a<3; a++) {
+
+        if (scale[a] <= 0.0f) {
+            continue;
+        }
+
+        Bin* axis = bins + (a * BVH_BINS);
+        float rightCost[BVH_BINS];
+        Bin right;
+
+        for (int b=BVH_BINS-1; b>0; b--) {
+            right.add(axis[b]);
+            rightCost[b] = right.area() * static_cast<float>(right.count);
+        }
+
+        Bin left;
+
+        for (int b=0; b<BVH_BINS-1; b++) {
+
+            left.add(axis[b]);
+
+            float cost = (left.area() * static_cast<float>(left.count)) + rightCost[b + 1];
+
+            if (left.count > 0 && left.count < count && cost < bestCost) {
+                bestCost = cost;
+                bestAxis = a;
+                bestBin  = b;
+            }
+        }
+    }
+
+    // Splitting costs one more box test than a leaf. Small nodes stay leaves
+    // unless the split is expected to pay for that:
+    float leafCost = box.area() * static_cast<float>(count);
+
+    if (count <= BVH_MAX_LEAF && (bestAxis < 0 || box.area() + bestCost >= leafCost)) {
+        return node;
+    }
+
+    int mid = first + (count / 2);
+
+    if (bestAxis >= 0) {
+        auto split = std::partition(this->index.begin() + first
+                                   ,this->index.begin() + first + count
+                                   ,[&](int o) {
+            float c = 0.5f * (lo[(3 * o) + bestAxis] + hi[(3 * o) + bestAxis]);
+            return binOf(c, centroids.lo[bestAxis], scale[bestAxis]) <= bestBin;
+        });
+        mid = static_cast<int>(split - this->index.begin());
+    }
+
+    // Every centroid in the same place; any split is as good as another:
+    if (mid == first || mid == first + count) {
+        mid = first + (count / 2);
+    }
+
+    this->build(first, mid - first, level + 1);
+
+    int second = this->build(mid, first + count - mid, level + 1);
+
+    this->nodes[node].offset = second;
+    this->nodes[node].count  = 0;
+
+    return node;
+}
+
+/*******************************************************************************
+ * Queries
+ ******************************************************************************/
+
+/**
+ * Slab test; the same arithmetic as BoundingBox::isHit()
+ */
+static inline bool slab(const float* lo
+                       ,const float* hi
+                       ,const float o[3]
+                       ,const float d[3]
+                       ,float& tNear
+                       ,float& tFar)
+{
+    float x1 = (lo[0] - o[0]) / d[0];
+    float x2 = (hi[0] - o[0]) / d[0];
+    float y1 = (lo[1] - o[1]) / d[1];
+    float y2 = (hi[1] - o[1]) / d[1];
+    float z1 = (lo[2] - o[2]) / d[2];
+    float z2 = (hi[2] - o[2]) / d[2];
+
+    if (x1 > x2) {
+        swap(x1, x2);
+    }
+    if (y1 > y2) {
+        swap(y1, y2);
+    }
+    if (z1 > z2) {
+        swap(z1, z2);
+    }
+
+    tNear = max(x1, max(y1, z1));
+    tFar  = min(x2, min(y2, z2));
+
+    return !(tNear > tFar || tFar < 0);
+}
+
+static bool closerHit(const BVHHit& a, const BVHHit& b)
+{
+    return a.tNear < b.tNear || (a.tNear == b.tNear && a.object < b.object);
+}
+
+int BVH::intersect(const Ray& ray, BVHHit* hits) const
+{
+    if (this->nodes.empty()) {
+        return 0;
+    }
+
+    float o[3], d[3];
+
+    // Zero direction components are nudged to FLT_EPSILON, as in isHit():
+    for (int a=0; a<3; a++) {
+        o[a] = ray.origin.p[a];
+        d[a] = ray.direction[a] == 0.0f ? FLT_EPSILON : ray.direction[a];
+    }
+
+    int stack[BVH_MAX_DEPTH + 1];
+    int top   = 0;
+    int found = 0;
+
+    stack[top++] = 0;
+
+    while (top > 0) {
+
+        const BVHNode& node = this->nodes[stack[--top]];
+        float tNear, tFar;
+
+        if (!slab(node.lo, node.hi, o, d, tNear, tFar)) {
+            continue;
+        }
+
+        if (node.count == 0) {
+            stack[top++] = node.offset;
+            stack[top++] = static_cast<int>(&node - this->nodes.data()) + 1;
+            continue;
+        }
+
+        for (int i=node.offset; i<node.offset+node.count; i++) {
+
+            int object = this->index[i];
+
+            if (slab(&this->objectLo[3 * object], &this->objectHi[3 * object], o, d, tNear, tFar)) {
+                BVHHit& hit = hits[found++];
+                hit.object  = object;
+                hit.tNear   = tNear;
+                hit.tFar    = tFar;
+                hit.mask    = 1;
+            }
+        }
+    }
+
+    sort(hits, hits + found, closerHit);
+
+    return found;
+}
+
+int BVH::intersect(const RayPacket& packet, int mask, BVHHit* hits) const
+{
+    if (this->nodes.empty() || mask == 0) {
+        return 0;
+    }
+
+    int stack[BVH_MAX_DEPTH + 1];
+    int top   = 0;
+    int found = 0;
+
+    stack[top++] = 0;
+
+    while (top > 0) {
+
+        const BVHNode& node = this->nodes[stack[--top]];
+        __m128 tNear, tFar;
+
+        if (!(intersectBounds(node.lo, node.hi, packet, tNear, tFar) & mask)) {
+            continue;
+        }
+
+        if (node.count == 0) {
+            stack[top++] = node.offset;
+            stack[top++] = static_cast<int>(&node - this->nodes.data()) + 1;
+            continue;
+        }
+
+        for (int i=node.offset; i<node.offset+node.count; i++) {
+
+            int object = this->index[i];
+            int lanes  = mask & intersectBounds(&this->objectLo[3 * object], &this->objectHi[3 * object], packet, tNear, tFar);
+
+            if (!lanes) {
+                continue;
+            }
+
+            alignas(16) float near[PACKET_SIZE];
+            alignas(16) float far[PACKET_SIZE];
+            _mm_store_ps(near, tNear);
+            _mm_store_ps(far, tFar);
+
+            BVHHit& hit = hits[found++];
+            hit.object  = object;
+            hit.tNear   = numeric_limits<float>::max();
+            hit.tFar    = -numeric_limits<float>::max();
+            hit.mask    = lanes;
+
+            for (int l=0; l<PACKET_SIZE; l++) {
+                if (lanes & (1 << l)) {
+                    hit.tNear = std::min(hit.tNear, near[l]);
+                    hit.tFar  = std::max(hit.tFar, far[l]);
+                }
+            }
+        }
+    }
+
+    sort(hits, hits + found, closerHit);
+
+    return found;
+}
+
+/******************************************************************************/
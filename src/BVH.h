@@ -0,0 +1,94 @@
+#ifndef _BVH_H
+#define _BVH_H
+
+#include <vector>
+#include "BV.h"
+#include "Ray.h"
+
+/******************************************************************************/
+
+// Number of SAH bins tried along each axis when splitting a node
+#define BVH_BINS 16
+
+// Most objects a leaf will hold
+#define BVH_MAX_LEAF 4
+
+// Deepest the tree can get; bounds the traversal stack
+#define BVH_MAX_DEPTH 64
+
+// Nodes with at least this many objects are binned in parallel
+#define BVH_PARALLEL_BIN 4096
+
+// Forward declarations:
+class RayPacket;
+
+/*******************************************************************************
+ * An object whose bounding box a ray (or, for packets, at least one lane of
+ * the packet) passes through, and the parametric distances along the ray at
+ * which it enters and leaves the box
+ ******************************************************************************/
+
+typedef struct BVHHit
+{
+    int object;  // Index of the object, as passed to the BVH
+    float tNear; // Entry distance; negative if the ray starts inside the box
+    float tFar;  // Exit distance
+    int mask;    // Lanes that pass through the box; 1 for single rays
+
+} BVHHit;
+
+/*******************************************************************************
+ * A node of the flattened tree. Nodes are laid out depth first, so an
+ * interior node's first child is the node right after it
+ ******************************************************************************/
+
+typedef struct BVHNode
+{
+    float lo[3], hi[3]; // Bounds
+    int offset;         // Leaf: first entry of the object index; interior: second child
+    int count;          // Leaf: number of objects; interior: 0
+
+} BVHNode;
+
+/*******************************************************************************
+ * Bounding volume hierarchy over the bounding boxes of a scene's objects,
+ * built with binned SAH splits.
+ *
+ * A query returns every object whose box the ray passes through, ordered by
+ * entry distance, in time proportional to the log of the number of objects
+ * rather than to the number itself. Box tests use the same arithmetic as
+ * BoundingBox::isHit(), so a ray is reported for exactly the objects whose
+ * isHit() would be true
+ ******************************************************************************/
+
+class BVH
+{
+    protected:
+        std::vector<BVHNode> nodes;
+        std::vector<int> index;     // Object indices, grouped by leaf
+        std::vector<float> objectLo;  // Object bounds, 3 floats per object
+        std::vector<float> objectHi;
+        int depth;
+
+        int build(int first, int count, int level);
+
+    public:
+        BVH();
+        BVH(const std::vector<BoundingBox>& bounds);
+
+        int getObjectCount() const { return static_cast<int>(this->index.size()); }
+        int getNodeCount() const   { return static_cast<int>(this->nodes.size()); }
+        int getDepth() const       { return this->depth; }
+
+        // Fills hits with every object the ray passes through, sorted by
+        // entry distance, and returns how many there are. hits must have
+        // room for getObjectCount() entries
+        int intersect(const Ray& ray, BVHHit* hits) const;
+
+        // Same as above for the lanes of packet in mask. An object is
+        // reported once, with the lanes that hit it and their nearest entry
+        // distance
+        int intersect(const RayPacket& packet, int mask, BVHHit* hits) const;
+};
+
+#endif
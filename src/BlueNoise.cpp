@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include "BlueNoise.h"
+
+/******************************************************************************/
+
+using namespace std;
+
+/*******************************************************************************
+ * Void-and-cluster helpers
+ *
+ * A binary pattern over the torus, and the energy of every pixel: the sum of
+ * a Gaussian centered on every set pixel. The tightest cluster is the set
+ * pixel with the most energy, the largest void the unset one with the least
+ ******************************************************************************/
+
+typedef struct Pattern
+{
+    int size;
+    vector<char> bits;
+    vector<float> energy;
+    const vector<float>* kernel; // Gaussian by toroidal offset, size^2 entries
+
+    Pattern(int _size, const vector<float>* _kernel) :
+        size(_size),
+        bits(_size * _size, 0),
+        energy(_size * _size, 0.0f),
+        kernel(_kernel)
+    { };
+
+    void set(int p, bool value)
+    {
+        float sign = value ? 1.0f : -1.0f;
+        int mask   = this->size - 1;
+        int px     = p % this->size;
+        int py     = p / this->size;
+
+        this->bits[p] = value ? 1 : 0;
+
+        for (int y=0; y<this->size; y++) {
+            const float* row = &(*this->kernel)[((y - py) & mask) * this->size];
+            float* e         = &this->energy[y * this->size];
+            for (int x=0; x<this->size; x++) {
+                e[x] += sign * row[(x - px) & mask];
+            }
+        }
+    }
+
+    int tightestCluster() const
+    {
+        int best         = -1;
+        float bestEnergy = -numeric_limits<float>::max();
+
+        for (size_t p=0; p<this->bits.size(); p++) {
+            if (this->bits[p] && this->energy[p] > bestEnergy) {
+                best       = static_cast<int>(p);
+                bestEnergy = this->energy[p];
+            }
+        }
+
+        return best;
+    }
+
+    int largestVoid() const
+    {
+        int best         = -1;
+        float bestEnergy = numeric_limits<float>::max();
+
+        for (size_t p=0; p<this->bits.size(); p++) {
+            if (!this->bits[p] && this->energy[p] < bestEnergy) {
+                best       = static_cast<int>(p);
+                bestEnergy = this->energy[p];
+            }
+        }
+
+        return best;
+    }
+
+} Pattern;
+
+/*******************************************************************************
+ * BlueNoise
+ ******************************************************************************/
+
+BlueNoise::BlueNoise() :
+    size(1)
+{
+
+}
+
+/**
+ * Builds a size x size mask; size must be a power of two. The seed picks the
+ * initial random pattern, and with it the whole mask
+ */
+BlueNoise::BlueNoise(int _size, int seed) :
+    size(_size)
+{
+    if (_size < 2 || (_size & (_size - 1)) != 0) {
+        throw runtime_error("Blue-noise mask size must be a power of two");
+    }
+
+    int n = _size * _size;
+
+    // Gaussian by toroidal offset:
+    vector<float> kernel(n);
+
+    for (int y=0; y<_size; y++) {
+        for (int x=0; x<_size; x++) {
+            float dx = static_cast<float>(std::min(x, _size - x));
+            float dy = static_cast<float>(std::min(y, _size - y));
+            kernel[(y * _size) + x] = exp(-((dx * dx) + (dy * dy)) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+    }
+
+    // Initial pattern: a tenth of the pixels, chosen at random
+    Pattern pattern(_size, &kernel);
+    mt19937 rng(static_cast<unsigned int>(seed));
+    uniform_int_distribution<int> pixel(0, n - 1);
+    int ones = std::max(1, n / 10);
+
+    for (int placed=0; placed<ones; ) {
+        int p = pixel(rng);
+        if (!pattern.bits[p]) {
+            pattern.set(p, true);
+            placed++;
+        }
+    }
+
+    // Spread it out: move the tightest cluster into the largest void until
+    // that would move a pixel back to where it came from
+    for (int iteration=0; iteration<n; iteration++) {
+
+        int cluster = pattern.tightestCluster();
+        pattern.set(cluster, false);
+
+        int hole = pattern.largestVoid();
+
+        if (hole == cluster) {
+            pattern.set(cluster, true);
+            break;
+        }
+
+        pattern.set(hole, true);
+    }
+
+    vector<int> rank(n, 0);
+    Pattern prototype = pattern;
+
+    // Ranks below the initial pattern's: take out the tightest clusters first
+    for (int r=ones-1; r>=0; r--) {
+        int cluster = pattern.tightestCluster();
+        pattern.set(cluster, false);
+        rank[cluster] = r;
+    }
+
+    // Ranks above it: fill the largest voids first
+    pattern = prototype;
+
+    for (int r=ones; r<n; r++) {
+        int hole = pattern.largestVoid();
+        pattern.set(hole, true);
+        rank[hole] = r;
+    }
+
+    this->mask.resize(n);
+
+    for (int p=0; p<n; p++) {
+        this->mask[p] = static_cast<float>(rank[p]) / static_cast<float>(n);
+    }
+}
+
+float BlueNoise::at(int i, int j, int k) const
+{
+    // Slice offsets from the R2 sequence (Roberts), whose two coordinates
+    // are the fractional parts of multiples of 1/g and 1/g^2, where g is
+    // the plastic number:
+    double u = fmod(0.7548776662466927 * static_cast<double>(k), 1.0);
+    double v = fmod(0.5698402909980532 * static_cast<double>(k), 1.0);
+
+    return this->at(i + static_cast<int>(u * this->size), j + static_cast<int>(v * this->size));
+}
+
+/******************************************************************************/
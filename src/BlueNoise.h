@@ -0,0 +1,50 @@
+#ifndef _BLUE_NOISE_H
+#define _BLUE_NOISE_H
+
+#include <vector>
+
+/******************************************************************************/
+
+// Width and height of the blue-noise mask, in pixels
+#define BLUE_NOISE_SIZE 64
+
+// Standard deviation of the Gaussian used to measure clustering, in pixels
+#define BLUE_NOISE_SIGMA 1.5f
+
+/*******************************************************************************
+ * Tileable blue-noise threshold mask, made by void-and-cluster (Ulichney).
+ *
+ * Every value in [0,1) appears once per tile, in steps of 1 / size^2, and
+ * neighboring pixels get values far apart. Used as per-pixel start offsets,
+ * it turns the banding of rays that all step in lockstep into fine,
+ * high-frequency noise. The mask only depends on its size and seed
+ ******************************************************************************/
+
+class BlueNoise
+{
+    protected:
+        int size;
+        std::vector<float> mask;
+
+        int wrap(int n) const { return ((n % this->size) + this->size) % this->size; }
+
+    public:
+        // An empty mask: every value is 0
+        BlueNoise();
+        BlueNoise(int size, int seed);
+
+        int getSize() const { return this->size; }
+
+        // Value at pixel (x,y), with the mask tiled over the plane
+        float at(int x, int y) const
+        {
+            return this->mask.empty() ? 0.0f : this->mask[(this->wrap(y) * this->size) + this->wrap(x)];
+        }
+
+        // Value at voxel (i,j,k). Each slice of k reads the mask shifted by
+        // the next point of a low-discrepancy sequence, so neighboring
+        // slices don't repeat each other
+        float at(int i, int j, int k) const;
+};
+
+#endif
@@ -0,0 +1,543 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include "BrickCache.h"
+#include "VolumeFile.h"
+
+#if defined(WINVER) || defined(_WIN32) || defined(_WIN64)
+    #define BRICK_CACHE_COPY
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+/******************************************************************************/
+
+using namespace std;
+
+/******************************************************************************/
+
+// No slot, in the table and the recently used list
+#define NO_SLOT -1
+
+/******************************************************************************/
+
+static inline int hashBrick(int brick, int mask)
+{
+    uint32_t h = static_cast<uint32_t>(brick) * 2654435761u;
+    return static_cast<int>((h ^ (h >> 16)) & static_cast<uint32_t>(mask));
+}
+
+/**
+ * Opens the volume file for reading bricks, and sets aside room for the
+ * given number of them. If that much memory can't be had, the cache makes do
+ * with half as many bricks, down to the given minimum
+ */
+BrickCache::BrickCache(shared_ptr<VolumeFile> _file, int _capacity, int minimum) :
+    file(_file),
+    descriptor(-1),
+    format(static_cast<VoxelFormat>(_file->getHeader().format)),
+    voxelBytes(0),
+    storedBricks(0),
+    capacity(std::max(_capacity, std::max(minimum, 1))),
+    tableMask(0),
+    hits(0),
+    misses(0),
+    evictions(0),
+    prefetches(0),
+    readErrors(0),
+    queueHead(0),
+    queueSize(0),
+    stopping(false)
+{
+    const VolumeHeader& header = this->file->getHeader();
+
+    if (header.layout != LAYOUT_BRICKED && header.layout != LAYOUT_SPARSE) {
+        throw runtime_error("Only volume files in a brick layout can be streamed: " + this->file->getFilename());
+    }
+
+    this->voxelBytes   = this->format == FORMAT_FLOAT ? sizeof(float) : this->format == FORMAT_UINT16 ? 2 : 1;
+    this->storedBricks = static_cast<int>(header.data.bytes / (BRICK_VOXELS * this->voxelBytes));
+    this->capacity     = std::max(1, std::min(this->capacity, this->storedBricks));
+    minimum            = std::min(std::max(minimum, 1), this->capacity);
+
+    while (true) {
+        try {
+            this->voxels.resize(static_cast<size_t>(this->capacity) * BRICK_VOXELS);
+            break;
+        } catch (const bad_alloc&) {
+            if (this->capacity <= minimum) {
+                throw;
+            }
+            this->capacity = std::max(this->capacity / 2, minimum);
+            clog << "Brick cache: out of memory, trying " << this->capacity << " bricks" << endl;
+        }
+    }
+
+    this->slotBrick.assign(this->capacity, -1);
+    this->pins.assign(this->capacity, 0);
+    this->ready.assign(this->capacity, 0);
+
+    // Every slot starts out unpinned, and so on the list:
+    this->newer.assign(this->capacity + 1, NO_SLOT);
+    this->older.assign(this->capacity + 1, NO_SLOT);
+    this->newer[this->capacity] = this->capacity;
+    this->older[this->capacity] = this->capacity;
+
+    for (int s=0; s<this->capacity; s++) {
+        this->pushNewest(s);
+    }
+
+    // At most half full, so probes stay short:
+    int tableSize = 2;
+    while (tableSize < 2 * this->capacity) {
+        tableSize *= 2;
+    }
+
+    this->tableBrick.assign(tableSize, -1);
+    this->tableSlot.assign(tableSize, NO_SLOT);
+    this->tableMask = tableSize - 1;
+
+#ifndef BRICK_CACHE_COPY
+    this->descriptor = open(this->file->getFilename().c_str(), O_RDONLY);
+
+    if (this->descriptor < 0) {
+        throw runtime_error("Couldn't open file: " + this->file->getFilename());
+    }
+#endif
+
+    this->queue.assign(PREFETCH_QUEUE, -1);
+    this->pending.assign(PREFETCH_QUEUE, -1);
+
+    // Without a thread to read ahead, bricks are still read when needed:
+    try {
+        this->prefetcher = thread(&BrickCache::prefetchLoop, this);
+    } catch (const system_error&) {
+        clog << "Brick cache: no prefetching" << endl;
+    }
+}
+
+BrickCache::~BrickCache()
+{
+    {
+        lock_guard<mutex> guard(this->queueLock);
+        this->stopping = true;
+    }
+    this->queued.notify_all();
+
+    if (this->prefetcher.joinable()) {
+        this->prefetcher.join();
+    }
+
+#ifndef BRICK_CACHE_COPY
+    if (this->descriptor >= 0) {
+        close(this->descriptor);
+    }
+#endif
+}
+
+/*******************************************************************************
+ * Bookkeeping. Everything here is called with the lock held
+ ******************************************************************************/
+
+/**
+ * Slot holding the given brick, or NO_SLOT
+ */
+int BrickCache::find(int brick) const
+{
+    for (int h = hashBrick(brick, this->tableMask); this->tableBrick[h] >= 0; h = (h + 1) & this->tableMask) {
+        if (this->tableBrick[h] == brick) {
+            return this->tableSlot[h];
+        }
+    }
+
+    return NO_SLOT;
+}
+
+void BrickCache::insert(int brick, int slot)
+{
+    int h = hashBrick(brick, this->tableMask);
+
+    while (this->tableBrick[h] >= 0) {
+        h = (h + 1) & this->tableMask;
+    }
+
+    this->tableBrick[h] = brick;
+    this->tableSlot[h]  = slot;
+}
+
+/**
+ * Removes brick from the table, moving back any entries after it that could
+ * no longer be found past the gap
+ */
+void BrickCache::erase(int brick)
+{
+    int h = hashBrick(brick, this->tableMask);
+
+    while (this->tableBrick[h] != brick) {
+        assert(this->tableBrick[h] >= 0);
+        h = (h + 1) & this->tableMask;
+    }
+
+    this->tableBrick[h] = -1;
+
+    for (int n = (h + 1) & this->tableMask; this->tableBrick[n] >= 0; n = (n + 1) & this->tableMask) {
+
+        int home = hashBrick(this->tableBrick[n], this->tableMask);
+
+        // Entry n stays put if its home lies cyclically in (h, n]:
+        bool stays = h <= n ? (home > h && home <= n) : (home > h || home <= n);
+
+        if (!stays) {
+            this->tableBrick[h] = this->tableBrick[n];
+            this->tableSlot[h]  = this->tableSlot[n];
+            this->tableBrick[n] = -1;
+            h = n;
+        }
+    }
+}
+
+void BrickCache::unlink(int slot)
+{
+    this->older[this->newer[slot]] = this->older[slot];
+    this->newer[this->older[slot]] = this->newer[slot];
+    this->newer[slot] = NO_SLOT;
+    this->older[slot] = NO_SLOT;
+}
+
+void BrickCache::pushNewest(int slot)
+{
+    int head = this->capacity;
+
+    this->older[slot]               = this->older[head];
+    this->newer[slot]               = head;
+    this->newer[this->older[head]]  = slot;
+    this->older[head]               = slot;
+}
+
+/**
+ * Takes the least recently used unpinned slot for brick, pinned once and not
+ * yet ready, or returns NO_SLOT if every slot is pinned
+ */
+int BrickCache::claim(int brick)
+{
+    int slot = this->newer[this->capacity];
+
+    if (slot == this->capacity) {
+        return NO_SLOT;
+    }
+
+    this->unlink(slot);
+
+    if (this->slotBrick[slot] >= 0) {
+        this->erase(this->slotBrick[slot]);
+        this->evictions++;
+    }
+
+    this->slotBrick[slot] = brick;
+    this->pins[slot]      = 1;
+    this->ready[slot]     = 0;
+    this->insert(brick, slot);
+
+    return slot;
+}
+
+/*******************************************************************************
+ * Reading
+ ******************************************************************************/
+
+/**
+ * Reads the given number of bytes from the file at offset, returning false
+ * on failure
+ */
+bool BrickCache::readBytes(void* out, size_t count, uint64_t offset) const
+{
+#ifdef BRICK_CACHE_COPY
+    if (offset > this->file->size() || count > this->file->size() - offset) {
+        return false;
+    }
+    memcpy(out, this->file->data() + offset, count);
+    return true;
+#else
+    uint8_t* at = static_cast<uint8_t*>(out);
+
+    while (count > 0) {
+
+        ssize_t n = pread(this->descriptor, at, count, static_cast<off_t>(offset));
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        at     += n;
+        count  -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+
+    return true;
+#endif
+}
+
+/**
+ * Reads brick into slot as densities, without the lock. A brick that can't
+ * be read is left empty rather than failing the render
+ */
+void BrickCache::read(int brick, int slot)
+{
+    const VolumeHeader& header = this->file->getHeader();
+    float* out                 = &this->voxels[static_cast<size_t>(slot) * BRICK_VOXELS];
+    size_t bytes               = static_cast<size_t>(BRICK_VOXELS) * this->voxelBytes;
+    uint64_t offset            = header.data.offset + (static_cast<uint64_t>(brick) * bytes);
+
+    if (this->format == FORMAT_FLOAT) {
+        if (!this->readBytes(out, bytes, offset)) {
+            fill(out, out + BRICK_VOXELS, 0.0f);
+            this->readErrors++;
+        }
+        return;
+    }
+
+    uint16_t codes[BRICK_VOXELS];
+
+    if (!this->readBytes(codes, bytes, offset)) {
+        fill(out, out + BRICK_VOXELS, 0.0f);
+        this->readErrors++;
+        return;
+    }
+
+    // Same arithmetic as VoxelBuffer::value(), one range at a time:
+    const uint8_t* bytesIn = reinterpret_cast<const uint8_t*>(codes);
+    const uint8_t* ranges  = this->file->at(header.ranges);
+    size_t rangeCount      = header.ranges.bytes / sizeof(QuantRange);
+    size_t current         = rangeCount;
+    QuantRange range;
+
+    for (int v=0; v<BRICK_VOXELS; v++) {
+
+        size_t r = static_cast<size_t>(((static_cast<int64_t>(brick) * BRICK_VOXELS) + v) >> header.quantShift);
+
+        if (r != current) {
+            if (r >= rangeCount) {
+                fill(out, out + BRICK_VOXELS, 0.0f);
+                this->readErrors++;
+                return;
+            }
+            memcpy(&range, ranges + (r * sizeof(QuantRange)), sizeof(QuantRange));
+            current = r;
+        }
+
+        float code = this->format == FORMAT_UINT8
+            ? static_cast<float>(bytesIn[v])
+            : static_cast<float>(codes[v]);
+
+        out[v] = range.offset + (range.scale * code);
+    }
+}
+
+/*******************************************************************************
+ * Access
+ ******************************************************************************/
+
+int BrickCache::acquire(int brick)
+{
+    assert(brick >= 0 && brick < this->storedBricks);
+
+    unique_lock<mutex> guard(this->lock);
+
+    while (true) {
+
+        int slot = this->find(brick);
+
+        if (slot != NO_SLOT) {
+
+            if (this->pins[slot]++ == 0) {
+                this->unlink(slot);
+            }
+            this->hits++;
+
+            // Someone else is reading it:
+            while (!this->ready[slot]) {
+                this->changed.wait(guard);
+            }
+
+            return slot;
+        }
+
+        slot = this->claim(brick);
+
+        // Every brick is in use; wait for one to be let go:
+        if (slot == NO_SLOT) {
+            this->changed.wait(guard);
+            continue;
+        }
+
+        this->misses++;
+
+        guard.unlock();
+        this->read(brick, slot);
+        guard.lock();
+
+        this->ready[slot] = 1;
+        this->changed.notify_all();
+
+        return slot;
+    }
+}
+
+void BrickCache::release(int slot)
+{
+    lock_guard<mutex> guard(this->lock);
+
+    assert(this->pins[slot] > 0);
+
+    if (--this->pins[slot] == 0) {
+        this->pushNewest(slot);
+        this->changed.notify_all();
+    }
+}
+
+/**
+ * Queues the given bricks that aren't in memory. Hints are only worth
+ * anything if they cost the caller next to nothing, so they are dropped
+ * rather than wait for either lock
+ */
+void BrickCache::prefetch(const int* bricks, int count)
+{
+    if (!this->prefetcher.joinable()) {
+        return;
+    }
+
+    unique_lock<mutex> guard(this->lock, try_to_lock);
+
+    if (!guard.owns_lock()) {
+        return;
+    }
+
+    unique_lock<mutex> hints(this->queueLock, try_to_lock);
+
+    if (!hints.owns_lock()) {
+        return;
+    }
+
+    // The prefetcher only sleeps on an empty queue:
+    bool wake = this->queueSize == 0;
+
+    for (int b=0; b<count && this->queueSize < PREFETCH_QUEUE; b++) {
+        if (bricks[b] >= 0 && bricks[b] < this->storedBricks && this->find(bricks[b]) == NO_SLOT) {
+            this->queue[(this->queueHead + this->queueSize) % PREFETCH_QUEUE] = bricks[b];
+            this->queueSize++;
+        }
+    }
+
+    if (wake && this->queueSize > 0) {
+        hints.unlock();
+        guard.unlock();
+        this->queued.notify_one();
+    }
+}
+
+/**
+ * Reads hinted bricks that aren't in memory yet into the least recently used
+ * slots, as long as there are free ones to take. Hints are taken off the
+ * queue all at once, so threads adding more don't wait on every brick read
+ */
+void BrickCache::prefetchLoop()
+{
+    while (true) {
+
+        int count = 0;
+
+        {
+            unique_lock<mutex> guard(this->queueLock);
+
+            this->queued.wait(guard, [this]() { return this->stopping || this->queueSize > 0; });
+
+            if (this->stopping) {
+                return;
+            }
+
+            for (; this->queueSize > 0; this->queueSize--, count++) {
+                this->pending[count] = this->queue[this->queueHead];
+                this->queueHead      = (this->queueHead + 1) % PREFETCH_QUEUE;
+            }
+        }
+
+        unique_lock<mutex> guard(this->lock);
+
+        for (int h=0; h<count; h++) {
+
+            int brick = this->pending[h];
+
+            if (this->find(brick) != NO_SLOT) {
+                continue;
+            }
+
+            int slot = this->claim(brick);
+
+            if (slot == NO_SLOT) {
+                break;
+            }
+
+            guard.unlock();
+            this->read(brick, slot);
+            guard.lock();
+
+            this->ready[slot] = 1;
+            this->prefetches++;
+
+            if (--this->pins[slot] == 0) {
+                this->pushNewest(slot);
+            }
+            this->changed.notify_all();
+        }
+    }
+}
+
+BrickCacheStats BrickCache::getStats()
+{
+    BrickCacheStats stats;
+
+    stats.hits       = this->hits;
+    stats.misses     = this->misses;
+    stats.evictions  = this->evictions;
+    stats.prefetches = this->prefetches;
+    stats.readErrors = this->readErrors;
+    stats.capacity   = this->capacity;
+
+    lock_guard<mutex> guard(this->lock);
+
+    for (int s=0; s<this->capacity; s++) {
+        stats.resident += this->slotBrick[s] >= 0;
+    }
+
+    return stats;
+}
+
+ostream& operator<<(ostream& s, const BrickCacheStats& stats)
+{
+    long long requests = stats.hits + stats.misses;
+
+    s << "BrickCache {" << endl
+      << "  hits       = " << stats.hits
+      << " (" << (requests > 0 ? (100.0 * stats.hits) / requests : 0.0) << "%)" << endl
+      << "  misses     = " << stats.misses << endl
+      << "  evictions  = " << stats.evictions << endl
+      << "  prefetches = " << stats.prefetches << endl;
+
+    if (stats.readErrors > 0) {
+        s << "  read errors = " << stats.readErrors << endl;
+    }
+
+    return s << "  resident   = " << stats.resident << " of " << stats.capacity << " bricks ("
+             << ((static_cast<long long>(stats.capacity) * BRICK_VOXELS * sizeof(float)) >> 10) << " KB)" << endl
+             << "}";
+}
+
+/******************************************************************************/
@@ -0,0 +1,214 @@
+#ifndef _BRICK_CACHE_H
+#define _BRICK_CACHE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Voxel.h"
+
+// Forward declarations:
+class VolumeFile;
+
+/******************************************************************************/
+
+// Bricks a BrickCursor keeps pinned at a time
+#define CURSOR_BRICKS 8
+
+// Prefetch hints the cache holds on to; more are dropped until it catches up
+#define PREFETCH_QUEUE 1024
+
+/*******************************************************************************
+ * Counters kept by a BrickCache. Hits are bricks that were already in memory
+ * (or on their way in) when asked for, misses had to be read while the
+ * caller waited, evictions are bricks dropped to make room, and prefetches
+ * are bricks read ahead of time from hints
+ ******************************************************************************/
+
+typedef struct BrickCacheStats
+{
+    long long hits;
+    long long misses;
+    long long evictions;
+    long long prefetches;
+    long long readErrors;
+    int capacity;        // Bricks the cache can hold
+    int resident;        // Bricks it holds now
+
+    BrickCacheStats() :
+        hits(0),
+        misses(0),
+        evictions(0),
+        prefetches(0),
+        readErrors(0),
+        capacity(0),
+        resident(0)
+    { };
+
+} BrickCacheStats;
+
+std::ostream& operator<<(std::ostream& s, const BrickCacheStats& stats);
+
+/*******************************************************************************
+ * Bounded, thread-safe LRU cache of the bricks of a volume file in one of the
+ * brick layouts, addressed by their position in the file's storage.
+ *
+ * Bricks are read from disk with positioned reads rather than through the
+ * file's mapping, and quantized bricks are expanded to floats as they come
+ * in, so the cache's slots are all the memory the voxels take. Slots are
+ * allocated up front, and nothing is allocated while rendering: a smaller
+ * budget means more misses rather than a failed allocation.
+ *
+ * A brick is pinned while it is in use, and only unpinned bricks are
+ * evicted, least recently used first. A background thread reads the bricks
+ * it is given hints for, so they are often in memory by the time a ray
+ * reaches them. Reads happen outside of the lock; threads asking for a brick
+ * that is still being read wait for it
+ ******************************************************************************/
+
+class BrickCache
+{
+    protected:
+        std::shared_ptr<VolumeFile> file;
+        int descriptor;       // Read with pread(), where there is one
+        VoxelFormat format;
+        int voxelBytes;
+        int storedBricks;
+        int capacity;
+
+        // Slot s holds brick slotBrick[s] (-1 if none) in BRICK_VOXELS
+        // floats from voxels[s * BRICK_VOXELS]; it is pinned pins[s] times
+        // and ready once read. Unpinned slots sit in a list from least to
+        // most recently used, linked through newer and older, with entry
+        // capacity as both ends
+        std::vector<float> voxels;
+        std::vector<int> slotBrick;
+        std::vector<int> pins;
+        std::vector<char> ready;
+        std::vector<int> newer;
+        std::vector<int> older;
+
+        // Brick to slot lookup: open addressing with linear probing
+        std::vector<int> tableBrick;
+        std::vector<int> tableSlot;
+        int tableMask;
+
+        std::mutex lock;
+        std::condition_variable changed; // A slot was read or unpinned
+
+        std::atomic<long long> hits;
+        std::atomic<long long> misses;
+        std::atomic<long long> evictions;
+        std::atomic<long long> prefetches;
+        std::atomic<long long> readErrors;
+
+        // Prefetch hints, in a ring, and the thread that reads them, a
+        // batch of pending ones at a time
+        std::vector<int> queue;
+        std::vector<int> pending;
+        int queueHead;
+        int queueSize;
+        bool stopping;
+        std::mutex queueLock;
+        std::condition_variable queued;
+        std::thread prefetcher;
+
+        int find(int brick) const;
+        void insert(int brick, int slot);
+        void erase(int brick);
+        void unlink(int slot);
+        void pushNewest(int slot);
+        int claim(int brick);
+        bool readBytes(void* out, size_t count, uint64_t offset) const;
+        void read(int brick, int slot);
+        void prefetchLoop();
+
+    public:
+        BrickCache(std::shared_ptr<VolumeFile> file, int capacity, int minimum = 1);
+        virtual ~BrickCache();
+
+        BrickCache(const BrickCache& other) = delete;
+        BrickCache& operator=(const BrickCache& other) = delete;
+
+        // Pins brick (a storage index) in memory, reading it if it isn't,
+        // and returns the slot it is in. Every acquire() needs a release()
+        int acquire(int brick);
+        void release(int slot);
+        const float* data(int slot) const { return &this->voxels[static_cast<size_t>(slot) * BRICK_VOXELS]; }
+
+        // Asks for the given bricks to be read in the background. Never
+        // blocks; hints are dropped while the cache is busy or the queue is
+        // full
+        void prefetch(const int* bricks, int count);
+
+        int getCapacity() const { return this->capacity; }
+        BrickCacheStats getStats();
+};
+
+/*******************************************************************************
+ * The last few bricks one thread has read from a cache, kept pinned so
+ * neighboring lookups don't go through the cache's lock. Cursors live on the
+ * stack for the length of a march, and unpin everything when they go away
+ ******************************************************************************/
+
+class BrickCursor
+{
+    protected:
+        BrickCache& cache;
+        int bricks[CURSOR_BRICKS];
+        int slots[CURSOR_BRICKS];
+        const float* voxels[CURSOR_BRICKS];
+        int count;
+        int last;   // Entry of the most recent lookup
+        int victim; // Entry replaced next, round robin
+
+    public:
+        BrickCursor(BrickCache& _cache) : cache(_cache), count(0), last(0), victim(0) { };
+        ~BrickCursor()
+        {
+            for (int c=0; c<this->count; c++) {
+                this->cache.release(this->slots[c]);
+            }
+        }
+
+        BrickCursor(const BrickCursor& other) = delete;
+        BrickCursor& operator=(const BrickCursor& other) = delete;
+
+        // Voxels of the given brick
+        const float* fetch(int brick)
+        {
+            if (this->count > 0 && this->bricks[this->last] == brick) {
+                return this->voxels[this->last];
+            }
+
+            for (int c=0; c<this->count; c++) {
+                if (this->bricks[c] == brick) {
+                    this->last = c;
+                    return this->voxels[c];
+                }
+            }
+
+            int c;
+
+            if (this->count < CURSOR_BRICKS) {
+                c = this->count++;
+            } else {
+                c            = this->victim;
+                this->victim = (this->victim + 1) % CURSOR_BRICKS;
+                this->cache.release(this->slots[c]);
+            }
+
+            this->bricks[c] = brick;
+            this->slots[c]  = this->cache.acquire(brick);
+            this->voxels[c] = this->cache.data(this->slots[c]);
+            this->last      = c;
+
+            return this->voxels[c];
+        }
+};
+
+#endif
@@ -105,6 +105,19 @@ void Camera::setAspectRatio(float aspectRatio)
     this->calibrateViewPlane();
 }
 
+// The eye
+const P& Camera::getPosition() const
+{
+    return this->position;
+}
+
+// Height of a pixel on a screen h pixels high, per unit of distance from the
+// eye: how quickly the footprint of a ray grows along it
+float Camera::getPixelSpread(float h) const
+{
+    return (2.0f * this->phi) / h;
+}
+
 // Convert an (u,v) coordinate in the range {[0,1],[0,1]} to a position in
 // R3 space
 P Camera::ndc2World(float x, float y) const 
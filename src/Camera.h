@@ -36,6 +36,9 @@ class Camera
         void setFOV(float fov);
         void setAspectRatio(float aspectRatio);
 
+        const P& getPosition() const;
+        float getPixelSpread(float h) const;
+
         P ndc2World(float x, float y) const;
         P screen2World(float x, float y, float w, float h) const;
 
@@ -1,13 +1,23 @@
+#include <algorithm>
 #include <cctype>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <stdexcept>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <sstream>
 #include <ctime>
 #include "Utils.h"
 #include "BitmapTexture.h"
 #include "Config.h"
 #include "Light.h"
+#include "MappedFile.h"
+#include "Scheduler.h"
+#include "StreamedVolume.h"
+#include "VolumeFile.h"
 #include "VoxelSphere.h"
 #include "VoxelCloud.h"
 #include "VoxelPyroclastic.h"
@@ -16,6 +26,9 @@
 #define DEFAULT_FREQ 1.0f
 #define DEFAULT_AMP 1.0f
 
+// Bytes of density lines handed to a worker at a time
+#define DENSITY_CHUNK_BYTES (4 * 1024 * 1024)
+
 /******************************************************************************/
  
 using namespace std;
@@ -67,6 +80,11 @@ using namespace Utils;
  * 1.0
  * 0
  * 0
+ *
+ * ==== Volume files ====
+ *
+ * Binary files ending in VOLUME_EXTENSION, holding the header above as text
+ * followed by a single voxel buffer; see VolumeFile.h
  ******************************************************************************/
 
 Configuration::Configuration() :
@@ -80,7 +98,9 @@ Configuration::Configuration() :
     VDIR(ivec3(0, 0, -1)),
     UVEC(ivec3(0, 1, 0)),
     FOVY(45.0f),
-    SEED(static_cast<int>(time(nullptr)))
+    SEED(static_cast<int>(time(nullptr))),
+    LAYOUT(LAYOUT_LINEAR),
+    STREAM(0)
 {
 
 }
@@ -96,7 +116,9 @@ Configuration::Configuration(const Configuration& other) :
     VDIR(other.VDIR),
     UVEC(other.UVEC),
     FOVY(other.FOVY),
-    SEED(static_cast<int>(time(nullptr)))
+    SEED(static_cast<int>(time(nullptr))),
+    LAYOUT(other.LAYOUT),
+    STREAM(other.STREAM)
 {
 
 }
@@ -126,6 +148,33 @@ ostream& operator<<(ostream& s, const Configuration& c)
       << "}";
 }
 
+/**
+ * Guesses the format version of a configuration file from the start of its
+ * body, which follows the (optional) header lines, each starting with an
+ * attribute name. A version 2 body opens with the object count followed by
+ * the first object's type name; a version 1 body is nothing but densities
+ */
+int Configuration::detectVersion(const string& filename)
+{
+    ifstream configFile(filename.c_str());
+    vector<string> body;
+    string line;
+
+    while (body.size() < 2 && getline(configFile, line)) {
+
+        istringstream is(line);
+        string first;
+
+        if (!(is >> first) || (body.empty() && isalpha(first[0]))) {
+            continue;
+        }
+
+        body.push_back(first);
+    }
+
+    return body.size() == 2 && isalpha(body[1][0]) ? 2 : 1;
+}
+
 /**
  * Tests if the given string is non-numeric
  */
@@ -195,7 +244,9 @@ void Configuration::readHeader(istream& is)
 
     while (getline(is, line)) {
 
-        line = trim(line);
+        // Rewinding has to cover the whole line, spaces and all:
+        rewindChars = line.length() + 1;
+        line        = trim(line);
 
         // Newline means the header is over
         if (line.length() == 0) {
@@ -215,10 +266,36 @@ void Configuration::readHeader(istream& is)
         this->readAttribute(optionType, is);
     }
 
-    rewindChars = line.length() + 1;
     is.seekg(-rewindChars, ios_base::cur);
 }
 
+void Configuration::writeHeader(ostream& os) const
+{
+    auto precision = os.precision(numeric_limits<float>::max_digits10);
+
+    os << "STEP " << this->STEP << endl
+       << "XYZC " << this->XYZC.x << " " << this->XYZC.y << " " << this->XYZC.z << endl
+       << "BRGB " << this->BRGB.r << " " << this->BRGB.g << " " << this->BRGB.b << endl
+       << "MRGB " << this->MRGB.r << " " << this->MRGB.g << " " << this->MRGB.b << endl
+       << "FILE " << this->FILE << endl
+       << "RESO " << this->RESO.x << " " << this->RESO.y << endl
+       << "EYEP " << this->EYEP.x << " " << this->EYEP.y << " " << this->EYEP.z << endl
+       << "VDIR " << this->VDIR.x << " " << this->VDIR.y << " " << this->VDIR.z << endl
+       << "UVEC " << this->UVEC.x << " " << this->UVEC.y << " " << this->UVEC.z << endl
+       << "FOVY " << this->FOVY << endl;
+
+    auto ip = this->LPOS.begin();
+    auto ic = this->LCOL.begin();
+
+    for (; ip != this->LPOS.end() && ic != this->LCOL.end(); ip++, ic++) {
+        os << "LPOS " << ip->x << " " << ip->y << " " << ip->z << endl
+           << "LCOL " << ic->r << " " << ic->g << " " << ic->b << endl;
+    }
+
+    os << endl;
+    os.precision(precision);
+}
+
 /**
  * Instantiates lights based on read configuration values
  */
@@ -455,7 +532,7 @@ void NewConfigurationReader::readBody(istream& is, bool skippedHeader)
 
         if  (objectType == "sphere") {
 
-            obj = new VoxelSphere(radius, scale, this->XYZC, bounds, material);
+            obj = new VoxelSphere(radius, scale, this->XYZC, bounds, material, this->LAYOUT);
 
         } else if (objectType == "cloud") {
 
@@ -467,7 +544,8 @@ void NewConfigurationReader::readBody(istream& is, bool skippedHeader)
                                 ,this->SEED
                                 ,octaves
                                 ,freq
-                                ,amp);
+                                ,amp
+                                ,this->LAYOUT);
 
         } else if (objectType == "pyroclastic") {
 
@@ -479,7 +557,8 @@ void NewConfigurationReader::readBody(istream& is, bool skippedHeader)
                                       ,this->SEED
                                       ,octaves
                                       ,freq
-                                      ,amp);
+                                      ,amp
+                                      ,this->LAYOUT);
         }
 
         this->objects.push_back(obj);
@@ -488,29 +567,229 @@ void NewConfigurationReader::readBody(istream& is, bool skippedHeader)
 
 /******************************************************************************/
 
-OldConfigurationReader::OldConfigurationReader() :
-    Configuration()
+OldConfigurationReader::OldConfigurationReader(const string& _filename) :
+    Configuration(),
+    filename(_filename)
+{
+
+}
+
+static bool isDigit(char c)
 {
+    return c >= '0' && c <= '9';
+}
 
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
 }
 
 /**
- * Reads a configuration density value for a single object
+ * Parses the number at p, as in "-1.25e-3", and returns the character after
+ * it, or p if there isn't one. Values that come out exactly from a single
+ * float multiplication or division, like most densities written with a few
+ * digits, are found that way; anything else goes through strtof(), so every
+ * value is the one the stream operators would read
  */
-float OldConfigurationReader::readSingleDensity(int count, string line)
+static const char* parseDensity(const char* p, const char* end, float& value)
 {
-    istringstream is(line);
-    float value = 0.0;
-    is >> value;
+    const char* start = p;
+    bool negative     = false;
+    bool exact        = true;
+    bool digits       = false;
+    uint64_t mantissa = 0;
+    int significant   = 0;
+    int exponent      = 0;
+
+    if (p != end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    for (; p != end && isDigit(*p); p++) {
+        digits = true;
+        if (significant < 19) {
+            mantissa     = (mantissa * 10) + static_cast<uint64_t>(*p - '0');
+            significant += mantissa != 0;
+        } else {
+            exact = false;
+            exponent++;
+        }
+    }
+
+    if (p != end && *p == '.') {
+        for (p++; p != end && isDigit(*p); p++) {
+            digits = true;
+            if (significant < 19) {
+                mantissa     = (mantissa * 10) + static_cast<uint64_t>(*p - '0');
+                significant += mantissa != 0;
+                exponent--;
+            } else {
+                exact = false;
+            }
+        }
+    }
+
+    if (!digits) {
+        return start;
+    }
+
+    // An exponent without digits is left unread, as the stream would:
+    if (p != end && (*p == 'e' || *p == 'E')) {
+
+        const char* q = p + 1;
+        bool down     = false;
+        int power     = 0;
+
+        if (q != end && (*q == '-' || *q == '+')) {
+            down = *q == '-';
+            q++;
+        }
+
+        if (q != end && isDigit(*q)) {
+            for (; q != end && isDigit(*q); q++) {
+                power = std::min((power * 10) + (*q - '0'), 100000);
+            }
+            exponent += down ? -power : power;
+            p = q;
+        }
+    }
+
+    static const float powers[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+    static const double widePowers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    // Both operands are exact floats here, so the one rounding is correct:
+    if (exact && mantissa <= (1u << 24) && exponent >= -10 && exponent <= 10) {
+        float m = static_cast<float>(mantissa);
+        value   = exponent < 0 ? m / powers[-exponent] : m * powers[exponent];
+        value   = negative ? -value : value;
+        return p;
+    }
+
+    // The same in double precision, for values with more digits. Rounding
+    // the double to a float again is only wrong when the double landed
+    // exactly halfway between two floats, all of whose 29 extra bits are
+    // then 1 followed by zeros
+    if (exact && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+
+        double m = static_cast<double>(mantissa);
+        double d = exponent < 0 ? m / widePowers[-exponent] : m * widePowers[exponent];
+        uint64_t bits;
+
+        memcpy(&bits, &d, sizeof(bits));
+
+        if ((bits & 0x1FFFFFFFull) != 0x10000000ull && 
+            (d == 0.0 || (d >= numeric_limits<float>::min() && d <= numeric_limits<float>::max()))) 
+        {
+            value = static_cast<float>(negative ? -d : d);
+            return p;
+        }
+    }
+
+    string number(start, p);
+    value = strtof(number.c_str(), nullptr);
+
+    return p;
+}
+
+/**
+ * Parses the density lines from begin to end, one value per line, into
+ * densities, scaling them by the voxel space width. Blank lines before the
+ * first value are skipped; after it, a blank line is a density of 0, and
+ * anything after a line's value is ignored.
+ *
+ * The text is split into chunks that end on a line break. The lines of every
+ * chunk are counted in parallel, which places every chunk's values in the
+ * array, and then the chunks are parsed in parallel straight into it. The
+ * first line that doesn't start with a number is reported
+ */
+void OldConfigurationReader::readDensities(const char* begin, const char* end, vector<float>& densities) const
+{
+    while (begin != end && (isBlank(*begin) || *begin == '\n')) {
+        begin++;
+    }
+
+    vector<const char*> chunks(1, begin);
+
+    while (chunks.back() != end) {
+
+        const char* next = chunks.back() + std::min(static_cast<size_t>(end - chunks.back()), static_cast<size_t>(DENSITY_CHUNK_BYTES));
+
+        if (next != end) {
+            const char* newline = static_cast<const char*>(memchr(next - 1, '\n', end - (next - 1)));
+            next = newline != nullptr ? newline + 1 : end;
+        }
+
+        chunks.push_back(next);
+    }
+
+    int count = static_cast<int>(chunks.size()) - 1;
+    vector<size_t> first(count + 1, 0);
+
+    parallelFor(count, 1, [&](int from, int to) {
+        for (int c=from; c<to; c++) {
+            first[c + 1] = std::count(chunks[c], chunks[c + 1], '\n');
+        }
+    });
+
+    // A last line without a line break still counts:
+    if (begin != end && *(end - 1) != '\n') {
+        first[count]++;
+    }
+
+    for (int c=0; c<count; c++) {
+        first[c + 1] += first[c];
+    }
 
-    if (!is.good() && !is.eof()) {
-        ostringstream msg;
-        msg << "(" << count << ") Bad parse for line: '" << line << "'";
-        throw runtime_error(msg.str());
+    if (first[count] > static_cast<size_t>(numeric_limits<int>::max())) {
+        throw runtime_error("Too many densities: " + to_string(first[count]));
     }
 
-    // Multiply the density value by the voxel space width:
-    return value * this->XYZC.x;
+    densities.resize(first[count]);
+
+    float scale = static_cast<float>(this->XYZC.x);
+    vector<size_t> badLine(count, numeric_limits<size_t>::max());
+    vector<string> badText(count);
+
+    parallelFor(count, 1, [&](int from, int to) {
+        for (int c=from; c<to; c++) {
+
+            const char* p = chunks[c];
+            const char* e = chunks[c + 1];
+            size_t n      = first[c];
+
+            while (p < e) {
+
+                const char* eol = static_cast<const char*>(memchr(p, '\n', e - p));
+                eol = eol != nullptr ? eol : e;
+
+                const char* q = p;
+                float density = 0.0f;
+
+                while (q != eol && isBlank(*q)) {
+                    q++;
+                }
+
+                if (q != eol && parseDensity(q, eol, density) == q) {
+                    badLine[c] = n;
+                    badText[c] = trim(string(p, eol));
+                    break;
+                }
+
+                densities[n++] = density * scale;
+                p = eol + 1;
+            }
+        }
+    });
+
+    for (int c=0; c<count; c++) {
+        if (badLine[c] != numeric_limits<size_t>::max()) {
+            ostringstream msg;
+            msg << "(" << badLine[c] << ") Bad parse for line: '" << badText[c] << "'";
+            throw runtime_error(msg.str());
+        }
+    }
 }
 
 /**
@@ -521,25 +800,32 @@ float OldConfigurationReader::readSingleDensity(int count, string line)
  */
 void OldConfigurationReader::readBody(istream& is, bool skippedHeader)
 {
-    int count = 0;
-    string line;
-
     BoundingBox bounds(P(0,0,0), P(1,1,-1));
     shared_ptr<Material> material = make_shared<Color>(this->MRGB.r, this->MRGB.g, this->MRGB.b);
 
-    auto voxels = make_shared<vector<Voxel> >();
-    voxels->reserve(1024 * 1024);
+    auto densities = make_shared<vector<float> >();
 
-    while (getline(is, line)) {
+    if (this->filename.empty()) {
+
+        string body((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+        this->readDensities(body.data(), body.data() + body.size(), *densities);
 
-        // Assume each line contains a floating point density value:
-        line = trim(line);
-        float density = this->readSingleDensity(count++, line);
+    } else {
 
-        voxels->push_back(Voxel(density));
+        // Where the header left off; a header with nothing after it leaves
+        // the stream failed:
+        MappedFile file(this->filename, true);
+        const char* text = reinterpret_cast<const char*>(file.data());
+        streamoff offset = is.tellg();
+
+        if (offset < 0 || static_cast<size_t>(offset) > file.size()) {
+            offset = static_cast<streamoff>(file.size());
+        }
+
+        this->readDensities(text + offset, text + file.size(), *densities);
     }
 
-    auto vb = new VoxelBuffer(voxels, bounds, material);
+    auto vb = new VoxelBuffer(densities, bounds, material);
 
     if (skippedHeader) {
         // Defer explicit dimensions for now
@@ -552,3 +838,46 @@ void OldConfigurationReader::readBody(istream& is, bool skippedHeader)
 }
 
 /******************************************************************************/
+
+BinaryConfigurationReader::BinaryConfigurationReader(const string& _filename) :
+    Configuration(),
+    filename(_filename)
+{
+
+}
+
+void BinaryConfigurationReader::read(istream& is, bool skipHeader)
+{
+    this->file = make_shared<VolumeFile>(this->filename);
+
+    if (skipHeader) {
+        clog << "Skipping header..." << endl;
+    } else {
+        istringstream scene(this->file->getScene());
+        this->readHeader(scene);
+    }
+
+    this->readBody(is, skipHeader);
+
+    if (!skipHeader) {
+        this->addLighting();
+    }
+}
+
+/**
+ * The voxel buffer, sampling the file where it is mapped, or streaming it a
+ * brick at a time. Volume files carry their dimensions, so nothing is
+ * deferred
+ */
+void BinaryConfigurationReader::readBody(istream& is, bool skippedHeader)
+{
+    shared_ptr<Material> material = make_shared<Color>(this->MRGB.r, this->MRGB.g, this->MRGB.b);
+
+    if (this->STREAM > 0) {
+        this->objects.push_back(new StreamedVolume(this->file, material, static_cast<size_t>(this->STREAM) << 20));
+    } else {
+        this->objects.push_back(new VoxelBuffer(this->file, material));
+    }
+}
+
+/******************************************************************************/
@@ -8,6 +8,10 @@
 #include <glm/glm.hpp>
 #include "Voxel.h"
 
+// Forward declarations:
+class Light;
+class VolumeFile;
+
 /******************************************************************************/
 
 using namespace std;
@@ -125,12 +129,37 @@ class Configuration
          */
         int SEED;
 
+        /**
+         * Storage order of the voxel buffers the objects are built in. It
+         * has to be set before the body is read to keep large, mostly empty
+         * objects from ever being stored densely
+         */
+        VoxelLayout LAYOUT;
+
+        /**
+         * Megabytes of bricks to keep in memory when streaming a volume file
+         * from disk, or 0 to map the whole file
+         */
+        int STREAM;
+
         Configuration();
         Configuration(const Configuration& other);
         virtual ~Configuration();
 
         virtual void read(istream& s, bool skipHeader = false);
 
+        /**
+         * The format of the named text configuration file: 2 if its body
+         * lists objects, 1 if it is only densities
+         */
+        static int detectVersion(const string& filename);
+
+        /**
+         * Writes the header attributes in the form readHeader() reads them
+         * back in, ending with a blank line
+         */
+        void writeHeader(ostream& s) const;
+
         const list<Primitive*>& getObjects() const { return this->objects; };
         const list<Light*>& getLights() const      { return this->lights; };
 
@@ -162,11 +191,39 @@ class NewConfigurationReader : public Configuration
 class OldConfigurationReader : public Configuration
 {
     protected:
-        float readSingleDensity(int count, string line);
+        string filename;
+        void readDensities(const char* begin, const char* end, vector<float>& densities) const;
+        virtual void readBody(istream& s, bool skippedHeader);
+
+    public:
+        /**
+         * Densities are parsed from the named file, mapped, picking up where
+         * the stream leaves off after the header. Without a file name, the
+         * rest of the stream is read in and parsed
+         */
+        OldConfigurationReader(const string& filename = "");
+};
+
+/******************************************************************************/
+
+class BinaryConfigurationReader : public Configuration
+{
+    protected:
+        string filename;
+        shared_ptr<VolumeFile> file;
         virtual void readBody(istream& s, bool skippedHeader);
 
     public:
-        OldConfigurationReader();
+        BinaryConfigurationReader(const string& filename);
+
+        /**
+         * Maps the volume file the reader was made for; the stream isn't
+         * read. The scene header stored in the file stands in for the text
+         * header, and is skipped the same way. With STREAM set, the voxels
+         * are read through a brick cache of that size instead of sampled
+         * where they are mapped
+         */
+        virtual void read(istream& s, bool skipHeader = false);
 };
 
 /******************************************************************************/
@@ -1,12 +1,9 @@
 #ifndef _RENDER_CONTEXT_H
 #define _RENDER_CONTEXT_H
 
-#include <list>
+#include "BlueNoise.h"
 #include "Color.h"
-
-// Forward declarations:
-class Light;
-class Primitive;
+#include "Scene.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Options and variables relevant to the current rendering context
@@ -17,29 +14,91 @@ class RenderContext
     protected:
         float step;                    // Sampling step size
         bool interpolate;              // Enable trilinear interpolation
-        std::list<Primitive*> objects; // Scene lights
-        std::list<Light*> lights;      // Scene lights
+        int tileSize;                  // Width and height of a render tile, in pixels
+        int threads;                   // Number of render threads; 0 picks a default
+        float shadowEpsilon;           // Shadow rays stop once transmittance falls below this
+        float cutoff;                  // Primary rays stop once transmittance falls below this
+        bool roulette;                 // Use Russian roulette instead of a hard cutoff
+        bool packets;                  // Trace primary rays in SIMD packets
+        bool dda;                      // Walk voxels exactly instead of stepping
+        float tolerance;               // Adaptive marching error bound per step; 0 disables
+        bool preIntegration;           // Integrate each fixed step exactly, density changing linearly
+        int samplesPerPixel;           // Delta tracking estimates per pixel; 0 marches instead
+        const BlueNoise* blueNoise;    // Start offset mask for marches; null starts them all alike
+        P eye;                         // Where primary rays start, for their footprints
+        float pixelSpread;             // Growth of a primary ray's footprint per unit distance; 0 disables LOD
+        Span<SceneObject> objects;     // Scene objects
+        Span<SceneLight> lights;       // Scene lights
+        const BVH* bvh;                // Hierarchy over the scene objects
         Color bgColor;
 
     public:
-        RenderContext(float step
-                     ,const std::list<Primitive*>& objects
-                     ,const std::list<Light*>& lights
-                     ,Color bgColor)
+        // The context only refers to the scene's arrays, so the scene must 
+        // outlive it
+        RenderContext(float step, const RenderScene& scene)
         { 
             this->step    = step;
-            this->objects = objects;
-            this->lights  = lights;
-            this->bgColor = bgColor;
+            this->objects = scene.getObjects();
+            this->lights  = scene.getLights();
+            this->bvh     = &scene.getBVH();
+            this->bgColor = scene.getBackground();
             this->interpolate = false;
+            this->tileSize    = 16;
+            this->threads     = 0;
+            this->shadowEpsilon = 1.0e-3f;
+            this->cutoff        = 1.0e-3f;
+            this->roulette      = false;
+            this->packets       = false;
+            this->dda           = false;
+            this->tolerance     = 0.0f;
+            this->preIntegration = false;
+            this->samplesPerPixel = 0;
+            this->blueNoise       = nullptr;
+            this->pixelSpread     = 0.0f;
         };
 
         float getStep() const { return this->step; }
-        const std::list<Primitive*>& getObjects() const { return this->objects; } 
-        const std::list<Light*>& getLights() const      { return this->lights; } 
+        void setStep(float step)                        { this->step = step; }
+        const Span<SceneObject>& getObjects() const     { return this->objects; } 
+        const Span<SceneLight>& getLights() const       { return this->lights; } 
+        const BVH& getBVH() const                       { return *this->bvh; }
         const Color& getBackground() const           { return this->bgColor; }
         bool getInterpolation() const                   { return this->interpolate; }
         void setInterpolation(bool interpolate) { this->interpolate = interpolate; }
+        int getTileSize() const                         { return this->tileSize; }
+        void setTileSize(int tileSize)                  { this->tileSize = tileSize; }
+        int getThreads() const                          { return this->threads; }
+        void setThreads(int threads)                    { this->threads = threads; }
+        float getShadowEpsilon() const                  { return this->shadowEpsilon; }
+        void setShadowEpsilon(float epsilon)            { this->shadowEpsilon = epsilon; }
+        float getCutoff() const                         { return this->cutoff; }
+        void setCutoff(float cutoff)                    { this->cutoff = cutoff; }
+        bool getRoulette() const                        { return this->roulette; }
+        void setRoulette(bool roulette)                 { this->roulette = roulette; }
+        bool getPackets() const                         { return this->packets; }
+        void setPackets(bool packets)                   { this->packets = packets; }
+        bool getDDA() const                             { return this->dda; }
+        void setDDA(bool dda)                           { this->dda = dda; }
+        float getTolerance() const                      { return this->tolerance; }
+        void setTolerance(float tolerance)              { this->tolerance = tolerance; }
+        bool getPreIntegration() const                  { return this->preIntegration; }
+        void setPreIntegration(bool preIntegration)     { this->preIntegration = preIntegration; }
+        bool getTracking() const                        { return this->samplesPerPixel > 0; }
+        int getSamplesPerPixel() const                  { return this->samplesPerPixel; }
+        void setSamplesPerPixel(int samples)            { this->samplesPerPixel = samples; }
+        const BlueNoise* getBlueNoise() const           { return this->blueNoise; }
+        void setBlueNoise(const BlueNoise* blueNoise)   { this->blueNoise = blueNoise; }
+        bool getLOD() const                             { return this->pixelSpread > 0.0f; }
+        void setLOD(const P& eye, float pixelSpread)    { this->eye = eye; this->pixelSpread = pixelSpread; }
+
+        // Width of a primary ray where it reaches X, if level of detail
+        // selection is on
+        float getFootprint(const P& X) const            { return dist(this->eye, X) * this->pixelSpread; }
+
+        // Fraction of a step by which to move the first sample of the march
+        // for pixel (x,y), or of the shadow march from voxel (i,j,k)
+        float getJitter(int x, int y) const             { return this->blueNoise ? this->blueNoise->at(x, y) : 0.0f; }
+        float getJitter(int i, int j, int k) const      { return this->blueNoise ? this->blueNoise->at(i, j, k) : 0.0f; }
 }; 
 
 #endif
@@ -0,0 +1,157 @@
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include "DDAMarch.h"
+#include "Utils.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace Utils;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * Exact transmittance from X towards the point to, or to where that path
+ * leaves the volume if sooner: the optical depth is the sum of the density
+ * of every voxel crossed times the length of the path inside it. The cost is
+ * the number of voxels crossed, whatever the step size. If epsilon > 0, the
+ * walk stops as soon as the transmittance is known to be below epsilon
+ */
+float Q(const VoxelBuffer& vb
+       ,float kappa
+       ,const P& X
+       ,const P& to
+       ,float epsilon)
+{
+    assert(vb.hasLoadedDimensions());
+
+    V N            = to - X;
+    float distance = glm::length(N);
+    float tau      = 0.0f;
+
+    if (distance <= 0.0f) {
+        return 1.0f;
+    }
+
+    // exp(-kappa * tau) < epsilon <=> tau > maxTau
+    float maxTau = epsilon > 0.0f
+        ? -log(epsilon) / kappa
+        : numeric_limits<float>::infinity();
+
+    walkCells(vb, 1, X, N / distance, distance, [&](int i, int j, int k, float s, float length) {
+        tau += vb(i, j, k) * length;
+        return tau <= maxTau;
+    });
+
+    return exp(-kappa * tau);
+}
+
+/**
+ * Exact traversal: instead of sampling every step, walks each voxel the ray
+ * crosses and integrates Beer's law over the exact length of the ray inside
+ * it. Densities are constant over a voxel without interpolation, so this is
+ * the exact solution of the march the fixed step kernels approximate, at a
+ * cost set by the grid resolution rather than the step size. Shading is
+ * evaluated at the middle of each segment, and unbaked shadows are exact too
+ */
+typedef struct DDAKernel
+{
+    template<bool Interpolate, typename Shading, int Lights>
+    static RayMarch march(const MarchParams& params
+                         ,const VoxelBuffer& vb
+                         ,const P& start
+                         ,const P& end)
+    {
+        float kappa      = KAPPA;
+        float T          = 1.0f;
+        int samples      = 0;
+        int samplesSaved = 0;
+        float accum[3]   = { 0.0f, 0.0f, 0.0f };
+        V N              = end - start;
+        float distance   = glm::length(N);
+
+        if (distance <= 0.0f) {
+            return RayMarch(Color(0.0f, 0.0f, 0.0f), T);
+        }
+
+        N /= distance;
+
+        walkCells(vb, 1, start, N, distance, [&](int vi, int vj, int vk, float s, float length) {
+
+            float density = vb(vi, vj, vk);
+
+            // Empty voxels neither attenuate nor add color:
+            if (density <= 0.0f) {
+                return true;
+            }
+
+            P X               = start + (N * (s + (0.5f * length)));
+            float deltaT      = exp(-kappa * length * density);
+            float attenuation = (1.0f - deltaT) / kappa;
+
+            // Light scattered over the segment is attenuated by what lies in
+            // front of the segment, not by the segment itself: the integral
+            // of kappa * T(s) over it is T * (1 - deltaT). Segments are a
+            // whole voxel long, so shading with the transmittance past the
+            // segment would darken dense voxels noticeably
+            typename Shading::Sample material = Shading::at(params, X);
+
+            for (int k=0; k<Lights; k++) {
+
+                float lightT = vb.light(k, vi, vj, vk);
+
+                if (lightT < 0.0f) {
+                    P center;
+                    vb.center(vi, vj, vk, center);
+                    lightT = Q(vb, kappa, center, params.lightPosition[k], params.shadowEpsilon);
+                }
+
+                const Color& c = Shading::light(params, material, k);
+                accum[0] = std::min(accum[0] + (((c.fR() * attenuation) * T) * lightT), 1.0f);
+                accum[1] = std::min(accum[1] + (((c.fG() * attenuation) * T) * lightT), 1.0f);
+                accum[2] = std::min(accum[2] + (((c.fB() * attenuation) * T) * lightT), 1.0f);
+            }
+
+            T *= deltaT;
+            samples++;
+
+            if (T < params.cutoff) {
+
+                if (params.roulette && unitHash(X, samples) * params.cutoff < T) {
+                    T = params.cutoff;
+                    return true;
+                }
+
+                if (params.roulette) {
+                    T = 0.0f;
+                }
+
+                // Voxels left: at most one boundary crossing per grid unit
+                // travelled along each axis
+                vec3 left    = glm::abs(vb.directionToGrid(N)) * (distance - (s + length));
+                samplesSaved = static_cast<int>(left.x + left.y + left.z);
+                return false;
+            }
+
+            return true;
+        });
+
+        return RayMarch(Color(accum[0], accum[1], accum[2]), T, samples, samplesSaved);
+    }
+
+} DDAKernel;
+
+float DDAMarch::shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const
+{
+    return Q(vb, KAPPA, X, to, epsilon);
+}
+
+/**
+ * Densities are read whole, so the kernel is the same with interpolation on
+ */
+MarchKernel DDAMarch::kernel(bool interpolate, bool textured, int lights) const
+{
+    return composeKernel<DDAKernel>(false, textured, lights);
+}
@@ -0,0 +1,116 @@
+#ifndef _DDA_MARCH_H
+#define _DDA_MARCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <glm/glm.hpp>
+#include "MarchPolicy.h"
+#include "R3.h"
+#include "Voxel.h"
+
+/*******************************************************************************
+ * Exact traversal: rays and shadow rays walk every voxel they cross instead
+ * of stepping, integrating over the exact length of the ray inside each. It
+ * needs no state besides the buffer
+ ******************************************************************************/
+
+class DDAMarch : public MarchPolicy
+{
+    public:
+        virtual MarchKernel kernel(bool interpolate, bool textured, int lights) const;
+        virtual float shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const;
+
+        std::string getTypeName() const { return "DDAMarch"; };
+};
+
+/******************************************************************************/
+
+float Q(const VoxelBuffer& vb
+       ,float kappa
+       ,const P& X
+       ,const P& to
+       ,float epsilon = 0.0f);
+
+/******************************************************************************/
+
+/**
+ * Walks the cells of size^3 voxels crossed by the segment that starts at X
+ * and runs for the given distance along unit direction N, in order
+ * (Amanatides & Woo). With a size of 1 these are the voxels themselves, and
+ * with MACROCELL_SIZE the macrocells. For every cell, f(i, j, k, s, length)
+ * is given the cell's index, the distance along the segment at which the
+ * cell is entered and the length of the segment inside it. The walk ends
+ * when f returns false, at the end of the segment, or where the segment
+ * leaves the grid.
+ *
+ * Voxel boundaries are the exact ones center() uses. A start point just off
+ * the grid, as BoundingBox::isHit() can give, is taken to be in the nearest
+ * cell
+ */
+template<typename F>
+inline void walkCells(const VoxelBuffer& vb
+                     ,int size
+                     ,const P& X
+                     ,const V& N
+                     ,float distance
+                     ,F f)
+{
+    auto& bounds    = vb.getBoundingBox();
+    glm::ivec3 dim  = (vb.getDimensions() + (size - 1)) / size;
+    glm::vec3 scale = glm::vec3(vb.getDimensions()) / ((bounds.getP2().p - bounds.getP1().p) * static_cast<float>(size));
+    glm::vec3 G     = (X.p - bounds.getP1().p) * scale;
+    glm::vec3 dG    = N * scale;
+
+    int cell[3], advance[3];
+    float next[3], delta[3];
+
+    for (int a=0; a<3; a++) {
+
+        cell[a] = std::min(std::max(static_cast<int>(std::floor(G[a])), 0), dim[a] - 1);
+
+        if (dG[a] > 0.0f) {
+            advance[a] = 1;
+            delta[a]   = 1.0f / dG[a];
+            next[a]    = (static_cast<float>(cell[a] + 1) - G[a]) * delta[a];
+        } else if (dG[a] < 0.0f) {
+            advance[a] = -1;
+            delta[a]   = -1.0f / dG[a];
+            next[a]    = (G[a] - static_cast<float>(cell[a])) * delta[a];
+        } else {
+            advance[a] = 0;
+            delta[a]   = std::numeric_limits<float>::infinity();
+            next[a]    = std::numeric_limits<float>::infinity();
+        }
+    }
+
+    float s = 0.0f;
+
+    while (s < distance) {
+
+        // The axis whose voxel boundary comes first:
+        int a = next[0] < next[1]
+            ? (next[0] < next[2] ? 0 : 2)
+            : (next[1] < next[2] ? 1 : 2);
+
+        float exit = std::min(next[a], distance);
+
+        if (exit > s) {
+            if (!f(cell[0], cell[1], cell[2], s, exit - s)) {
+                return;
+            }
+            s = exit;
+        }
+
+        cell[a] += advance[a];
+
+        if (cell[a] < 0 || cell[a] >= dim[a]) {
+            return;
+        }
+
+        next[a] += delta[a];
+    }
+}
+
+#endif
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include "DensityStorage.h"
+#include "Scheduler.h"
+#include "VolumeFile.h"
+
+/******************************************************************************/
+
+// Number of voxels handed to a worker at a time while (de)quantizing
+#define QUANTIZE_GRAIN 65536
+
+/******************************************************************************/
+
+using namespace std;
+
+/******************************************************************************/
+
+// Storage is saved and mapped as it is:
+static_assert(sizeof(QuantRange) == 2 * sizeof(float), "Quantization ranges are saved as pairs of floats");
+
+/**
+ *
+ */
+DensityStorage::DensityStorage() :
+    format(FORMAT_FLOAT),
+    densities(make_shared<vector<float> >()),
+    shift(0),
+    maxError(0.0f),
+    rmsError(0.0f),
+    data(nullptr),
+    count(0)
+{
+    this->bind();
+}
+
+/**
+ *
+ */
+DensityStorage::DensityStorage(shared_ptr<vector<float> > _densities) :
+    format(FORMAT_FLOAT),
+    densities(_densities),
+    shift(0),
+    maxError(0.0f),
+    rmsError(0.0f),
+    data(nullptr),
+    count(0)
+{
+    assert(_densities);
+    this->bind();
+}
+
+/**
+ * Reads the voxels of the given volume file where they lie in its mapping
+ */
+DensityStorage::DensityStorage(shared_ptr<VolumeFile> file) :
+    format(static_cast<VoxelFormat>(file->getHeader().format)),
+    densities(make_shared<vector<float> >()),
+    shift(file->getHeader().quantShift),
+    maxError(file->getHeader().quantMaxError),
+    rmsError(file->getHeader().quantRMSError),
+    data(file->at(file->getHeader().data)),
+    count(0),
+    mapping(file)
+{
+    const VolumeHeader& header = file->getHeader();
+
+    if (header.format > FORMAT_UINT8) {
+        throw runtime_error("Unknown voxel format in volume file: " + file->getFilename());
+    }
+
+    this->count  = static_cast<int>(header.data.bytes / this->voxelBytes());
+    this->ranges = file->read<QuantRange>(header.ranges);
+}
+
+DensityStorage::DensityStorage(const DensityStorage& other) :
+    format(other.format),
+    densities(other.densities),
+    codes(other.codes),
+    ranges(other.ranges),
+    shift(other.shift),
+    maxError(other.maxError),
+    rmsError(other.rmsError),
+    data(other.data),
+    count(other.count),
+    mapping(other.mapping)
+{
+    // The codes were copied:
+    this->bind();
+}
+
+DensityStorage& DensityStorage::operator=(const DensityStorage& other)
+{
+    if (this != &other) {
+        this->format    = other.format;
+        this->densities = other.densities;
+        this->codes     = other.codes;
+        this->ranges    = other.ranges;
+        this->shift     = other.shift;
+        this->maxError  = other.maxError;
+        this->rmsError  = other.rmsError;
+        this->data      = other.data;
+        this->count     = other.count;
+        this->mapping   = other.mapping;
+        this->bind();
+    }
+
+    return *this;
+}
+
+/**
+ * Points the samplers at the densities or the codes, whichever the format
+ * keeps. Mapped storage keeps reading the file
+ */
+void DensityStorage::bind()
+{
+    if (this->isMapped()) {
+        return;
+    }
+
+    if (this->format == FORMAT_FLOAT) {
+        this->data  = reinterpret_cast<const uint8_t*>(this->densities->data());
+        this->count = static_cast<int>(this->densities->size());
+    } else {
+        this->data  = this->codes.data();
+        this->count = static_cast<int>(this->codes.size() / (this->format == FORMAT_UINT8 ? 1 : 2));
+    }
+}
+
+void DensityStorage::setDensities(shared_ptr<vector<float> > densities)
+{
+    assert(this->format == FORMAT_FLOAT && !this->isMapped());
+
+    this->densities = densities;
+    this->bind();
+}
+
+void DensityStorage::grow(int voxels)
+{
+    assert(this->format == FORMAT_FLOAT && !this->isMapped());
+
+    this->densities->resize(this->densities->size() + static_cast<size_t>(voxels), 0.0f);
+    this->bind();
+}
+
+void DensityStorage::detach()
+{
+    if (!this->isMapped()) {
+        return;
+    }
+
+    if (this->format == FORMAT_FLOAT) {
+        const float* mapped = reinterpret_cast<const float*>(this->data);
+        this->densities     = make_shared<vector<float> >(mapped, mapped + this->count);
+    } else {
+        size_t bytes = static_cast<size_t>(this->count) * this->voxelBytes();
+        this->codes.assign(this->data, this->data + bytes);
+    }
+
+    this->mapping.reset();
+    this->bind();
+}
+
+bool DensityStorage::hasRanges() const
+{
+    if (this->format == FORMAT_FLOAT) {
+        return true;
+    }
+
+    return this->shift >= 0 && this->shift <= 31 && this->count > 0 &&
+           static_cast<size_t>((this->count - 1) >> this->shift) < this->ranges.size();
+}
+
+/**
+ * Every block gets codes spread evenly from its smallest density to its
+ * largest, and every density is rounded to the nearest code. Going back to
+ * floats keeps the error
+ */
+void DensityStorage::setFormat(VoxelFormat format, int shift)
+{
+    if (format == this->format) {
+        return;
+    }
+
+    this->detach();
+
+    int count = this->count;
+
+    if (this->format != FORMAT_FLOAT) {
+
+        auto expanded = make_shared<vector<float> >(count);
+
+        parallelFor(count, QUANTIZE_GRAIN, [&](int begin, int end) {
+            for (int w=begin; w<end; w++) {
+                (*expanded)[w] = this->value(w);
+            }
+        });
+
+        this->densities = expanded;
+        this->format    = FORMAT_FLOAT;
+        vector<uint8_t>().swap(this->codes);
+        vector<QuantRange>().swap(this->ranges);
+        this->bind();
+    }
+
+    if (format == FORMAT_FLOAT) {
+        return;
+    }
+
+    auto source   = this->densities;
+    int blockSize = shift >= 31 ? count : 1 << shift;
+    int blocks    = count / blockSize;
+    float levels  = format == FORMAT_UINT8 ? 255.0f : 65535.0f;
+
+    this->shift = shift;
+    this->ranges.assign(blocks, QuantRange());
+    this->codes.assign(static_cast<size_t>(count) * (format == FORMAT_UINT8 ? 1 : 2), 0);
+
+    parallelFor(blocks, 1, [&](int begin, int end) {
+        for (int b=begin; b<end; b++) {
+            auto first = source->begin() + (static_cast<size_t>(b) * blockSize);
+            auto range = std::minmax_element(first, first + blockSize);
+            this->ranges[b] = QuantRange(*range.first, (*range.second - *range.first) / levels);
+        }
+    });
+
+    uint8_t* codes8   = this->codes.data();
+    uint16_t* codes16 = reinterpret_cast<uint16_t*>(this->codes.data());
+
+    parallelFor(count, QUANTIZE_GRAIN, [&](int begin, int end) {
+        for (int w=begin; w<end; w++) {
+
+            const QuantRange& range = this->ranges[w >> this->shift];
+            float code = range.scale > 0.0f ? std::round(((*source)[w] - range.offset) / range.scale) : 0.0f;
+            code       = std::min(std::max(code, 0.0f), levels);
+
+            if (format == FORMAT_UINT8) {
+                codes8[w] = static_cast<uint8_t>(code);
+            } else {
+                codes16[w] = static_cast<uint16_t>(code);
+            }
+        }
+    });
+
+    this->format    = format;
+    this->densities = make_shared<vector<float> >();
+    this->bind();
+}
+
+void DensityStorage::getQuantizationError(float& maxError, float& rmsError) const
+{
+    maxError = this->maxError;
+    rmsError = this->rmsError;
+}
+
+void DensityStorage::setQuantizationError(float maxError, float rmsError)
+{
+    this->maxError = maxError;
+    this->rmsError = rmsError;
+}
@@ -0,0 +1,172 @@
+#ifndef _DENSITY_STORAGE_H
+#define _DENSITY_STORAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*******************************************************************************
+ * Precision a voxel buffer stores its densities at:
+ *
+ * FORMAT_FLOAT  - 32-bit floats
+ * FORMAT_UINT16 - 16-bit codes spread evenly over the density range of each
+ *                 brick in the brick layouts, or of the whole volume in the
+ *                 linear layout. A range starting at 0 keeps empty voxels at
+ *                 exactly 0
+ * FORMAT_UINT8  - 8-bit codes, spread the same way
+ ******************************************************************************/
+
+typedef enum VoxelFormat
+{
+    FORMAT_FLOAT,
+    FORMAT_UINT16,
+    FORMAT_UINT8
+} VoxelFormat;
+
+/*******************************************************************************
+ * Mapping from the codes of a quantized brick or volume to densities:
+ * density = offset + (scale * code)
+ ******************************************************************************/
+
+typedef struct QuantRange
+{
+    float offset;
+    float scale;
+
+    QuantRange() : offset(0.0f), scale(0.0f) { };
+    QuantRange(float _offset, float _scale) : offset(_offset), scale(_scale) { };
+
+} QuantRange;
+
+// Forward declarations:
+class VolumeFile;
+
+/*******************************************************************************
+ * The densities of a voxel buffer, by storage index, in one of the formats
+ * above: float densities, codes and their ranges, or the voxels of a mapped
+ * volume file in either. Samplers read whichever through one pointer; writes
+ * go to the float densities, which detach() first copies mapped voxels into
+ ******************************************************************************/
+
+class DensityStorage
+{
+    protected:
+        VoxelFormat format;
+        std::shared_ptr<std::vector<float> > densities;
+
+        // Densities of quantized storage, which keeps no floats: one or two
+        // bytes of code per voxel, and the range of every block of voxels.
+        // A storage index shifted right by shift gives the range it belongs to
+        std::vector<uint8_t> codes;
+        std::vector<QuantRange> ranges;
+        int shift;
+        float maxError;      // Largest and RMS error quantizing introduced
+        float rmsError;
+
+        // What the samplers read: the densities or codes, or the voxel data
+        // of a mapped volume file, and the number of voxels stored there
+        const uint8_t* data;
+        int count;
+        std::shared_ptr<VolumeFile> mapping;
+
+        void bind();
+
+        // Corners of a trilinear lookup whose cell lies in one run of
+        // storage, with strides sy and sz between rows and slices, in the
+        // order v000, v001, v010, v011, v100, v101, v110, v111
+        template<typename T>
+        static void gatherCorners(const T* d, int base, int sy, int sz, float v[8])
+        {
+            v[0] = static_cast<float>(d[base]);
+            v[1] = static_cast<float>(d[base + sz]);
+            v[2] = static_cast<float>(d[base + sy]);
+            v[3] = static_cast<float>(d[base + sy + sz]);
+            v[4] = static_cast<float>(d[base + 1]);
+            v[5] = static_cast<float>(d[base + 1 + sz]);
+            v[6] = static_cast<float>(d[base + 1 + sy]);
+            v[7] = static_cast<float>(d[base + 1 + sy + sz]);
+        }
+
+    public:
+        DensityStorage();
+        DensityStorage(std::shared_ptr<std::vector<float> > densities);
+        DensityStorage(std::shared_ptr<VolumeFile> file);
+        DensityStorage(const DensityStorage& other);
+
+        DensityStorage& operator=(const DensityStorage& other);
+
+        VoxelFormat getFormat() const { return this->format; }
+        int size() const { return this->count; }
+
+        // Density at storage index w
+        float value(int w) const
+        {
+            if (this->format == FORMAT_FLOAT) {
+                return reinterpret_cast<const float*>(this->data)[w];
+            }
+
+            const QuantRange& range = this->ranges[w >> this->shift];
+            float code = this->format == FORMAT_UINT8
+                ? static_cast<float>(this->data[w])
+                : static_cast<float>(reinterpret_cast<const uint16_t*>(this->data)[w]);
+
+            return range.offset + (range.scale * code);
+        }
+
+        // Reads the corners of a cell that lies in one run of storage.
+        // Quantized storage leaves them as codes, and hands back the range
+        // of the block they are in, which applies to every corner alike
+        void gatherCell(int base, int sy, int sz, float v[8], float& scale, float& offset) const
+        {
+            if (this->format == FORMAT_FLOAT) {
+                gatherCorners(reinterpret_cast<const float*>(this->data), base, sy, sz, v);
+                return;
+            }
+
+            const QuantRange& range = this->ranges[base >> this->shift];
+            scale  = range.scale;
+            offset = range.offset;
+
+            if (this->format == FORMAT_UINT8) {
+                gatherCorners(this->data, base, sy, sz, v);
+            } else {
+                gatherCorners(reinterpret_cast<const uint16_t*>(this->data), base, sy, sz, v);
+            }
+        }
+
+        // Float densities, for storage that isn't quantized or mapped.
+        // Replacing or growing them rebinds the samplers; new voxels are zero
+        const std::shared_ptr<std::vector<float> >& getDensities() const { return this->densities; }
+        void setDensities(std::shared_ptr<std::vector<float> > densities);
+        void grow(int voxels);
+
+        // Mapped volume files. detach() copies the voxels out of the file,
+        // which is read-only, and lets go of it
+        bool isMapped() const { return this->mapping != nullptr; }
+        void detach();
+
+        // True if every stored voxel has a range to decode it with
+        bool hasRanges() const;
+
+        // Converts the voxels to the given format. Codes are always made
+        // from floats, spread over blocks of 2^shift voxels each; a shift of
+        // 31 gives one range for all of them
+        void setFormat(VoxelFormat format, int shift = 31);
+
+        void getQuantizationError(float& maxError, float& rmsError) const;
+        void setQuantizationError(float maxError, float rmsError);
+
+        // What a volume file saves: the voxels as they are stored, and the
+        // ranges that decode them
+        const uint8_t* getData() const { return this->data; }
+        const std::vector<QuantRange>& getRanges() const { return this->ranges; }
+        int getShift() const { return this->shift; }
+        size_t voxelBytes() const { return this->format == FORMAT_FLOAT ? sizeof(float) : this->format == FORMAT_UINT16 ? 2 : 1; }
+
+        // Bytes held by the voxels and ranges. The voxels of mapped storage
+        // count too, though they live in the page cache
+        size_t bytes() const { return (static_cast<size_t>(this->count) * this->voxelBytes()) + (this->ranges.size() * sizeof(QuantRange)); }
+};
+
+#endif
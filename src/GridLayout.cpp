@@ -0,0 +1,233 @@
+#include <cassert>
+#include "GridLayout.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ *
+ */
+GridLayout::GridLayout(VoxelLayout _type, const ivec3& _dim) :
+    type(_type),
+    brickDim(0, 0, 0)
+{
+    this->setDimensions(_dim);
+}
+
+/**
+ * Recomputes the storage strides for the given dimensions
+ */
+void GridLayout::setDimensions(const ivec3& dim)
+{
+    ivec3 padded   = dim + 2;
+    this->dim      = dim;
+    this->stride   = ivec3(1, padded.x, padded.x * padded.y);
+    this->origin   = this->stride.x + this->stride.y + this->stride.z;
+    this->brickDim = (padded + BRICK_MASK) / BRICK_SIZE;
+
+    // Voxels -1 and dim lie in the first and last sparse bricks:
+    this->sparseDim = ((dim + BRICK_SIZE) / BRICK_SIZE) + 1;
+    this->nodeDim   = (this->sparseDim + SPARSE_NODE_MASK) / SPARSE_NODE_SIZE;
+}
+
+/**
+ * Number of voxels needed to store the grid, plus its apron, in this layout.
+ * The bricked layout rounds every axis up to whole bricks; an empty sparse
+ * grid is just the shared empty brick
+ */
+int GridLayout::storageSize() const
+{
+    ivec3 padded = this->dim + 2;
+
+    if (this->type == LAYOUT_SPARSE) {
+        return static_cast<int>(this->origins.size()) * BRICK_VOXELS;
+    }
+
+    if (this->type == LAYOUT_BRICKED) {
+        return this->brickDim.x * this->brickDim.y * this->brickDim.z * BRICK_VOXELS;
+    }
+
+    return padded.x * padded.y * padded.z;
+}
+
+/**
+ * Convert a storage index to a 3D index. The shared empty brick stands for
+ * many voxels, so maps to the apron
+ */
+void GridLayout::ind2sub(int w, int& i, int& j, int& k) const
+{
+    if (this->type == LAYOUT_BRICKED) {
+        int brick  = w / BRICK_VOXELS;
+        int offset = w & (BRICK_VOXELS - 1);
+        i = ((brick % this->brickDim.x) << BRICK_SHIFT) + (offset & BRICK_MASK) - 1;
+        j = (((brick / this->brickDim.x) % this->brickDim.y) << BRICK_SHIFT) + ((offset >> BRICK_SHIFT) & BRICK_MASK) - 1;
+        k = ((brick / (this->brickDim.x * this->brickDim.y)) << BRICK_SHIFT) + (offset >> (2 * BRICK_SHIFT)) - 1;
+        return;
+    }
+
+    if (this->type == LAYOUT_SPARSE) {
+        int brick  = this->origins[w / BRICK_VOXELS];
+        int offset = w & (BRICK_VOXELS - 1);
+        if (brick < 0) {
+            i = j = k = -1;
+            return;
+        }
+        i = ((brick % this->sparseDim.x) << BRICK_SHIFT) + (offset & BRICK_MASK) - BRICK_SIZE;
+        j = (((brick / this->sparseDim.x) % this->sparseDim.y) << BRICK_SHIFT) + ((offset >> BRICK_SHIFT) & BRICK_MASK) - BRICK_SIZE;
+        k = ((brick / (this->sparseDim.x * this->sparseDim.y)) << BRICK_SHIFT) + (offset >> (2 * BRICK_SHIFT)) - BRICK_SIZE;
+        return;
+    }
+
+    i = (w % this->stride.y) - 1;
+    j = ((w / this->stride.y) % (this->dim.y + 2)) - 1;
+    k = (w / this->stride.z) - 1;
+}
+
+/**
+ *
+ */
+bool GridLayout::emptyNode(int i, int j, int k, vec3& lo, vec3& hi) const
+{
+    if (this->type != LAYOUT_SPARSE) {
+        return false;
+    }
+
+    ivec3 brick = (ivec3(i, j, k) + BRICK_SIZE) >> BRICK_SHIFT;
+
+    if (this->nodes[this->node(brick.x, brick.y, brick.z)] != 0) {
+        return false;
+    }
+
+    lo = vec3(((brick >> SPARSE_NODE_SHIFT) * SPARSE_NODE_VOXELS) - BRICK_SIZE);
+    hi = lo + static_cast<float>(SPARSE_NODE_VOXELS);
+
+    return true;
+}
+
+/*******************************************************************************
+ * Sparse tree
+ ******************************************************************************/
+
+void GridLayout::clear()
+{
+    assert(this->type == LAYOUT_SPARSE);
+
+    this->nodes.assign(this->nodeDim.x * this->nodeDim.y * this->nodeDim.z, 0);
+    this->bricks.assign(SPARSE_NODE_BRICKS, 0);
+    this->origins.assign(1, -1);
+}
+
+/**
+ * New bricks are stored after all the others
+ */
+bool GridLayout::allocateBrick(int bi, int bj, int bk)
+{
+    int node = this->node(bi, bj, bk);
+
+    if (this->nodes[node] == 0) {
+        this->nodes[node] = static_cast<int>(this->bricks.size() / SPARSE_NODE_BRICKS);
+        this->bricks.resize(this->bricks.size() + SPARSE_NODE_BRICKS, 0);
+    }
+
+    int child = this->child(bi, bj, bk);
+
+    if (this->bricks[child] != 0) {
+        return false;
+    }
+
+    this->bricks[child] = static_cast<int>(this->origins.size());
+    this->origins.push_back(bi + (bj * this->sparseDim.x) + (bk * this->sparseDim.x * this->sparseDim.y));
+
+    return true;
+}
+
+/**
+ * A brick is stored whenever density can reach it through a trilinear lookup
+ */
+int GridLayout::allocateAround(int i, int j, int k)
+{
+    // Brick b covers voxels 8(b - 1) .. 8b - 1, and borders the voxels just
+    // before and after those:
+    ivec3 v(i, j, k);
+    ivec3 lo  = glm::max((v + (BRICK_SIZE - 1)) >> BRICK_SHIFT, ivec3(0));
+    ivec3 hi  = glm::min((v + (BRICK_SIZE + 1)) >> BRICK_SHIFT, this->sparseDim - 1);
+    int added = 0;
+
+    for (int bk=lo.z; bk<=hi.z; bk++) {
+        for (int bj=lo.y; bj<=hi.y; bj++) {
+            for (int bi=lo.x; bi<=hi.x; bi++) {
+                added += this->allocateBrick(bi, bj, bk) ? 1 : 0;
+            }
+        }
+    }
+
+    return added;
+}
+
+ivec3 GridLayout::getOrigin(int n) const
+{
+    int b = this->origins[n];
+
+    return ivec3(b % this->sparseDim.x, (b / this->sparseDim.x) % this->sparseDim.y, b / (this->sparseDim.x * this->sparseDim.y));
+}
+
+/**
+ * Origins are checked against the tree, so that ind2sub() maps storage back
+ * to the voxels sub2ind() reads it for
+ */
+bool GridLayout::setTree(const vector<int>& nodes, const vector<int>& bricks, const vector<int>& origins, int stored)
+{
+    this->nodes   = nodes;
+    this->bricks  = bricks;
+    this->origins = origins;
+
+    if (this->type != LAYOUT_SPARSE) {
+        return true;
+    }
+
+    // Every index the samplers will follow has to land in the tree or the
+    // stored bricks:
+    int tables   = static_cast<int>(this->bricks.size() / SPARSE_NODE_BRICKS);
+    bool invalid = this->nodes.size() != static_cast<size_t>(this->nodeDim.x) * this->nodeDim.y * this->nodeDim.z ||
+                   (!this->origins.empty() && this->origins.size() != static_cast<size_t>(stored));
+
+    for (auto n = this->nodes.begin(); n != this->nodes.end() && !invalid; n++) {
+        invalid = *n < 0 || *n >= tables;
+    }
+    for (auto b = this->bricks.begin(); b != this->bricks.end() && !invalid; b++) {
+        invalid = *b < 0 || *b >= stored;
+    }
+
+    // A stored brick with an origin has to stand for a brick of the grid,
+    // the one whose entry in the tree leads back to it:
+    int sparseBricks = this->sparseDim.x * this->sparseDim.y * this->sparseDim.z;
+
+    for (int n=0; n<static_cast<int>(this->origins.size()) && !invalid; n++) {
+
+        int b = this->origins[n];
+
+        if (b < 0) {
+            continue;
+        }
+        if (b >= sparseBricks) {
+            invalid = true;
+            continue;
+        }
+
+        ivec3 brick = this->getOrigin(n);
+        invalid     = this->bricks[this->child(brick.x, brick.y, brick.z)] != n;
+    }
+
+    return !invalid;
+}
+
+void GridLayout::dropTree()
+{
+    vector<int>().swap(this->nodes);
+    vector<int>().swap(this->bricks);
+    vector<int>().swap(this->origins);
+}
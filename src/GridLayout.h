@@ -0,0 +1,217 @@
+#ifndef _GRID_LAYOUT_H
+#define _GRID_LAYOUT_H
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+
+/******************************************************************************/
+
+// Width, height and depth of a brick in the bricked voxel layout, in voxels,
+// and the shift and mask that split an index into brick and offset
+#define BRICK_SIZE 8
+#define BRICK_SHIFT 3
+#define BRICK_MASK (BRICK_SIZE - 1)
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+// Width, height and depth of a node of the sparse layout's tree, in bricks,
+// and the shift and mask that split a brick index into node and child
+#define SPARSE_NODE_SIZE 8
+#define SPARSE_NODE_SHIFT 3
+#define SPARSE_NODE_MASK (SPARSE_NODE_SIZE - 1)
+#define SPARSE_NODE_BRICKS (SPARSE_NODE_SIZE * SPARSE_NODE_SIZE * SPARSE_NODE_SIZE)
+
+// Voxels along each axis of a node of the sparse layout's tree
+#define SPARSE_NODE_VOXELS (SPARSE_NODE_SIZE * BRICK_SIZE)
+
+/*******************************************************************************
+ * Order in which a voxel buffer stores its voxels:
+ *
+ * LAYOUT_LINEAR  - x fastest, then y, then z
+ * LAYOUT_BRICKED - BRICK_SIZE^3 bricks stored one after the other in linear
+ *                  order, each brick's voxels stored linearly. All eight
+ *                  corners of a trilinear lookup, and most of the steps of a
+ *                  ray in any direction, then fall in the same few cache lines
+ * LAYOUT_SPARSE  - BRICK_SIZE^3 bricks reached through a two level tree:
+ *                  a grid of nodes, each a table of SPARSE_NODE_SIZE^3
+ *                  bricks. Only bricks with density in or right around them
+ *                  are stored; every other brick, and every child table of
+ *                  a node without any, is one shared block of zeros. Bricks
+ *                  line up with macrocells, and start BRICK_SIZE voxels
+ *                  before the grid so the apron falls in bricks of its own
+ ******************************************************************************/
+
+typedef enum VoxelLayout
+{
+    LAYOUT_LINEAR,
+    LAYOUT_BRICKED,
+    LAYOUT_SPARSE
+} VoxelLayout;
+
+/*******************************************************************************
+ * Where each voxel of a grid, plus its one voxel apron, is stored in one of
+ * the layouts above: storage indices, and in the sparse layout the tree that
+ * decides which bricks are stored at all. It only addresses storage; what is
+ * stored there, and at what precision, is up to its owner
+ ******************************************************************************/
+
+class GridLayout
+{
+    protected:
+        VoxelLayout type;
+        glm::ivec3 dim;
+        glm::ivec3 brickDim; // Bricks along each axis, in the bricked layout
+        glm::ivec3 stride;   // Linear storage strides along each axis
+        int origin;          // Linear storage index of voxel (0,0,0)
+
+        // Tree of the sparse layout. Node n's child table starts at entry
+        // nodes[n] * SPARSE_NODE_BRICKS of bricks, and holds the brick each
+        // child is stored as. Table 0 and brick 0 are the shared empty ones;
+        // origins maps a stored brick back to its linear index in the
+        // sparseDim grid of bricks
+        glm::ivec3 sparseDim;
+        glm::ivec3 nodeDim;
+        std::vector<int> nodes;
+        std::vector<int> bricks;
+        std::vector<int> origins;
+
+        // Node of the tree that brick (bi,bj,bk) lies in, and the index into
+        // bricks of that brick's entry
+        int node(int bi, int bj, int bk) const
+        {
+            return (bi >> SPARSE_NODE_SHIFT) +
+                   (bj >> SPARSE_NODE_SHIFT) * this->nodeDim.x +
+                   (bk >> SPARSE_NODE_SHIFT) * this->nodeDim.x * this->nodeDim.y;
+        }
+        int child(int bi, int bj, int bk) const
+        {
+            return (this->nodes[this->node(bi, bj, bk)] * SPARSE_NODE_BRICKS) +
+                   (bi & SPARSE_NODE_MASK) +
+                   ((bj & SPARSE_NODE_MASK) << SPARSE_NODE_SHIFT) +
+                   ((bk & SPARSE_NODE_MASK) << (2 * SPARSE_NODE_SHIFT));
+        }
+
+    public:
+        GridLayout(VoxelLayout type = LAYOUT_LINEAR, const glm::ivec3& dim = glm::ivec3(0, 0, 0));
+
+        VoxelLayout getType() const { return this->type; }
+        const glm::ivec3& getStride() const { return this->stride; }
+
+        // Resizes the grid. The sparse tree is left as it is, so needs
+        // clearing or loading to match
+        void setDimensions(const glm::ivec3& dim);
+
+        // Brick of one of the brick layouts that voxel (i,j,k) is stored in,
+        // and its index within that brick. Brick 0 of the sparse layout is
+        // the shared empty one
+        int locate(int i, int j, int k, int& offset) const
+        {
+            if (this->type == LAYOUT_BRICKED) {
+                i++;
+                j++;
+                k++;
+                offset = (i & BRICK_MASK) +
+                         ((j & BRICK_MASK) << BRICK_SHIFT) +
+                         ((k & BRICK_MASK) << (2 * BRICK_SHIFT));
+                return (i >> BRICK_SHIFT) +
+                       (j >> BRICK_SHIFT) * this->brickDim.x +
+                       (k >> BRICK_SHIFT) * this->brickDim.x * this->brickDim.y;
+            }
+
+            i += BRICK_SIZE;
+            j += BRICK_SIZE;
+            k += BRICK_SIZE;
+            offset = (i & BRICK_MASK) +
+                     ((j & BRICK_MASK) << BRICK_SHIFT) +
+                     ((k & BRICK_MASK) << (2 * BRICK_SHIFT));
+            return this->bricks[this->child(i >> BRICK_SHIFT, j >> BRICK_SHIFT, k >> BRICK_SHIFT)];
+        }
+
+        // Storage index of voxel (i,j,k)
+        int sub2ind(int i, int j, int k) const
+        {
+            if (this->type == LAYOUT_LINEAR) {
+                return this->origin + i + (j * this->stride.y) + (k * this->stride.z);
+            }
+
+            int offset;
+            int brick = this->locate(i, j, k, offset);
+            return (brick * BRICK_VOXELS) + offset;
+        }
+
+        // Voxel stored at storage index w. Indices in the apron, in unused
+        // parts of edge bricks or in the sparse layout's shared empty brick
+        // give coordinates outside of the grid
+        void ind2sub(int w, int& i, int& j, int& k) const;
+
+        // True if voxels (i,j,k) through (i+1,j+1,k+1) all lie in the same
+        // brick of one of the brick layouts
+        bool inOneBrick(int i, int j, int k) const
+        {
+            int pad = this->type == LAYOUT_BRICKED ? 1 : BRICK_SIZE;
+            return (((i + pad) & BRICK_MASK) != BRICK_MASK) &&
+                   (((j + pad) & BRICK_MASK) != BRICK_MASK) &&
+                   (((k + pad) & BRICK_MASK) != BRICK_MASK);
+        }
+
+        // False only for voxels in the sparse layout's shared empty brick
+        bool isStored(int i, int j, int k) const { return this->type != LAYOUT_SPARSE || this->sub2ind(i, j, k) >= BRICK_VOXELS; }
+
+        // If voxel (i,j,k) lies in a node of the sparse layout's tree without
+        // any bricks, sets lo and hi to the voxels the node covers
+        bool emptyNode(int i, int j, int k, glm::vec3& lo, glm::vec3& hi) const;
+
+        // Number of voxels stored: the whole padded grid, rounded up to
+        // whole bricks in the bricked layout, or the bricks the sparse tree
+        // holds, the shared empty one included
+        int storageSize() const;
+
+        // Bricks stored in one of the brick layouts, the sparse layout's
+        // shared empty one included. Unlike storageSize(), this doesn't
+        // overflow for grids too large to keep in memory
+        size_t storedBricks() const
+        {
+            return this->type == LAYOUT_SPARSE
+                ? this->origins.size()
+                : static_cast<size_t>(this->brickDim.x) * this->brickDim.y * this->brickDim.z;
+        }
+
+        // Sparse tree
+
+        // Empties the tree: every node points at the shared empty child
+        // table, whose entries all point at the shared empty brick
+        void clear();
+
+        // Stores brick (bi,bj,bk), and the child table of its node, if they
+        // aren't already. Returns true if the brick had to be added
+        bool allocateBrick(int bi, int bj, int bk);
+
+        // Stores every brick that voxel (i,j,k) lies in or borders, and
+        // returns the number that had to be added. Their storage is appended
+        // in the order they are added, after that of the bricks before them
+        int allocateAround(int i, int j, int k);
+
+        const std::vector<int>& getNodes() const { return this->nodes; }
+        const std::vector<int>& getBricks() const { return this->bricks; }
+        const std::vector<int>& getOrigins() const { return this->origins; }
+
+        // Bricks along each axis of the sparse layout, and the one stored
+        // brick n > 0 stands for
+        const glm::ivec3& getSparseDimensions() const { return this->sparseDim; }
+        glm::ivec3 getOrigin(int n) const;
+
+        // Loads the tree of a saved sparse layout, and tests that it fits the
+        // grid, that every index it holds lands in one of its tables or one
+        // of the given number of stored bricks, and that every origin that
+        // isn't negative lies in the grid and leads back to its brick
+        // through the tree. The origins may be left out by readers that
+        // never map storage back to voxels
+        bool setTree(const std::vector<int>& nodes, const std::vector<int>& bricks, const std::vector<int>& origins, int stored);
+
+        // Frees the tree, which is only read in the sparse layout
+        void dropTree();
+
+        size_t treeBytes() const { return (this->nodes.size() + this->bricks.size() + this->origins.size()) * sizeof(int); }
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include "MappedFile.h"
+
+#if defined(WINVER) || defined(_WIN32) || defined(_WIN64)
+    #define MAPPED_FILE_READ
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+/******************************************************************************/
+
+using namespace std;
+
+/******************************************************************************/
+
+MappedFile::MappedFile(const string& _filename, bool sequential) :
+    filename(_filename),
+    bytes(nullptr),
+    length(0)
+{
+#ifdef MAPPED_FILE_READ
+    ifstream file(_filename.c_str(), ios::binary);
+
+    if (!file) {
+        throw runtime_error("Couldn't open file: " + _filename);
+    }
+
+    this->contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    this->bytes  = this->contents.data();
+    this->length = this->contents.size();
+#else
+    int fd = open(_filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        throw runtime_error("Couldn't open file: " + _filename);
+    }
+
+    struct stat info;
+
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw runtime_error("Couldn't read file: " + _filename);
+    }
+
+    // Empty files can't be mapped, and have nothing to map:
+    if (info.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+
+    // The mapping keeps the file open:
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+        throw runtime_error("Couldn't map file: " + _filename);
+    }
+
+    if (sequential) {
+        madvise(mapped, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+    }
+
+    this->bytes  = static_cast<const uint8_t*>(mapped);
+    this->length = static_cast<size_t>(info.st_size);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef MAPPED_FILE_READ
+    if (this->bytes != nullptr) {
+        munmap(const_cast<uint8_t*>(this->bytes), this->length);
+    }
+#endif
+}
+
+/******************************************************************************/
@@ -0,0 +1,37 @@
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*******************************************************************************
+ * Read-only view of a whole file. The file is mapped into memory, so pages
+ * are only read from disk once they are touched, and are shared with the
+ * page cache rather than copied. Systems without mmap() read the file in.
+ * Files read from front to back can say so, which lets the system read
+ * further ahead
+ ******************************************************************************/
+
+class MappedFile
+{
+    protected:
+        std::string filename;
+        const uint8_t* bytes;
+        size_t length;
+        std::vector<uint8_t> contents; // Where the file can't be mapped
+
+    public:
+        MappedFile(const std::string& filename, bool sequential = false);
+        virtual ~MappedFile();
+
+        // MappedFile owns its mapping
+        MappedFile(const MappedFile& other) = delete;
+        MappedFile& operator=(const MappedFile& other) = delete;
+
+        const std::string& getFilename() const { return this->filename; }
+        const uint8_t* data() const            { return this->bytes; }
+        size_t size() const                    { return this->length; }
+};
+
+#endif
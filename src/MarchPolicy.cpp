@@ -0,0 +1,156 @@
+#include <cmath>
+#include "AdaptiveMarch.h"
+#include "DDAMarch.h"
+#include "MarchPolicy.h"
+#include "PreIntegratedMarch.h"
+#include "Utils.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace Utils;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * Policy for marching vb with the given context's options. Options that
+ * don't apply to the buffer fall back to fixed steps: adaptive steps need
+ * its macrocells. Exact traversal takes precedence over the others, and
+ * adaptive steps over pre-integration, whose table is built for a single
+ * step length
+ */
+shared_ptr<MarchPolicy> makeMarchPolicy(const RenderContext& context, const VoxelBuffer& vb)
+{
+    if (context.getDDA()) {
+        return make_shared<DDAMarch>();
+    }
+
+    if (context.getTolerance() > 0.0f && vb.hasMacrocells()) {
+        return make_shared<AdaptiveMarch>(vb, context.getTolerance());
+    }
+
+    if (context.getPreIntegration()) {
+        return make_shared<PreIntegratedMarch>(vb, context.getStep());
+    }
+
+    return make_shared<FixedStepMarch>(context.getStep());
+}
+
+/*******************************************************************************
+ * Fixed steps
+ ******************************************************************************/
+
+float FixedStepMarch::shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const
+{
+    float offset = (2.0f * this->step) + MARCH_EPSILON;
+
+    P LX;
+    V LN;
+    int stepsToLight = traverse(this->step, offset + (jitter * this->step), X, to, LX, LN);
+
+    return Q(vb, KAPPA, this->step, stepsToLight, LX, LN, epsilon);
+}
+
+/**
+ * Same as rayMarchGeneric() without a density function, for a fixed
+ * interpolation mode, material kind and number of lights
+ */
+typedef struct FixedStepKernel
+{
+    template<bool Interpolate, typename Shading, int Lights>
+    static RayMarch march(const MarchParams& params
+                         ,const VoxelBuffer& vb
+                         ,const P& start
+                         ,const P& end)
+    {
+        float step         = params.step;
+        float kappa        = KAPPA;
+        float offset       = (2.0f * step) + MARCH_EPSILON;
+        float T            = 1.0f;
+        int samples        = 0;
+        int samplesSaved   = 0;
+        float accum[3]     = { 0.0f, 0.0f, 0.0f };
+
+        P X;
+        V N;
+        int iterations = traverse(step, MARCH_EPSILON + (params.jitter * step), start, end, X, N);
+
+        bool skipEmpty = vb.hasMacrocells();
+        vec3 G         = vb.positionToGrid(X);
+        vec3 dG        = vb.directionToGrid(N);
+
+        for (int i=0; i<iterations; i++, X += N, G += dG) {
+
+            int vi = -1;
+            int vj = -1;
+            int vk = -1;
+
+            if (!vb.positionToIndex(X, vi, vj, vk)) {
+                break;
+            }
+
+            int skip = skipEmpty ? vb.emptySteps(vi, vj, vk, G, dG) : 0;
+
+            if (skip > 0) {
+                i += skip - 1;
+                X += N * static_cast<float>(skip - 1);
+                G += dG * static_cast<float>(skip - 1);
+                continue;
+            }
+
+            float density     = Interpolate ? vb.getInterpolatedDensity(X) : vb(vi, vj, vk);
+            float deltaT      = exp(-kappa * step * density);
+            float attenuation = (1.0f - deltaT) / kappa;
+
+            T *= deltaT;
+
+            typename Shading::Sample material = Shading::at(params, X);
+
+            for (int k=0; k<Lights; k++) {
+
+                float lightT = vb.light(k, vi, vj, vk);
+
+                if (lightT < 0.0f) {
+                    P center, LX;
+                    V LN;
+                    vb.center(X, center);
+                    int stepsToLight = traverse(step, offset + (params.context->getJitter(vi, vj, vk) * step), center, params.lightPosition[k], LX, LN);
+                    lightT = Q(vb, kappa, step, stepsToLight, LX, LN, params.shadowEpsilon);
+                }
+
+                // Same order of operations as the Color arithmetic in
+                // rayMarchGeneric(), whose clamps are no-ops here:
+                const Color& c = Shading::light(params, material, k);
+                accum[0] = std::min(accum[0] + (((c.fR() * attenuation) * T) * lightT), 1.0f);
+                accum[1] = std::min(accum[1] + (((c.fG() * attenuation) * T) * lightT), 1.0f);
+                accum[2] = std::min(accum[2] + (((c.fB() * attenuation) * T) * lightT), 1.0f);
+            }
+
+            samples++;
+
+            if (T < params.cutoff) {
+
+                if (params.roulette && unitHash(X, i) * params.cutoff < T) {
+                    T = params.cutoff;
+                    continue;
+                }
+
+                if (params.roulette) {
+                    T = 0.0f;
+                }
+
+                samplesSaved = iterations - (i + 1);
+                break;
+            }
+        }
+
+        return RayMarch(Color(accum[0], accum[1], accum[2]), T, samples, samplesSaved);
+    }
+
+} FixedStepKernel;
+
+MarchKernel FixedStepMarch::kernel(bool interpolate, bool textured, int lights) const
+{
+    return composeKernel<FixedStepKernel>(interpolate, textured, lights);
+}
@@ -0,0 +1,149 @@
+#ifndef _MARCH_POLICY_H
+#define _MARCH_POLICY_H
+
+#include <memory>
+#include <string>
+#include "BitmapTexture.h"
+#include "Color.h"
+#include "Context.h"
+#include "R3.h"
+#include "Voxel.h"
+
+/*******************************************************************************
+ * How a voxel buffer is marched: the kernel selectMarchKernel() composes for
+ * the buffer's material and lights, whatever state that kernel reads besides
+ * the buffer itself, and the way shadow rays are marched, both by the kernel
+ * when a voxel has no baked light and by bakeLights(). prepare() builds one
+ * per buffer with makeMarchPolicy(), and it stays fixed until the next
+ * prepare(). Kernels get at their policy through MarchParams::policy
+ ******************************************************************************/
+
+class MarchPolicy
+{
+    public:
+        virtual ~MarchPolicy() { };
+
+        // Kernel for the given interpolation mode, material kind and number
+        // of lights, which is at most MAX_LIGHTS
+        virtual MarchKernel kernel(bool interpolate, bool textured, int lights) const = 0;
+
+        // Transmittance from X towards the point to through vb, or to where
+        // that path leaves the volume if sooner. jitter moves the first sample
+        // along by that fraction of a step, and if epsilon > 0 the march may
+        // stop once the transmittance is known to be below epsilon
+        virtual float shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const = 0;
+
+        virtual std::string getTypeName() const = 0;
+};
+
+/*******************************************************************************
+ * Fixed steps of the context's length, and Q() for shadows
+ ******************************************************************************/
+
+class FixedStepMarch : public MarchPolicy
+{
+    protected:
+        float step;
+
+    public:
+        FixedStepMarch(float _step) : step(_step) { };
+
+        virtual MarchKernel kernel(bool interpolate, bool textured, int lights) const;
+        virtual float shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const;
+
+        std::string getTypeName() const { return "FixedStepMarch"; };
+};
+
+/******************************************************************************/
+
+std::shared_ptr<MarchPolicy> makeMarchPolicy(const RenderContext& ctx, const VoxelBuffer& vb);
+
+/*******************************************************************************
+ * Kernel composition
+ *
+ * Kernels are instantiated for every combination of interpolation mode,
+ * material kind and light count, so their per-sample loops have no virtual
+ * calls, list walks or shared_ptr copies. A policy's kernels are the static
+ * member template march<Interpolate, Shading, Lights>() of a struct, which
+ * composeKernel() picks an instantiation of. Shading is one of the two
+ * below
+ ******************************************************************************/
+
+/**
+ * Constant color materials: the material color is folded into the light
+ * colors up front
+ */
+typedef struct ConstantShading
+{
+    typedef int Sample;
+
+    static Sample at(const MarchParams& params, const P& X) { return 0; }
+
+    static const Color& light(const MarchParams& params, Sample sample, int k)
+    {
+        return params.lightColor[k];
+    }
+
+} ConstantShading;
+
+/**
+ * Bitmap textures: looked up once per sample, through a direct rather than a
+ * virtual call
+ */
+typedef struct TextureShading
+{
+    typedef Color Sample;
+
+    static Sample at(const MarchParams& params, const P& X)
+    {
+        return params.texture->BitmapTexture::colorAt(X, params.origin);
+    }
+
+    static Color light(const MarchParams& params, const Sample& sample, int k)
+    {
+        return params.lightColor[k] * sample;
+    }
+
+} TextureShading;
+
+/**
+ * Kernel for any material, or more lights than there are specializations
+ * for, reading everything through the context
+ */
+RayMarch genericKernel(const MarchParams& params
+                      ,const VoxelBuffer& vb
+                      ,const P& start
+                      ,const P& end);
+
+static_assert(MAX_LIGHTS == 5, "composeKernel() needs a case for every light count up to MAX_LIGHTS");
+
+template<typename Kernels, bool Interpolate, typename Shading>
+static MarchKernel composeKernel(int lights)
+{
+    switch (lights) {
+        case 0: return Kernels::template march<Interpolate, Shading, 0>;
+        case 1: return Kernels::template march<Interpolate, Shading, 1>;
+        case 2: return Kernels::template march<Interpolate, Shading, 2>;
+        case 3: return Kernels::template march<Interpolate, Shading, 3>;
+        case 4: return Kernels::template march<Interpolate, Shading, 4>;
+        case 5: return Kernels::template march<Interpolate, Shading, 5>;
+    }
+
+    return genericKernel;
+}
+
+template<typename Kernels>
+static MarchKernel composeKernel(bool interpolate, bool textured, int lights)
+{
+    if (textured) {
+        return interpolate
+            ? composeKernel<Kernels, true, TextureShading>(lights)
+            : composeKernel<Kernels, false, TextureShading>(lights);
+    }
+
+    return interpolate
+        ? composeKernel<Kernels, true, ConstantShading>(lights)
+        : composeKernel<Kernels, false, ConstantShading>(lights);
+}
+
+#endif
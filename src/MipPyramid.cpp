@@ -0,0 +1,175 @@
+#include <cassert>
+#include "MipPyramid.h"
+#include "Scheduler.h"
+#include "Voxel.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace Utils;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * Builds the mip pyramid from the current densities, halving the resolution
+ * (rounding up) at every level until a level is a single voxel or there are
+ * MIP_MAX_LEVELS of them
+ */
+void MipPyramid::build(const VoxelBuffer& vb, MipFilter filter)
+{
+    assert(vb.hasLoadedDimensions());
+
+    // Taps over parent voxels 2i-1 .. 2i+2 for child voxel i:
+    const float box[4]      = { 0.0f, 0.5f, 0.5f, 0.0f };
+    const float gaussian[4] = { 0.125f, 0.375f, 0.375f, 0.125f };
+    const float* taps       = filter == MIP_GAUSSIAN ? gaussian : box;
+
+    this->clear();
+
+    const VoxelBuffer* parent = &vb;
+
+    while (static_cast<int>(this->levels.size()) < MIP_MAX_LEVELS) {
+
+        ivec3 from = parent->gridDim;
+        ivec3 to   = (from + 1) / 2;
+
+        if (from.x <= 1 && from.y <= 1 && from.z <= 1) {
+            break;
+        }
+
+        auto densities = make_shared<vector<float> >(to.x * to.y * to.z, 0.0f);
+
+        // Parent voxels off the grid repeat its edges, so the edges of odd
+        // sized levels don't fade:
+        auto tap = [&](int c, int t, int axis) {
+            return std::min(std::max((2 * c) - 1 + t, 0), from[axis] - 1);
+        };
+
+        parallelFor(to.z, 1, [&](int begin, int end) {
+            for (int k=begin; k<end; k++) {
+                for (int j=0; j<to.y; j++) {
+                    for (int i=0; i<to.x; i++) {
+
+                        float sum = 0.0f;
+
+                        for (int tk=0; tk<4; tk++) {
+                            for (int tj=0; tj<4; tj++) {
+
+                                float weight = taps[tk] * taps[tj];
+
+                                if (weight == 0.0f) {
+                                    continue;
+                                }
+
+                                for (int ti=0; ti<4; ti++) {
+                                    sum += weight * taps[ti] * (*parent)(tap(i, ti, 0), tap(j, tj, 1), tap(k, tk, 2));
+                                }
+                            }
+                        }
+
+                        (*densities)[i + (j * to.x) + (k * to.x * to.y)] = sum;
+                    }
+                }
+            }
+        });
+
+        auto level = make_shared<VoxelBuffer>(to, densities, vb.bounds, vb.getMaterial());
+        level->setLayout(vb.getLayout());
+        level->setFormat(vb.getFormat());
+
+        this->levels.push_back(level);
+        parent = level.get();
+    }
+}
+
+void MipPyramid::clear()
+{
+    this->levels.clear();
+    this->contexts.clear();
+}
+
+/**
+ * Readies every level to march with ctx, the context vb is prepared with,
+ * but with its step scaled to the level's voxel size
+ */
+void MipPyramid::prepare(const VoxelBuffer& vb, const RenderContext& ctx)
+{
+    this->contexts.assign(this->levels.size(), ctx);
+
+    for (size_t l=0; l<this->levels.size(); l++) {
+        this->contexts[l].setStep(ctx.getStep() * (this->levels[l]->voxelSize() / vb.voxelSize()));
+        this->levels[l]->prepareMarch(this->contexts[l]);
+    }
+}
+
+/**
+ * Fills in the light planes of level from those of the next finer level,
+ * averaging the baked transmittances of the 2x2x2 voxels each voxel covers.
+ * Voxels that cover none are left unbaked
+ */
+void MipPyramid::filterLevel(VoxelBuffer& level, const VoxelBuffer& finer)
+{
+    int count   = level.storage.size();
+    ivec3 dim   = level.getDimensions();
+    ivec3 limit = finer.getDimensions() - 1;
+
+    level.lightPlanes.assign(finer.lightPlanes.size(), vector<float>(count, -1.0f));
+
+    for (size_t l=0; l<level.lightPlanes.size(); l++) {
+
+        parallelFor(dim.z, 1, [&](int begin, int end) {
+            for (int k=begin; k<end; k++) {
+                for (int j=0; j<dim.y; j++) {
+                    for (int i=0; i<dim.x; i++) {
+
+                        float sum = 0.0f;
+                        int baked = 0;
+
+                        for (int c=0; c<8; c++) {
+
+                            ivec3 from = glm::min((ivec3(i, j, k) * 2) + ivec3(c & 1, (c >> 1) & 1, c >> 2), limit);
+                            float T    = finer.light(static_cast<int>(l), from.x, from.y, from.z);
+
+                            if (T >= 0.0f) {
+                                sum += T;
+                                baked++;
+                            }
+                        }
+
+                        // Nothing in the shared empty brick is ever baked:
+                        if (baked > 0 && level.layout.isStored(i, j, k)) {
+                            level.lightPlanes[l][level.sub2ind(i, j, k)] = sum / static_cast<float>(baked);
+                        }
+                    }
+                }
+            }
+        });
+    }
+}
+
+/**
+ * Filters the light planes of every level down from those vb has baked
+ */
+void MipPyramid::filterLights(const VoxelBuffer& vb)
+{
+    for (size_t l=0; l<this->levels.size(); l++) {
+        MipPyramid::filterLevel(*this->levels[l], l > 0 ? *this->levels[l - 1] : vb);
+    }
+}
+
+/**
+ * The coarsest level whose voxels are no wider than MIP_FOOTPRINT_SCALE of a
+ * ray footprint, where level 0 is the buffer itself
+ */
+int MipPyramid::levelFor(float footprint) const
+{
+    int level = 0;
+    float max = footprint * MIP_FOOTPRINT_SCALE;
+
+    while (level < static_cast<int>(this->levels.size()) && this->levels[level]->voxelSize() <= max) {
+        level++;
+    }
+
+    return level;
+}
@@ -0,0 +1,68 @@
+#ifndef _MIP_PYRAMID_H
+#define _MIP_PYRAMID_H
+
+#include <memory>
+#include <vector>
+#include "Context.h"
+
+/******************************************************************************/
+
+// Most levels a voxel buffer's mip pyramid has besides the buffer itself
+#define MIP_MAX_LEVELS 8
+
+// Widest voxel a ray is marched through, as a fraction of its footprint.
+// Filtering densities makes thin parts of a volume more opaque than the
+// pixel's average over them, so levels are kept finer than the footprint
+#define MIP_FOOTPRINT_SCALE 0.5f
+
+/*******************************************************************************
+ * Filter that builds each level of a mip pyramid from the level below:
+ *
+ * MIP_BOX      - average of the 2x2x2 voxels a coarse voxel covers
+ * MIP_GAUSSIAN - binomial (1 3 3 1) filter over those voxels and one more on
+ *                every side, which aliases less at the cost of some blur
+ ******************************************************************************/
+
+typedef enum MipFilter
+{
+    MIP_BOX,
+    MIP_GAUSSIAN
+} MipFilter;
+
+// Forward declarations:
+class VoxelBuffer;
+
+/*******************************************************************************
+ * Mip pyramid of a voxel buffer: level l + 1 is at half the resolution of
+ * level l, level 0 being the buffer itself. Each level is a voxel buffer of
+ * its own, with the same bounds, material, layout and format, readied by
+ * prepare() to march with a context whose step is scaled to its voxel size.
+ * Levels don't bake their light planes; they are filtered down from the
+ * level below
+ ******************************************************************************/
+
+class MipPyramid
+{
+    protected:
+        std::vector<std::shared_ptr<VoxelBuffer> > levels; // Levels 1 and up
+        std::vector<RenderContext> contexts;
+
+        static void filterLevel(VoxelBuffer& level, const VoxelBuffer& finer);
+
+    public:
+        bool empty() const { return this->levels.empty(); }
+        int getLevels() const { return static_cast<int>(this->levels.size()); }
+
+        // Level l > 0, and the context prepare() gave it
+        const VoxelBuffer& getLevel(int l) const { return *this->levels[l - 1]; }
+        const RenderContext& getContext(int l) const { return this->contexts[l - 1]; }
+
+        void build(const VoxelBuffer& vb, MipFilter filter);
+        void clear();
+        int levelFor(float footprint) const;
+
+        void prepare(const VoxelBuffer& vb, const RenderContext& ctx);
+        void filterLights(const VoxelBuffer& vb);
+};
+
+#endif
@@ -0,0 +1,469 @@
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <list>
+#include <memory>
+#include <glm/glm.hpp>
+#include "Color.h"
+#include "Light.h"
+#include "Packet.h"
+#include "Utils.h"
+#include "Voxel.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+/*******************************************************************************
+ * SSE2 helpers
+ ******************************************************************************/
+
+// Picks a where mask is set and b elsewhere
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Expands a lane bitmask to a full-width SSE mask
+static inline __m128 laneMask(int mask)
+{
+    return _mm_castsi128_ps(_mm_set_epi32((mask & 8) ? -1 : 0
+                                         ,(mask & 4) ? -1 : 0
+                                         ,(mask & 2) ? -1 : 0
+                                         ,(mask & 1) ? -1 : 0));
+}
+
+// SSE2 can only truncate, so floor is built on top of it
+static inline __m128 floor4(__m128 x)
+{
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+}
+
+// Same operation order as Utils::lerp()
+static inline __m128 lerp4(__m128 v1, __m128 v2, __m128 t)
+{
+    return _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(1.0f), t), v1), _mm_mul_ps(t, v2));
+}
+
+// Lanes where 0 <= i < hi
+static inline __m128i inRange4(__m128i i, int hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi32(i, _mm_set1_epi32(-1))
+                        ,_mm_cmplt_epi32(i, _mm_set1_epi32(hi)));
+}
+
+/**
+ * exp(x) by range reduction to x = n*ln(2) + r and a degree 6 polynomial for
+ * exp(r), after the Cephes library's expf()
+ */
+__m128 exp4(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+    x = _mm_max_ps(x, _mm_set1_ps(-88.3762626647949f));
+
+    __m128 n = floor4(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f)));
+
+    // r = x - n*ln(2), with ln(2) split in two to keep the low bits:
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 z = _mm_mul_ps(x, x);
+    __m128 y = _mm_set1_ps(1.9875691500e-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, z), _mm_add_ps(x, one));
+
+    // 2^n, built directly in the exponent bits:
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(0x7f)), 23);
+
+    return _mm_mul_ps(y, _mm_castsi128_ps(e));
+}
+
+/*******************************************************************************
+ * Ray packet
+ ******************************************************************************/
+
+RayPacket::RayPacket(const Ray _rays[PACKET_SIZE], int _mask) :
+    mask(_mask)
+{
+    alignas(16) float o[3][PACKET_SIZE];
+    alignas(16) float d[3][PACKET_SIZE];
+
+    for (int l=0; l<PACKET_SIZE; l++) {
+        this->rays[l] = _rays[l];
+        o[0][l] = x(_rays[l].origin);
+        o[1][l] = y(_rays[l].origin);
+        o[2][l] = z(_rays[l].origin);
+        d[0][l] = x(_rays[l].direction);
+        d[1][l] = y(_rays[l].direction);
+        d[2][l] = z(_rays[l].direction);
+    }
+
+    this->ox = _mm_load_ps(o[0]);
+    this->oy = _mm_load_ps(o[1]);
+    this->oz = _mm_load_ps(o[2]);
+    this->dx = _mm_load_ps(d[0]);
+    this->dy = _mm_load_ps(d[1]);
+    this->dz = _mm_load_ps(d[2]);
+}
+
+/*******************************************************************************
+ * Slab test
+ ******************************************************************************/
+
+int intersectBounds(const BoundingBox& bounds
+                   ,const RayPacket& packet
+                   ,__m128& tNear
+                   ,__m128& tFar)
+{
+    return intersectBounds(&bounds.getP1().p[0], &bounds.getP2().p[0], packet, tNear, tFar);
+}
+
+int intersectBounds(const float lo[3]
+                   ,const float hi[3]
+                   ,const RayPacket& packet
+                   ,__m128& tNear
+                   ,__m128& tFar)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 eps  = _mm_set1_ps(FLT_EPSILON);
+
+    // Zero direction components are nudged to FLT_EPSILON, as in isHit():
+    __m128 xd = select4(_mm_cmpeq_ps(packet.dx, zero), eps, packet.dx);
+    __m128 yd = select4(_mm_cmpeq_ps(packet.dy, zero), eps, packet.dy);
+    __m128 zd = select4(_mm_cmpeq_ps(packet.dz, zero), eps, packet.dz);
+
+    __m128 x1 = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(lo[0]), packet.ox), xd);
+    __m128 x2 = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(hi[0]), packet.ox), xd);
+    __m128 y1 = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(lo[1]), packet.oy), yd);
+    __m128 y2 = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(hi[1]), packet.oy), yd);
+    __m128 z1 = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(lo[2]), packet.oz), zd);
+    __m128 z2 = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(hi[2]), packet.oz), zd);
+
+    __m128 near = _mm_max_ps(_mm_min_ps(x1, x2), _mm_max_ps(_mm_min_ps(y1, y2), _mm_min_ps(z1, z2)));
+    __m128 far  = _mm_min_ps(_mm_max_ps(x1, x2), _mm_min_ps(_mm_max_ps(y1, y2), _mm_max_ps(z1, z2)));
+
+    __m128 miss = _mm_or_ps(_mm_cmpgt_ps(near, far), _mm_cmplt_ps(far, zero));
+
+    tNear = near;
+    tFar  = far;
+
+    return ~_mm_movemask_ps(miss) & packet.mask;
+}
+
+/*******************************************************************************
+ * Density lookups
+ ******************************************************************************/
+
+/**
+ * Voxel density at the given cells, for the lanes in mask
+ */
+static __m128 nearestDensity4(const VoxelBuffer& vb
+                             ,const int cell[3][PACKET_SIZE]
+                             ,int mask)
+{
+    alignas(16) float density[PACKET_SIZE] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (int l=0; l<PACKET_SIZE; l++) {
+        if (mask & (1 << l)) {
+            density[l] = vb(cell[0][l], cell[1][l], cell[2][l]);
+        }
+    }
+
+    return _mm_load_ps(density);
+}
+
+/**
+ * Same as VoxelBuffer::getInterpolatedDensity() for the lanes in mask, at
+ * positions X. Corner indices and weights are computed for all lanes at
+ * once; SSE2 has no gather, so the eight corner loads are done per lane
+ */
+static __m128 interpolatedDensity4(const VoxelBuffer& vb
+                                  ,const __m128 X[3]
+                                  ,int mask)
+{
+    auto& p1    = vb.getBoundingBox().getP1();
+    auto& scale = vb.getInterpolationScale();
+    auto& limit = vb.getInterpolationLimit();
+
+    __m128 w[3];
+    alignas(16) int lo[3][PACKET_SIZE];
+
+    for (int a=0; a<3; a++) {
+        __m128 loc = _mm_mul_ps(_mm_sub_ps(X[a], _mm_set1_ps(p1.p[a])), _mm_set1_ps(scale[a]));
+        loc        = _mm_min_ps(_mm_max_ps(loc, _mm_setzero_ps()), _mm_set1_ps(limit[a]));
+
+        // loc >= 0, so truncation is floor:
+        __m128i cell = _mm_cvttps_epi32(loc);
+        w[a]         = _mm_sub_ps(loc, _mm_cvtepi32_ps(cell));
+        _mm_store_si128(reinterpret_cast<__m128i*>(lo[a]), cell);
+    }
+
+    // v[c][l] is corner c of lane l, where bit 2 of c selects the x corner,
+    // bit 1 the y corner and bit 0 the z corner:
+    alignas(16) float v[8][PACKET_SIZE];
+
+    for (int l=0; l<PACKET_SIZE; l++) {
+
+        if (!(mask & (1 << l))) {
+            for (int c=0; c<8; c++) {
+                v[c][l] = 0.0f;
+            }
+            continue;
+        }
+
+        int i = lo[0][l];
+        int j = lo[1][l];
+        int k = lo[2][l];
+
+        for (int c=0; c<8; c++) {
+            v[c][l] = vb(i + ((c >> 2) & 1), j + ((c >> 1) & 1), k + (c & 1));
+        }
+    }
+
+    // Same order of operations as Utils::trilerp():
+    __m128 c00 = lerp4(_mm_load_ps(v[0]), _mm_load_ps(v[4]), w[0]);
+    __m128 c10 = lerp4(_mm_load_ps(v[2]), _mm_load_ps(v[6]), w[0]);
+    __m128 c01 = lerp4(_mm_load_ps(v[1]), _mm_load_ps(v[5]), w[0]);
+    __m128 c11 = lerp4(_mm_load_ps(v[3]), _mm_load_ps(v[7]), w[0]);
+    __m128 c0  = lerp4(c00, c10, w[1]);
+    __m128 c1  = lerp4(c01, c11, w[1]);
+
+    return _mm_mul_ps(lerp4(c0, c1, w[2]), _mm_set1_ps(1.0f / 3.0f));
+}
+
+/*******************************************************************************
+ * Packet ray march
+ ******************************************************************************/
+
+int rayMarchPacket(const RenderContext& context
+                  ,const VoxelBuffer& vb
+                  ,const RayPacket& packet
+                  ,int mask
+                  ,__m128 tNear
+                  ,__m128 tFar
+                  ,Hit hits[PACKET_SIZE]
+                  ,const float transmittance[PACKET_SIZE]
+                  ,const float jitter[PACKET_SIZE])
+{
+    assert(vb.hasLoadedDimensions());
+
+    float step       = context.getStep();
+    float kappa      = KAPPA;
+    float offset     = (2.0f * step) + MARCH_EPSILON;
+    bool interpolate = context.getInterpolation();
+    bool skipEmpty   = vb.hasMacrocells();
+    auto& lights     = context.getLights();
+    auto material    = vb.getMaterial().get();
+    auto color       = dynamic_cast<Color*>(material);
+    P origin         = vb.getBoundingBox().center();
+    auto& dim        = vb.getDimensions();
+    auto& p1         = vb.getBoundingBox().getP1();
+    vec3 gridScale   = vb.directionToGrid(V(1.0f, 1.0f, 1.0f));
+    int dims[3]      = { dim.x, dim.y, dim.z };
+
+    const __m128 one    = _mm_set1_ps(1.0f);
+    __m128 cutoff       = _mm_set1_ps(context.getCutoff());
+
+    if (transmittance != nullptr) {
+        cutoff = _mm_div_ps(cutoff, _mm_loadu_ps(transmittance));
+    }
+
+    const __m128 lo[3]    = { _mm_set1_ps(x(p1)), _mm_set1_ps(y(p1)), _mm_set1_ps(z(p1)) };
+    const __m128 scale[3] = { _mm_set1_ps(gridScale.x), _mm_set1_ps(gridScale.y), _mm_set1_ps(gridScale.z) };
+
+    // Per-lane setup, the same as at the start of rayMarch():
+    alignas(16) float near[PACKET_SIZE];
+    alignas(16) float far[PACKET_SIZE];
+    alignas(16) float start[3][PACKET_SIZE];
+    alignas(16) float delta[3][PACKET_SIZE];
+    int iterations[PACKET_SIZE];
+    int index[PACKET_SIZE];
+    int samples[PACKET_SIZE];
+    int samplesSaved[PACKET_SIZE];
+    vec3 dG[PACKET_SIZE];
+    int active = 0;
+
+    _mm_store_ps(near, tNear);
+    _mm_store_ps(far, tFar);
+
+    for (int l=0; l<PACKET_SIZE; l++) {
+
+        P X;
+        V N;
+
+        iterations[l] = index[l] = samples[l] = samplesSaved[l] = 0;
+
+        if (mask & (1 << l)) {
+            const Ray& ray = packet.rays[l];
+            P entered      = ray.origin + (ray.direction * near[l]);
+            P exited       = ray.origin + (ray.direction * far[l]);
+            float offset   = jitter != nullptr ? MARCH_EPSILON + (jitter[l] * step) : MARCH_EPSILON;
+            iterations[l]  = traverse(step, offset, entered, exited, X, N);
+            dG[l]          = vb.directionToGrid(N);
+            active        |= iterations[l] > 0 ? (1 << l) : 0;
+        }
+
+        for (int a=0; a<3; a++) {
+            start[a][l] = X.p[a];
+            delta[a][l] = N[a];
+        }
+    }
+
+    __m128 X[3] = { _mm_load_ps(start[0]), _mm_load_ps(start[1]), _mm_load_ps(start[2]) };
+    __m128 N[3] = { _mm_load_ps(delta[0]), _mm_load_ps(delta[1]), _mm_load_ps(delta[2]) };
+    __m128 T    = one;
+    __m128 accum[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+
+    while (active) {
+
+        // Vectorized positionToIndex():
+        __m128i valid = _mm_set1_epi32(-1);
+        alignas(16) int cell[3][PACKET_SIZE];
+        alignas(16) float grid[3][PACKET_SIZE];
+        alignas(16) float position[3][PACKET_SIZE];
+
+        for (int a=0; a<3; a++) {
+            __m128 G    = _mm_mul_ps(_mm_sub_ps(X[a], lo[a]), scale[a]);
+            __m128i C   = _mm_cvttps_epi32(G);
+            valid       = _mm_and_si128(valid, inRange4(C, dims[a]));
+            _mm_store_si128(reinterpret_cast<__m128i*>(cell[a]), C);
+            _mm_store_ps(grid[a], G);
+            _mm_store_ps(position[a], X[a]);
+        }
+
+        // Lanes that have left the volume are done:
+        active &= _mm_movemask_ps(_mm_castsi128_ps(valid));
+
+        if (!active) {
+            break;
+        }
+
+        int evaluate = active;
+        alignas(16) float extra[PACKET_SIZE] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+        // Lanes in an empty macrocell jump past it on their own:
+        if (skipEmpty) {
+            for (int l=0; l<PACKET_SIZE; l++) {
+
+                if (!(active & (1 << l))) {
+                    continue;
+                }
+
+                int skip = vb.emptySteps(cell[0][l], cell[1][l], cell[2][l]
+                                        ,vec3(grid[0][l], grid[1][l], grid[2][l])
+                                        ,dG[l]);
+                if (skip > 0) {
+                    evaluate &= ~(1 << l);
+                    extra[l]  = static_cast<float>(skip - 1);
+                    index[l] += skip - 1;
+                }
+            }
+        }
+
+        if (evaluate) {
+
+            __m128 evaluated   = laneMask(evaluate);
+            __m128 density     = interpolate
+                ? interpolatedDensity4(vb, X, evaluate)
+                : nearestDensity4(vb, cell, evaluate);
+            __m128 deltaT      = exp4(_mm_mul_ps(_mm_set1_ps(-kappa * step), density));
+            __m128 attenuation = _mm_div_ps(_mm_sub_ps(one, deltaT), _mm_set1_ps(kappa));
+
+            T = select4(evaluated, _mm_mul_ps(T, deltaT), T);
+
+            // For every light in the scene:
+            auto li = lights.begin();
+
+            for (int k=0; li != lights.end(); li++, k++) {
+
+                alignas(16) float lightT[PACKET_SIZE]   = { 0.0f, 0.0f, 0.0f, 0.0f };
+                alignas(16) float lit[3][PACKET_SIZE]   = { { 0.0f } };
+
+                for (int l=0; l<PACKET_SIZE; l++) {
+
+                    if (!(evaluate & (1 << l))) {
+                        continue;
+                    }
+
+                    P Xl(position[0][l], position[1][l], position[2][l]);
+                    lightT[l] = vb.light(k, cell[0][l], cell[1][l], cell[2][l]);
+
+                    // Not baked by VoxelBuffer::bakeLights():
+                    if (lightT[l] < 0.0f) {
+                        P center, LX;
+                        V LN;
+                        vb.center(Xl, center);
+                        float jittered   = offset + (context.getJitter(cell[0][l], cell[1][l], cell[2][l]) * step);
+                        int stepsToLight = traverse(step, jittered, center, li->position, LX, LN);
+                        lightT[l] = Q(vb, kappa, step, stepsToLight, LX, LN, context.getShadowEpsilon());
+                    }
+
+                    Color c = li->color * (color ? *color : material->colorAt(Xl, origin));
+                    lit[0][l] = c.fR();
+                    lit[1][l] = c.fG();
+                    lit[2][l] = c.fB();
+                }
+
+                __m128 L = _mm_load_ps(lightT);
+
+                for (int a=0; a<3; a++) {
+                    __m128 c = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_load_ps(lit[a]), attenuation), T), L);
+                    accum[a] = select4(evaluated, _mm_min_ps(_mm_add_ps(accum[a], c), one), accum[a]);
+                }
+            }
+
+            // Early ray termination, as in rayMarch():
+            int done = evaluate & _mm_movemask_ps(_mm_cmplt_ps(T, cutoff));
+
+            for (int l=0; l<PACKET_SIZE; l++) {
+                if (evaluate & (1 << l)) {
+                    samples[l]++;
+                }
+                if (done & (1 << l)) {
+                    samplesSaved[l] = iterations[l] - (index[l] + 1);
+                    active &= ~(1 << l);
+                }
+            }
+        }
+
+        // Step every lane to its next sample:
+        __m128 E = _mm_load_ps(extra);
+
+        for (int a=0; a<3; a++) {
+            X[a] = _mm_add_ps(_mm_add_ps(X[a], _mm_mul_ps(N[a], E)), N[a]);
+        }
+
+        for (int l=0; l<PACKET_SIZE; l++) {
+            if ((active & (1 << l)) && ++index[l] >= iterations[l]) {
+                active &= ~(1 << l);
+            }
+        }
+    }
+
+    alignas(16) float left[PACKET_SIZE];
+    alignas(16) float rgb[3][PACKET_SIZE];
+
+    _mm_store_ps(left, T);
+    _mm_store_ps(rgb[0], accum[0]);
+    _mm_store_ps(rgb[1], accum[1]);
+    _mm_store_ps(rgb[2], accum[2]);
+
+    for (int l=0; l<PACKET_SIZE; l++) {
+        if (mask & (1 << l)) {
+            hits[l].color         = Color(rgb[0][l], rgb[1][l], rgb[2][l]);
+            hits[l].transmittance = left[l];
+            hits[l].samples       = samples[l];
+            hits[l].samplesSaved  = samplesSaved[l];
+        }
+    }
+
+    return mask;
+}
@@ -0,0 +1,75 @@
+#ifndef _PACKET_H
+#define _PACKET_H
+
+#include <emmintrin.h>
+#include "BV.h"
+#include "Context.h"
+#include "Ray.h"
+
+/******************************************************************************/
+
+// Number of rays traced together, one per SSE lane
+#define PACKET_SIZE 4
+
+// Lane mask with every lane set
+#define PACKET_ALL ((1 << PACKET_SIZE) - 1)
+
+// Forward declarations:
+class VoxelBuffer;
+
+/*******************************************************************************
+ * A packet of neighbouring camera rays, stored one component per SSE register
+ * so they can be intersected and marched together. Lane l is in use if bit l
+ * of mask is set
+ ******************************************************************************/
+
+class RayPacket
+{
+    public:
+        Ray rays[PACKET_SIZE]; // The scalar rays, for per-lane fallbacks
+        __m128 ox, oy, oz;     // Origins
+        __m128 dx, dy, dz;     // Directions
+        int mask;
+
+        RayPacket(const Ray rays[PACKET_SIZE], int mask = PACKET_ALL);
+};
+
+/*******************************************************************************
+ * Packet kernels. Each mirrors its scalar counterpart and returns the mask of
+ * lanes it produced a result for
+ ******************************************************************************/
+
+// Slab test of every lane against the box; same as BoundingBox::isHit(), but
+// returns the parametric distances of the entry and exit points instead
+int intersectBounds(const BoundingBox& bounds
+                   ,const RayPacket& packet
+                   ,__m128& tNear
+                   ,__m128& tFar);
+
+// Same as above, for the box spanned by the corners lo and hi
+int intersectBounds(const float lo[3]
+                   ,const float hi[3]
+                   ,const RayPacket& packet
+                   ,__m128& tNear
+                   ,__m128& tFar);
+
+// exp(x) for four lanes at once, accurate to about 1 ulp over the range of
+// float; used for Beer's law
+__m128 exp4(__m128 x);
+
+// Same as rayMarch(), for every lane in mask, from tNear to tFar along the
+// lane's ray. transmittance, if given, is what is left of each lane's ray
+// before it gets here; early termination then applies to the ray as a whole.
+// jitter, if given, moves each lane's first sample along by that fraction of
+// a step
+int rayMarchPacket(const RenderContext& ctx
+                  ,const VoxelBuffer& vb
+                  ,const RayPacket& packet
+                  ,int mask
+                  ,__m128 tNear
+                  ,__m128 tFar
+                  ,Hit hits[PACKET_SIZE]
+                  ,const float transmittance[PACKET_SIZE] = nullptr
+                  ,const float jitter[PACKET_SIZE] = nullptr);
+
+#endif
@@ -0,0 +1,240 @@
+#include <cmath>
+#include "DDAMarch.h"
+#include "PreIntegratedMarch.h"
+#include "Utils.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace Utils;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * Builds the table for steps of the given length, over densities from 0 to
+ * the largest in vb.
+ *
+ * With density rising linearly from f to b over a step of length h, the
+ * transmittance across the step, exp(-kappa * h * (f + b) / 2), and the light
+ * it scatters, (1 - that) / kappa, have closed forms. With the lighting
+ * blending linearly from the front of the step to its middle and on to its
+ * back, how much of that light takes each of the three is integrated
+ * numerically, then scaled to add up to the closed form. Entries are
+ * relative to the transmittance past the step, which the march shades them
+ * with: each is divided by the step's transmittance
+ */
+PreIntegratedMarch::PreIntegratedMarch(const VoxelBuffer& vb, float step)
+{
+    float maxDensity = vb.getMaxDensity();
+
+    double kappa = KAPPA;
+    double h     = step / static_cast<double>(PREINTEGRATION_PIECES);
+
+    this->scale = maxDensity > 0.0f ? static_cast<float>(PREINTEGRATION_SIZE - 1) / maxDensity : 0.0f;
+    this->table.resize(PREINTEGRATION_SIZE * PREINTEGRATION_SIZE);
+
+    for (int a=0; a<PREINTEGRATION_SIZE; a++) {
+        for (int b=0; b<PREINTEGRATION_SIZE; b++) {
+
+            double front     = maxDensity * static_cast<double>(a) / static_cast<double>(PREINTEGRATION_SIZE - 1);
+            double back      = maxDensity * static_cast<double>(b) / static_cast<double>(PREINTEGRATION_SIZE - 1);
+            double slope     = (back - front) / step;
+            double depth     = kappa * step * 0.5 * (front + back);
+            double scattered = expm1(depth) / kappa;
+            double toFront   = 0.0;
+            double toMiddle  = 0.0;
+            double toBack    = 0.0;
+
+            // Midpoint rule, with the optical depth up to each midpoint exact.
+            // No piece straddles the middle of the step:
+            for (int p=0; p<PREINTEGRATION_PIECES; p++) {
+                double t       = (static_cast<double>(p) + 0.5) * h;
+                double density = front + (slope * t);
+                double dL      = density * exp(-kappa * ((front * t) + (0.5 * slope * t * t))) * h;
+                double u       = (2.0 * t) / step; // 0 at the front, 1 in the middle, 2 at the back
+
+                if (u < 1.0) {
+                    toFront  += dL * (1.0 - u);
+                    toMiddle += dL * u;
+                } else {
+                    toMiddle += dL * (2.0 - u);
+                    toBack   += dL * (u - 1.0);
+                }
+            }
+
+            // With no density at all, nothing is scattered:
+            double total = toFront + toMiddle + toBack;
+            double scale = total > 0.0 ? scattered / total : 0.0;
+
+            this->table[(a * PREINTEGRATION_SIZE) + b] = PreIntegral(static_cast<float>(exp(-depth))
+                                                                    ,static_cast<float>(toFront * scale)
+                                                                    ,static_cast<float>(toMiddle * scale)
+                                                                    ,static_cast<float>(toBack * scale));
+        }
+    }
+}
+
+float PreIntegratedMarch::shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const
+{
+    return Q(vb, KAPPA, X, to, epsilon);
+}
+
+/**
+ * Same as FixedStepKernel, but integrating exactly along the ray with density
+ * taken to change linearly from each sample to the next, and lighting to
+ * blend linearly from the front sample's to that of the voxel halfway along
+ * the step, then on to the back sample's. The policy's table gives the
+ * transmittance across each step and the light it scatters under each of
+ * those three lightings. As in FixedStepKernel, that light is shaded with
+ * the transmittance past the step. From where the ray enters to the
+ * first sample and from the last sample to where the ray leaves, density is
+ * taken to be the nearest sample's. Shadows not baked are exact
+ */
+typedef struct PreIntegratedKernel
+{
+    template<bool Interpolate, typename Shading, int Lights>
+    static RayMarch march(const MarchParams& params
+                         ,const VoxelBuffer& vb
+                         ,const P& start
+                         ,const P& end)
+    {
+        auto& policy       = static_cast<const PreIntegratedMarch&>(*params.policy);
+        float step         = params.step;
+        float kappa        = KAPPA;
+        float T            = 1.0f;
+        int samples        = 0;
+        int samplesSaved   = 0;
+        float accum[3]     = { 0.0f, 0.0f, 0.0f };
+        float distance     = dist(start, end);
+        float s            = MARCH_EPSILON + (params.jitter * step); // Distance along the ray to X
+        float last         = 0.0f;  // Distance to the previous sample, or to where the ray entered
+        float front        = -1.0f; // Density at the previous sample; negative where the ray entered
+        bool frontLit      = false; // Whether frontLight and frontMaterial are the previous sample's
+        float frontLight[Lights > 0 ? Lights : 1] = { 0.0f };
+        typename Shading::Sample frontMaterial = typename Shading::Sample();
+
+        auto scatter = [&](const typename Shading::Sample& material, int k, float light) {
+            const Color& c = Shading::light(params, material, k);
+            accum[0] = std::min(accum[0] + ((c.fR() * light) * T), 1.0f);
+            accum[1] = std::min(accum[1] + ((c.fG() * light) * T), 1.0f);
+            accum[2] = std::min(accum[2] + ((c.fB() * light) * T), 1.0f);
+        };
+
+        P X;
+        V N;
+        int iterations = traverse(step, s, start, end, X, N);
+
+        bool skipEmpty = vb.hasMacrocells();
+        vec3 G         = vb.positionToGrid(X);
+        vec3 dG        = vb.directionToGrid(N);
+
+        for (int i=0; i<iterations && s<distance; i++, X += N, G += dG, s += step) {
+
+            int vi = -1;
+            int vj = -1;
+            int vk = -1;
+
+            if (!vb.positionToIndex(X, vi, vj, vk)) {
+                break;
+            }
+
+            int skip = skipEmpty ? vb.emptySteps(vi, vj, vk, G, dG) : 0;
+
+            if (skip > 0) {
+                i += skip - 1;
+                X += N * static_cast<float>(skip - 1);
+                G += dG * static_cast<float>(skip - 1);
+                s += step * static_cast<float>(skip - 1);
+                last     = s;
+                front    = 0.0f;
+                frontLit = false;
+                continue;
+            }
+
+            float back = Interpolate ? vb.getInterpolatedDensity(X) : vb(vi, vj, vk);
+            PreIntegral segment;
+
+            if (front < 0.0f) {
+                float depth = kappa * (s - last) * back;
+                segment     = PreIntegral(exp(-depth), 0.0f, 0.0f, expm1(depth) / kappa);
+            } else {
+                segment = policy.integral(front, back);
+            }
+
+            // The voxel halfway along the step, if the step has a front sample:
+            int mi = -1;
+            int mj = -1;
+            int mk = -1;
+            bool halfway = frontLit && vb.positionToIndex(X + (N * -0.5f), mi, mj, mk);
+
+            typename Shading::Sample material = Shading::at(params, X);
+
+            T *= segment.transmittance;
+
+            for (int k=0; k<Lights; k++) {
+
+                float lightT = vb.light(k, vi, vj, vk);
+
+                if (lightT < 0.0f) {
+                    P center;
+                    vb.center(X, center);
+                    lightT = Q(vb, kappa, center, params.lightPosition[k], params.shadowEpsilon);
+                }
+
+                float fromFront = frontLit ? frontLight[k] : lightT;
+                float middle    = halfway ? vb.light(k, mi, mj, mk) : -1.0f;
+
+                // A middle voxel that wasn't baked, or no middle voxel at
+                // all, takes the mean of the front and back lighting:
+                if (middle < 0.0f) {
+                    middle = 0.5f * (fromFront + lightT);
+                }
+
+                scatter(material, k, (segment.front * fromFront) + (segment.middle * middle) + (segment.back * lightT));
+                frontLight[k] = lightT;
+            }
+
+            last          = s;
+            front         = back;
+            frontLit      = true;
+            frontMaterial = material;
+            samples++;
+
+            if (T < params.cutoff) {
+
+                if (params.roulette && unitHash(X, i) * params.cutoff < T) {
+                    T = params.cutoff;
+                    continue;
+                }
+
+                if (params.roulette) {
+                    T = 0.0f;
+                }
+
+                samplesSaved = iterations - (i + 1);
+                return RayMarch(Color(accum[0], accum[1], accum[2]), T, samples, samplesSaved);
+            }
+        }
+
+        // The rest of the way out:
+        if (frontLit && distance > last) {
+
+            float depth = kappa * (distance - last) * front;
+
+            T *= exp(-depth);
+
+            for (int k=0; k<Lights; k++) {
+                scatter(frontMaterial, k, (expm1(depth) / kappa) * frontLight[k]);
+            }
+        }
+
+        return RayMarch(Color(accum[0], accum[1], accum[2]), T, samples, samplesSaved);
+    }
+
+} PreIntegratedKernel;
+
+MarchKernel PreIntegratedMarch::kernel(bool interpolate, bool textured, int lights) const
+{
+    return composeKernel<PreIntegratedKernel>(interpolate, textured, lights);
+}
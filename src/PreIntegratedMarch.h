@@ -0,0 +1,92 @@
+#ifndef _PRE_INTEGRATED_MARCH_H
+#define _PRE_INTEGRATED_MARCH_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "MarchPolicy.h"
+#include "Voxel.h"
+
+/******************************************************************************/
+
+// Entries along each axis of the pre-integration table, and the number of
+// pieces each segment is split into when the table is built (even, so no
+// piece straddles the middle of the step)
+#define PREINTEGRATION_SIZE 64
+#define PREINTEGRATION_PIECES 32
+
+/*******************************************************************************
+ * Entry of the pre-integration table: over one step, with density changing
+ * linearly from the front sample to the back one, the transmittance across
+ * the step and the light it scatters towards the eye, split by whether it
+ * takes the lighting at the front of the step, halfway along it, or at its
+ * back
+ ******************************************************************************/
+
+typedef struct PreIntegral
+{
+    float transmittance;
+    float front;
+    float middle;
+    float back;
+
+    PreIntegral() : transmittance(1.0f), front(0.0f), middle(0.0f), back(0.0f) { };
+    PreIntegral(float _transmittance, float _front, float _middle, float _back) :
+        transmittance(_transmittance),
+        front(_front),
+        middle(_middle),
+        back(_back)
+    { };
+
+} PreIntegral;
+
+/*******************************************************************************
+ * Pre-integrated steps: fixed steps integrated exactly, with density taken to
+ * change linearly from one sample to the next, through a table indexed by the
+ * density at the front and back of a step. The table is built for one step
+ * length, over densities from 0 to the largest in the buffer. Shadows are
+ * exact
+ ******************************************************************************/
+
+class PreIntegratedMarch : public MarchPolicy
+{
+    protected:
+        std::vector<PreIntegral> table;
+        float scale; // Table entries per unit of density
+
+    public:
+        PreIntegratedMarch(const VoxelBuffer& vb, float step);
+
+        // Table lookup, interpolated bilinearly between entries
+        PreIntegral integral(float front, float back) const
+        {
+            float max = static_cast<float>(PREINTEGRATION_SIZE - 1);
+            float u   = std::min(front * this->scale, max);
+            float v   = std::min(back * this->scale, max);
+            int a     = std::min(static_cast<int>(u), PREINTEGRATION_SIZE - 2);
+            int b     = std::min(static_cast<int>(v), PREINTEGRATION_SIZE - 2);
+            float fu  = u - static_cast<float>(a);
+            float fv  = v - static_cast<float>(b);
+
+            const PreIntegral* row0 = &this->table[(a * PREINTEGRATION_SIZE) + b];
+            const PreIntegral* row1 = row0 + PREINTEGRATION_SIZE;
+
+            auto lerp = [&](float PreIntegral::* field) {
+                float w0 = row0[0].*field + ((row0[1].*field - row0[0].*field) * fv);
+                float w1 = row1[0].*field + ((row1[1].*field - row1[0].*field) * fv);
+                return w0 + ((w1 - w0) * fu);
+            };
+
+            return PreIntegral(lerp(&PreIntegral::transmittance)
+                              ,lerp(&PreIntegral::front)
+                              ,lerp(&PreIntegral::middle)
+                              ,lerp(&PreIntegral::back));
+        }
+
+        virtual MarchKernel kernel(bool interpolate, bool textured, int lights) const;
+        virtual float shadow(const VoxelBuffer& vb, const P& X, const P& to, float jitter, float epsilon) const;
+
+        std::string getTypeName() const { return "PreIntegratedMarch"; };
+};
+
+#endif
@@ -35,17 +35,21 @@ class Primitive : public Intersect
         virtual ~Primitive() { }
 
         const glm::ivec3& getDimensions() const;
-        void setDimensions(glm::ivec3 dim);
+        virtual void setDimensions(glm::ivec3 dim);
         bool hasLoadedDimensions() const { return !this->deferDimensions; }
         float getVoxelWidth()  const     { return this->voxelDim.x; }
         float getVoxelHeight() const     { return this->voxelDim.y; }
         float getVoxelDepth()  const     { return this->voxelDim.z; }
 
+        // Called once for every object after the scene is loaded and before
+        // rendering starts, to precompute anything the renderer will look up
+        virtual void prepare(const RenderContext& context) { }
+
         // Abstract methods:
         virtual std::string getTypeName() const = 0;
 
         const BoundingBox& getBoundingBox() const { return this->bounds; }
-        std::shared_ptr<Material> getMaterial() const { return this->material; }
+        const std::shared_ptr<Material>& getMaterial() const { return this->material; }
 };
 
 #endif
@@ -32,6 +32,10 @@ class Hit
         float distance;
         Color color;
         float transmittance;
+        int samples;      // Samples taken along the ray
+        int samplesSaved; // Samples skipped because the ray was terminated early
+
+        Hit() : distance(0.0f), transmittance(1.0f), samples(0), samplesSaved(0) {};
 };
 
 #endif
@@ -0,0 +1,43 @@
+#include "Config.h"
+#include "Light.h"
+#include "Primitive.h"
+#include "Scene.h"
+#include "Voxel.h"
+
+/******************************************************************************/
+
+RenderScene::RenderScene() :
+    background(0.0f, 0.0f, 0.0f)
+{
+
+}
+
+RenderScene::RenderScene(const Configuration& config) :
+    background(config.BRGB)
+{
+    auto& objects = config.getObjects();
+    auto& lights  = config.getLights();
+    vector<BoundingBox> bounds;
+
+    this->objects.reserve(objects.size());
+    this->lights.reserve(lights.size());
+
+    for (auto oi = objects.begin(); oi != objects.end(); oi++) {
+
+        SceneObject object;
+        object.primitive = *oi;
+        object.volume    = dynamic_cast<VoxelBuffer*>(*oi);
+        object.material  = (*oi)->getMaterial().get();
+
+        this->objects.push_back(object);
+        bounds.push_back((*oi)->getBoundingBox());
+    }
+
+    this->bvh = BVH(bounds);
+
+    for (auto li = lights.begin(); li != lights.end(); li++) {
+        this->lights.push_back(SceneLight((*li)->getPosition(), (*li)->getColor()));
+    }
+}
+
+/******************************************************************************/
@@ -0,0 +1,96 @@
+#ifndef _SCENE_H
+#define _SCENE_H
+
+#include <cstddef>
+#include <vector>
+#include "R3.h"
+#include "BVH.h"
+#include "Color.h"
+
+// Forward declarations:
+class Configuration;
+class Material;
+class Primitive;
+class VoxelBuffer;
+
+/*******************************************************************************
+ * A read-only view of a contiguous run of T, as handed out by RenderScene.
+ * Copying a span copies two pointers, never the elements
+ ******************************************************************************/
+
+template<typename T> class Span
+{
+    protected:
+        const T* first;
+        const T* last;
+
+    public:
+        Span() : first(nullptr), last(nullptr) { };
+        Span(const T* _first, const T* _last) : first(_first), last(_last) { };
+        Span(const std::vector<T>& v) : first(v.data()), last(v.data() + v.size()) { };
+
+        const T* begin() const                   { return this->first; }
+        const T* end() const                     { return this->last; }
+        size_t size() const                      { return static_cast<size_t>(this->last - this->first); }
+        bool empty() const                       { return this->first == this->last; }
+        const T& operator[](size_t i) const      { return this->first[i]; }
+};
+
+/*******************************************************************************
+ * A scene object, with everything the render loop looks up per ray resolved
+ * ahead of time
+ ******************************************************************************/
+
+typedef struct SceneObject
+{
+    Primitive* primitive; // The object itself
+    VoxelBuffer* volume;  // The same object if it is a voxel buffer, else null
+    Material* material;   // The object's material; owned by the object
+
+} SceneObject;
+
+/*******************************************************************************
+ * A point light, stored by value
+ ******************************************************************************/
+
+typedef struct SceneLight
+{
+    P position;
+    Color color;
+
+    SceneLight() { };
+    SceneLight(const P& _position, const Color& _color) : position(_position), color(_color) { };
+
+} SceneLight;
+
+/*******************************************************************************
+ * The scene as the renderer sees it, compiled once from a Configuration
+ * before rendering starts: objects and lights packed into flat arrays, with
+ * materials and voxel buffer casts already resolved, plus a BVH over the
+ * objects' bounding boxes. It can't be changed once built, so the render
+ * loop only holds spans into it and never allocates, copies lists or touches
+ * a shared_ptr refcount.
+ *
+ * The scene does not own the objects; they must outlive it
+ ******************************************************************************/
+
+class RenderScene
+{
+    protected:
+        std::vector<SceneObject> objects;
+        std::vector<SceneLight> lights;
+        BVH bvh;
+        Color background;
+
+    public:
+        // An empty scene with a black background
+        RenderScene();
+        RenderScene(const Configuration& config);
+
+        Span<SceneObject> getObjects() const { return Span<SceneObject>(this->objects); }
+        Span<SceneLight> getLights() const   { return Span<SceneLight>(this->lights); }
+        const BVH& getBVH() const            { return this->bvh; }
+        const Color& getBackground() const   { return this->background; }
+};
+
+#endif
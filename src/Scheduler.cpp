@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#ifdef ENABLE_OPENMP
+#include <omp.h>
+#endif
+#include "Scheduler.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace glm;
+
+typedef chrono::steady_clock Clock;
+
+/******************************************************************************/
+
+static double secondsSince(const Clock::time_point& start)
+{
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+/*******************************************************************************
+ * Per-worker tile queue
+ ******************************************************************************/
+
+void TileScheduler::WorkQueue::push(const Tile& tile)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->tiles.push_back(tile);
+}
+
+/**
+ * Takes the next tile from the owner's end of the queue
+ */
+bool TileScheduler::WorkQueue::pop(Tile& tile)
+{
+    lock_guard<mutex> guard(this->lock);
+
+    if (this->tiles.empty()) {
+        return false;
+    }
+
+    tile = this->tiles.front();
+    this->tiles.pop_front();
+
+    return true;
+}
+
+/**
+ * Takes a tile from the opposite end of the queue, away from the tiles the
+ * owner is about to work on
+ */
+bool TileScheduler::WorkQueue::steal(Tile& tile)
+{
+    lock_guard<mutex> guard(this->lock);
+
+    if (this->tiles.empty()) {
+        return false;
+    }
+
+    tile = this->tiles.back();
+    this->tiles.pop_back();
+
+    return true;
+}
+
+/*******************************************************************************
+ * Scheduler
+ ******************************************************************************/
+
+TileScheduler::TileScheduler(ivec2 _resolution, ivec2 _tileSize, int _numThreads) :
+    resolution(_resolution),
+    tileSize(glm::max(_tileSize, ivec2(1, 1))),
+    numThreads(_numThreads > 0 ? _numThreads : defaultThreadCount()),
+    wallTime(0.0)
+{
+
+}
+
+/**
+ * The number of workers used when none is given explicitly. If OpenMP is
+ * enabled, OMP_NUM_THREADS is honored
+ */
+int TileScheduler::defaultThreadCount()
+{
+    #ifdef ENABLE_OPENMP
+    return std::max(1, omp_get_max_threads());
+    #else
+    return std::max(1, static_cast<int>(thread::hardware_concurrency()));
+    #endif
+}
+
+/**
+ * Worker loop: drain the worker's own queue, then steal from the others
+ * until every queue is empty. Counters are kept locally and published once
+ * the worker is done, so workers never write to neighbouring stats while
+ * rendering
+ */
+void TileScheduler::work(int worker, const TileFunction& f, vector<WorkQueue>& queues)
+{
+    WorkerStats stats;
+    int n = static_cast<int>(queues.size());
+
+    while (true) {
+
+        Tile tile;
+        bool found  = queues[worker].pop(tile);
+        bool stolen = false;
+
+        // Start with the neighbouring worker so thieves spread out instead of
+        // all contending for the same queue:
+        for (int v=1; !found && v<n; v++) {
+            found = stolen = queues[(worker + v) % n].steal(tile);
+        }
+
+        if (!found) {
+            break;
+        }
+
+        auto start = Clock::now();
+
+        f(tile, worker);
+
+        stats.busy += secondsSince(start);
+        stats.tiles++;
+        stats.stolen += stolen ? 1 : 0;
+    }
+
+    this->stats[worker] = stats;
+}
+
+/**
+ * Renders every tile of the image by invoking f(tile, worker) exactly once
+ * per tile, blocking until all tiles have been processed
+ */
+void TileScheduler::run(const TileFunction& f)
+{
+    int tilesX = (this->resolution.x + this->tileSize.x - 1) / this->tileSize.x;
+    int tilesY = (this->resolution.y + this->tileSize.y - 1) / this->tileSize.y;
+    int count  = tilesX * tilesY;
+    int n      = std::max(1, std::min(this->numThreads, count));
+
+    vector<WorkQueue> queues(n);
+    this->stats.assign(n, WorkerStats());
+
+    // Deal the tiles out in contiguous runs so each worker starts on a
+    // coherent region of the image:
+    for (int t=0; t<count; t++) {
+        int tx = t % tilesX;
+        int ty = t / tilesX;
+        queues[(t * n) / count].push(Tile(tx * this->tileSize.x
+                                         ,ty * this->tileSize.y
+                                         ,std::min((tx + 1) * this->tileSize.x, this->resolution.x)
+                                         ,std::min((ty + 1) * this->tileSize.y, this->resolution.y)));
+    }
+
+    auto start = Clock::now();
+
+    if (n == 1) {
+        this->work(0, f, queues);
+    } else {
+        vector<thread> workers;
+        workers.reserve(n);
+
+        for (int w=0; w<n; w++) {
+            workers.push_back(thread(&TileScheduler::work, this, w, cref(f), ref(queues)));
+        }
+        for (auto wi = workers.begin(); wi != workers.end(); wi++) {
+            wi->join();
+        }
+    }
+
+    this->wallTime = secondsSince(start);
+}
+
+ostream& operator<<(ostream& s, const TileScheduler& scheduler)
+{
+    double totalBusy = 0.0;
+    auto& stats      = scheduler.getStats();
+    auto precision   = s.precision();
+
+    s << "TileScheduler {" << endl
+      << "  tileSize = <" << scheduler.tileSize.x << "," << scheduler.tileSize.y << ">" << endl
+      << "  threads  = "  << stats.size() << endl
+      << "  wall     = "  << fixed << setprecision(3) << scheduler.getWallTime() << "s" << endl;
+
+    for (size_t w=0; w<stats.size(); w++) {
+        totalBusy += stats[w].busy;
+        s << "  worker[" << w << "] = "
+          << stats[w].tiles  << " tiles ("
+          << stats[w].stolen << " stolen), busy "
+          << stats[w].busy   << "s" << endl;
+    }
+
+    if (!stats.empty()) {
+        s << "  average busy = " << (totalBusy / stats.size()) << "s" << endl;
+    }
+
+    s.unsetf(ios_base::floatfield);
+    s.precision(precision);
+
+    return s << "}";
+}
+
+/*******************************************************************************
+ * Parallel loop
+ ******************************************************************************/
+
+void parallelFor(int count
+                ,int grain
+                ,const function<void(int begin, int end)>& f
+                ,int numThreads)
+{
+    grain = std::max(1, grain);
+
+    int blocks = (count + grain - 1) / grain;
+    int n      = numThreads > 0 ? numThreads : TileScheduler::defaultThreadCount();
+    n          = std::max(1, std::min(n, blocks));
+
+    atomic<int> next(0);
+
+    auto work = [&]() {
+        while (true) {
+            int begin = next.fetch_add(grain);
+            if (begin >= count) {
+                break;
+            }
+            f(begin, std::min(begin + grain, count));
+        }
+    };
+
+    if (n == 1) {
+        work();
+        return;
+    }
+
+    vector<thread> workers;
+    workers.reserve(n);
+
+    for (int w=0; w<n; w++) {
+        workers.push_back(thread(work));
+    }
+    for (auto wi = workers.begin(); wi != workers.end(); wi++) {
+        wi->join();
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <glm/glm.hpp>
+
+/*******************************************************************************
+ * A rectangular block of pixels [x0,x1) x [y0,y1) rendered as one unit of work
+ ******************************************************************************/
+
+typedef struct Tile
+{
+    int x0, y0, x1, y1;
+
+    Tile() : x0(0), y0(0), x1(0), y1(0) { };
+    Tile(int _x0, int _y0, int _x1, int _y1) : x0(_x0), y0(_y0), x1(_x1), y1(_y1) { };
+
+} Tile;
+
+/*******************************************************************************
+ * Per-worker accounting, filled in by TileScheduler::run()
+ ******************************************************************************/
+
+typedef struct WorkerStats
+{
+    int tiles;   // Tiles processed by the worker
+    int stolen;  // How many of those were taken from another worker's queue
+    double busy; // Seconds spent inside the work function
+
+    WorkerStats() : tiles(0), stolen(0), busy(0.0) { };
+
+} WorkerStats;
+
+/*******************************************************************************
+ * Tile-based work-stealing scheduler
+ *
+ * The image is cut into tiles which are dealt out in contiguous runs to one
+ * deque per worker. A worker pops tiles from the front of its own deque and,
+ * once that is empty, steals from the back of the other workers' deques, so
+ * threads that land on cheap (empty) regions of the image pick up the work
+ * of threads stuck in dense ones
+ ******************************************************************************/
+
+class TileScheduler
+{
+    public:
+        typedef std::function<void(const Tile& tile, int worker)> TileFunction;
+
+    private:
+        class WorkQueue
+        {
+            protected:
+                std::mutex lock;
+                std::deque<Tile> tiles;
+
+            public:
+                void push(const Tile& tile);
+                bool pop(Tile& tile);
+                bool steal(Tile& tile);
+        };
+
+        void work(int worker, const TileFunction& f, std::vector<WorkQueue>& queues);
+
+    protected:
+        glm::ivec2 resolution;
+        glm::ivec2 tileSize;
+        int numThreads;
+        double wallTime;
+        std::vector<WorkerStats> stats;
+
+    public:
+        TileScheduler(glm::ivec2 resolution, glm::ivec2 tileSize, int numThreads = 0);
+
+        static int defaultThreadCount();
+
+        void run(const TileFunction& f);
+
+        int getThreadCount() const                    { return this->numThreads; }
+        double getWallTime() const                    { return this->wallTime; }
+        const std::vector<WorkerStats>& getStats() const { return this->stats; }
+
+        friend std::ostream& operator<<(std::ostream& s, const TileScheduler& scheduler);
+};
+
+/*******************************************************************************
+ * Runs f(begin, end) over [0,count) in blocks of grain indices, spread across
+ * numThreads workers (0 picks TileScheduler::defaultThreadCount()). Blocks are
+ * handed out dynamically, so uneven per-index costs balance out
+ ******************************************************************************/
+
+void parallelFor(int count
+                ,int grain
+                ,const std::function<void(int begin, int end)>& f
+                ,int numThreads = 0);
+
+#endif
@@ -0,0 +1,472 @@
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include "Ray.h"
+#include "Scheduler.h"
+#include "StreamedVolume.h"
+#include "Utils.h"
+#include "VolumeFile.h"
+
+/******************************************************************************/
+
+// Slack, in steps, when deciding which samples lie inside an empty macrocell;
+// the same as the VoxelBuffer's
+#define MACROCELL_EPSILON 1.0e-3f
+
+/******************************************************************************/
+
+using namespace std;
+using namespace Utils;
+using namespace glm;
+
+/******************************************************************************/
+
+/**
+ * Loads the tables of a volume file in one of the brick layouts. The cache
+ * is only set up by prepare(), once the number of render threads is known
+ */
+StreamedVolume::StreamedVolume(shared_ptr<VolumeFile> _file
+                              ,shared_ptr<Material> _material
+                              ,size_t _budget) :
+    Primitive(ivec3(_file->getHeader().dim[0], _file->getHeader().dim[1], _file->getHeader().dim[2])
+             ,BoundingBox(P(_file->getHeader().bounds[0], _file->getHeader().bounds[1], _file->getHeader().bounds[2])
+                         ,P(_file->getHeader().bounds[3], _file->getHeader().bounds[4], _file->getHeader().bounds[5]))
+             ,_material),
+    file(_file),
+    budget(_budget),
+    layout(static_cast<VoxelLayout>(_file->getHeader().layout), this->gridDim),
+    macrocellDim(0, 0, 0)
+{
+    const VolumeHeader& header = this->file->getHeader();
+
+    if (header.layout != LAYOUT_BRICKED && header.layout != LAYOUT_SPARSE) {
+        throw runtime_error("Only volume files in the bricked or sparse layout can be streamed: " + this->file->getFilename());
+    } else if (header.format > FORMAT_UINT8) {
+        throw runtime_error("Unknown voxel format in volume file: " + this->file->getFilename());
+    }
+
+    ivec3 dim         = this->gridDim;
+    size_t voxelBytes = header.format == FORMAT_FLOAT ? sizeof(float) : header.format == FORMAT_UINT16 ? 2 : 1;
+    size_t brickBytes = BRICK_VOXELS * voxelBytes;
+    size_t stored     = header.data.bytes / brickBytes;
+    bool invalid      = dim.x <= 0 || dim.y <= 0 || dim.z <= 0 || header.data.bytes % brickBytes != 0;
+
+    // Every index the samplers will follow has to land in the file:
+    if (this->layout.getType() == LAYOUT_BRICKED) {
+        invalid = invalid || stored != this->layout.storedBricks();
+    } else {
+        int bricks = static_cast<int>(std::min(stored, static_cast<size_t>(numeric_limits<int>::max())));
+        invalid    = !this->layout.setTree(this->file->read<int>(header.nodes), this->file->read<int>(header.bricks), vector<int>(), bricks) || invalid;
+    }
+
+    if (header.format != FORMAT_FLOAT) {
+        size_t ranges = header.ranges.bytes / sizeof(QuantRange);
+        invalid       = invalid || stored == 0 || header.quantShift < 0 || header.quantShift > 31 ||
+                        (((stored * BRICK_VOXELS) - 1) >> header.quantShift) >= ranges;
+    }
+
+    if (invalid) {
+        throw runtime_error("Volume file size does not match its dimensions: " + this->file->getFilename());
+    }
+
+    // Without saved macrocells, finding empty space would mean reading the
+    // whole volume, so the march goes without:
+    ivec3 cells      = (dim + (MACROCELL_SIZE - 1)) / MACROCELL_SIZE;
+    this->macrocells = this->file->read<Macrocell>(header.macrocells);
+
+    if (this->macrocells.size() == static_cast<size_t>(cells.x) * cells.y * cells.z) {
+        this->macrocellDim = cells;
+    } else {
+        this->macrocells.clear();
+    }
+
+    // The same grid spaces as the VoxelBuffer's:
+    vec3 fdim   = vec3(dim);
+    vec3 extent = this->bounds.getP2().p - this->bounds.getP1().p;
+
+    this->gridScale   = (fdim - this->voxelDim) / extent;
+    this->interpScale = (fdim - 1.0f) / extent;
+    this->interpMax   = vec3(nextafter(fdim.x, 0.0f), nextafter(fdim.y, 0.0f), nextafter(fdim.z, 0.0f));
+}
+
+StreamedVolume::~StreamedVolume()
+{
+
+}
+
+/**
+ * Sizes the cache to the budget, but never smaller than every render thread
+ * holding a full cursor of samples and one of shadows, so that no thread can
+ * be starved of bricks
+ */
+void StreamedVolume::prepare(const RenderContext& context)
+{
+    int threads  = context.getThreads() > 0 ? context.getThreads() : TileScheduler::defaultThreadCount();
+    int minimum  = (2 * CURSOR_BRICKS * (threads + 1)) + 1;
+    size_t limit = static_cast<size_t>(numeric_limits<int>::max());
+    int capacity = static_cast<int>(std::min(this->budget / (BRICK_VOXELS * sizeof(float)), limit));
+
+    if (capacity < minimum) {
+        clog << "Brick cache: budget too small for " << threads << " thread(s), using "
+             << minimum << " bricks" << endl;
+    }
+
+    this->cache.reset(new BrickCache(this->file, std::max(capacity, minimum), minimum));
+
+    clog << "Streaming " << this->file->getFilename() << " through "
+         << ((static_cast<size_t>(this->cache->getCapacity()) * BRICK_VOXELS * sizeof(float)) >> 20)
+         << " MB of bricks" << endl;
+}
+
+BrickCacheStats StreamedVolume::getCacheStats() const
+{
+    return this->cache ? this->cache->getStats() : BrickCacheStats();
+}
+
+/*******************************************************************************
+ * Sampling, following the VoxelBuffer's
+ ******************************************************************************/
+
+bool StreamedVolume::positionToIndex(const P& p, int& i, int& j, int& k) const
+{
+    vec3 G = (p.p - this->bounds.getP1().p) * this->gridScale;
+    i      = static_cast<int>(G.x);
+    j      = static_cast<int>(G.y);
+    k      = static_cast<int>(G.z);
+
+    return (i >= 0 && i < this->gridDim.x) &&
+           (j >= 0 && j < this->gridDim.y) &&
+           (k >= 0 && k < this->gridDim.z);
+}
+
+void StreamedVolume::center(int i, int j, int k, P& center) const
+{
+    auto p1   = this->bounds.getP1();
+    auto p2   = this->bounds.getP2();
+    float dx  = (x(p2) - x(p1)) / static_cast<float>(this->gridDim.x);
+    float dy  = (y(p2) - y(p1)) / static_cast<float>(this->gridDim.y);
+    float dz  = (z(p2) - z(p1)) / static_cast<float>(this->gridDim.z);
+    float dx2 = 0.5f * dx;
+    float dy2 = 0.5f * dy;
+    float dz2 = 0.5f * dz;
+
+    center = P(x(p1) + dx2 + (dx * static_cast<float>(i))
+              ,y(p1) + dy2 + (dy * static_cast<float>(j))
+              ,z(p1) + dz2 + (dz * static_cast<float>(k)));
+}
+
+static inline float lerpDensity(float v1, float v2, float t)
+{
+    return ((1.0f - t) * v1) + (t * v2);
+}
+
+/**
+ * Trilinearly interpolated density at p. Cells within one brick are read
+ * from it directly; the others look up each corner
+ */
+float StreamedVolume::interpolatedDensity(BrickCursor& cursor, const P& p) const
+{
+    vec3 loc  = glm::min(glm::max((p.p - this->bounds.getP1().p) * this->interpScale, vec3(0.0f)), this->interpMax);
+    vec3 cell = glm::floor(loc);
+    vec3 w    = loc - cell;
+    int i     = static_cast<int>(cell.x);
+    int j     = static_cast<int>(cell.y);
+    int k     = static_cast<int>(cell.z);
+
+    float v[8];
+
+    if (this->layout.inOneBrick(i, j, k)) {
+
+        int base;
+        int brick = this->layout.locate(i, j, k, base);
+
+        if (this->isEmptyBrick(brick)) {
+            return 0.0f;
+        }
+
+        const float* d = cursor.fetch(brick);
+        int sy         = BRICK_SIZE;
+        int sz         = BRICK_SIZE * BRICK_SIZE;
+
+        v[0] = d[base];
+        v[1] = d[base + sz];
+        v[2] = d[base + sy];
+        v[3] = d[base + sy + sz];
+        v[4] = d[base + 1];
+        v[5] = d[base + 1 + sz];
+        v[6] = d[base + 1 + sy];
+        v[7] = d[base + 1 + sy + sz];
+
+    } else {
+        for (int c=0; c<8; c++) {
+            v[c] = this->density(cursor, i + (c >> 2), j + ((c >> 1) & 1), k + (c & 1));
+        }
+    }
+
+    // Same order of operations as Utils::trilerp():
+    float c00 = lerpDensity(v[0], v[4], w.x);
+    float c10 = lerpDensity(v[2], v[6], w.x);
+    float c01 = lerpDensity(v[1], v[5], w.x);
+    float c11 = lerpDensity(v[3], v[7], w.x);
+    float c0  = lerpDensity(c00, c10, w.y);
+    float c1  = lerpDensity(c01, c11, w.y);
+
+    return lerpDensity(c0, c1, w.z) * (1.0f / 3.0f);
+}
+
+/**
+ * See VoxelBuffer::emptySteps()
+ */
+int StreamedVolume::emptySteps(int i, int j, int k, const vec3& G, const vec3& dG) const
+{
+    const Macrocell& cell = this->macrocells[(i / MACROCELL_SIZE) +
+                                             (j / MACROCELL_SIZE) * this->macrocellDim.x +
+                                             (k / MACROCELL_SIZE) * this->macrocellDim.x * this->macrocellDim.y];
+
+    if (cell.maxDensity > 0.0f) {
+        return 0;
+    }
+
+    vec3 lo(static_cast<float>((i / MACROCELL_SIZE) * MACROCELL_SIZE)
+           ,static_cast<float>((j / MACROCELL_SIZE) * MACROCELL_SIZE)
+           ,static_cast<float>((k / MACROCELL_SIZE) * MACROCELL_SIZE));
+    vec3 hi = lo + static_cast<float>(MACROCELL_SIZE);
+
+    this->layout.emptyNode(i, j, k, lo, hi);
+
+    float t = static_cast<float>(numeric_limits<int>::max() / 2);
+
+    for (int a=0; a<3; a++) {
+        if (dG[a] > 0.0f) {
+            t = std::min(t, (hi[a] - G[a]) / dG[a]);
+        } else if (dG[a] < 0.0f) {
+            t = std::min(t, (lo[a] - G[a]) / dG[a]);
+        }
+    }
+
+    return std::max(1, static_cast<int>(ceil(t - MACROCELL_EPSILON)));
+}
+
+/**
+ * Transmittance along a shadow ray, as Q() computes it for a VoxelBuffer
+ */
+float StreamedVolume::shadow(BrickCursor& cursor
+                            ,float step
+                            ,int iterations
+                            ,const P& X
+                            ,const V& N
+                            ,float epsilon) const
+{
+    auto& dim      = this->gridDim;
+    vec3 G         = (X.p - this->bounds.getP1().p) * this->gridScale;
+    vec3 dG        = N * this->gridScale;
+    float tau      = 0.0f;
+    bool skipEmpty = !this->macrocells.empty();
+
+    float maxTau = epsilon > 0.0f
+        ? -log(epsilon) / (KAPPA * step)
+        : numeric_limits<float>::infinity();
+
+    for (int n=0; n<iterations; n++, G += dG) {
+
+        int i = static_cast<int>(G.x);
+        int j = static_cast<int>(G.y);
+        int k = static_cast<int>(G.z);
+
+        if (i < 0 || i >= dim.x || j < 0 || j >= dim.y || k < 0 || k >= dim.z) {
+            break;
+        }
+
+        int skip = skipEmpty ? this->emptySteps(i, j, k, G, dG) : 0;
+
+        if (skip > 0) {
+            n += skip - 1;
+            G += dG * static_cast<float>(skip - 1);
+            continue;
+        }
+
+        tau += this->density(cursor, i, j, k);
+
+        if (tau > maxTau) {
+            break;
+        }
+    }
+
+    return exp(-KAPPA * step * tau);
+}
+
+/**
+ * Hints the first few occupied bricks from start to end to the cache, every
+ * half a brick along the segment
+ */
+void StreamedVolume::prefetch(const P& start, const P& end) const
+{
+    vec3 G0      = (start.p - this->bounds.getP1().p) * this->gridScale;
+    vec3 G1      = (end.p - this->bounds.getP1().p) * this->gridScale;
+    float length = glm::length(G1 - G0);
+    int steps    = std::max(1, static_cast<int>(ceil(length / (0.5f * BRICK_SIZE))));
+    int previous = -1;
+    int hinted   = 0;
+    int bricks[PREFETCH_BRICKS];
+
+    for (int s=0; s<=steps && hinted < PREFETCH_BRICKS; s++) {
+
+        vec3 G  = G0 + ((G1 - G0) * (static_cast<float>(s) / static_cast<float>(steps)));
+        ivec3 v = glm::clamp(ivec3(G), ivec3(0, 0, 0), this->gridDim - 1);
+
+        if (!this->macrocells.empty()) {
+            const Macrocell& cell = this->macrocells[(v.x / MACROCELL_SIZE) +
+                                                     (v.y / MACROCELL_SIZE) * this->macrocellDim.x +
+                                                     (v.z / MACROCELL_SIZE) * this->macrocellDim.x * this->macrocellDim.y];
+            if (cell.maxDensity <= 0.0f) {
+                continue;
+            }
+        }
+
+        int offset;
+        int brick = this->layout.locate(v.x, v.y, v.z, offset);
+
+        if (brick != previous && !this->isEmptyBrick(brick)) {
+            bricks[hinted++] = brick;
+            previous         = brick;
+        }
+    }
+
+    this->cache->prefetch(bricks, hinted);
+}
+
+/*******************************************************************************
+ * Intersection
+ ******************************************************************************/
+
+/**
+ * Marches the ray through the volume the way rayMarchGeneric() does, with
+ * the context's cutoff and without jitter, as VoxelBuffer::intersects() does
+ */
+bool StreamedVolume::intersects(const Ray& ray, const RenderContext& context, Hit& hit)
+{
+    assert(this->cache != nullptr);
+
+    P start, end;
+
+    if (!this->bounds.isHit(ray, start, end)) {
+        return false;
+    }
+
+    this->prefetch(start, end);
+
+    // Samples and shadow rays wander off in different directions, so each
+    // keeps its own bricks:
+    BrickCursor samples(*this->cache);
+    BrickCursor shadows(*this->cache);
+
+    float step       = context.getStep();
+    float kappa      = KAPPA;
+    float cutoff     = context.getCutoff();
+    float epsilon    = context.getShadowEpsilon();
+    float T          = 1.0f;
+    bool roulette    = context.getRoulette();
+    bool interpolate = context.getInterpolation();
+    bool skipEmpty   = !this->macrocells.empty();
+    int taken        = 0;
+    int saved        = 0;
+    auto material    = this->material.get();
+    auto& lights     = context.getLights();
+    P origin         = this->bounds.center();
+    Color accumColor = Color(0.0f, 0.0f, 0.0f);
+
+    assert(lights.size() <= MAX_LIGHTS);
+
+    // Samples in the same voxel see the same shadows:
+    ivec3 shaded(-1, -1, -1);
+    float lightT[MAX_LIGHTS];
+
+    P X;
+    V N;
+    int iterations = traverse(step, MARCH_EPSILON, start, end, X, N);
+    vec3 G         = (X.p - this->bounds.getP1().p) * this->gridScale;
+    vec3 dG        = N * this->gridScale;
+
+    for (int i=0; i<iterations; i++, X += N, G += dG) {
+
+        int vi, vj, vk;
+
+        if (!this->positionToIndex(X, vi, vj, vk)) {
+            break;
+        }
+
+        int skip = skipEmpty ? this->emptySteps(vi, vj, vk, G, dG) : 0;
+
+        if (skip > 0) {
+            i += skip - 1;
+            X += N * static_cast<float>(skip - 1);
+            G += dG * static_cast<float>(skip - 1);
+            continue;
+        }
+
+        float density = interpolate
+            ? this->interpolatedDensity(samples, X)
+            : this->density(samples, vi, vj, vk);
+
+        float deltaT      = exp(-kappa * step * density);
+        float attenuation = (1.0f - deltaT) / kappa;
+
+        T *= deltaT;
+
+        if (shaded != ivec3(vi, vj, vk)) {
+
+            P center;
+            this->center(vi, vj, vk, center);
+
+            float offset = (2.0f * step) + MARCH_EPSILON + (context.getJitter(vi, vj, vk) * step);
+            auto li      = lights.begin();
+
+            for (int l=0; li != lights.end(); li++, l++) {
+                P LX;
+                V LN;
+                int stepsToLight = traverse(step, offset, center, li->position, LX, LN);
+                lightT[l]        = this->shadow(shadows, step, stepsToLight, LX, LN, epsilon);
+            }
+
+            shaded = ivec3(vi, vj, vk);
+        }
+
+        auto li = lights.begin();
+
+        for (int l=0; li != lights.end(); li++, l++) {
+            accumColor += li->color *
+                          material->colorAt(X, origin) *
+                          attenuation *
+                          T *
+                          lightT[l];
+        }
+
+        taken++;
+
+        if (T < cutoff) {
+
+            if (roulette && unitHash(X, i) * cutoff < T) {
+                T = cutoff;
+                continue;
+            }
+
+            if (roulette) {
+                T = 0.0f;
+            }
+
+            saved = iterations - (i + 1);
+            break;
+        }
+    }
+
+    hit.color         = accumColor;
+    hit.transmittance = T;
+    hit.samples       = taken;
+    hit.samplesSaved  = saved;
+
+    return true;
+}
+
+/******************************************************************************/
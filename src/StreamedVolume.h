@@ -0,0 +1,81 @@
+#ifndef _STREAMED_VOLUME_H
+#define _STREAMED_VOLUME_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "BrickCache.h"
+#include "GridLayout.h"
+#include "Primitive.h"
+#include "Voxel.h"
+
+// Forward declarations:
+class VolumeFile;
+
+/******************************************************************************/
+
+// Bricks along a primary ray the cache is asked to read ahead
+#define PREFETCH_BRICKS 16
+
+/*******************************************************************************
+ * A volume file too large to keep in memory, marched the way a VoxelBuffer
+ * marches with its generic kernel. The file must be in one of the brick
+ * layouts: only its tables and macrocells are loaded, and voxels are read a
+ * brick at a time through a BrickCache of a fixed budget, which never
+ * shrinks below what the render threads can pin at once.
+ *
+ * Since there are no light planes to bake into, shadows are marched from
+ * every sample, from the voxel center and with the jitter bakeLights() would
+ * use, so renders match those of the same file loaded whole
+ ******************************************************************************/
+
+class StreamedVolume : public Primitive
+{
+    protected:
+        std::shared_ptr<VolumeFile> file;
+        std::unique_ptr<BrickCache> cache;
+        size_t budget;       // Bytes of bricks to keep in memory
+
+        // Where each voxel is stored. Only the tree of the sparse layout is
+        // loaded, since voxels are never mapped back from storage
+        GridLayout layout;
+
+        std::vector<Macrocell> macrocells;
+        glm::ivec3 macrocellDim;
+
+        glm::vec3 gridScale;
+        glm::vec3 interpScale;
+        glm::vec3 interpMax;
+
+        bool isEmptyBrick(int brick) const { return this->layout.getType() == LAYOUT_SPARSE && brick == 0; }
+
+        float density(BrickCursor& cursor, int i, int j, int k) const
+        {
+            int offset;
+            int brick = this->layout.locate(i, j, k, offset);
+            return this->isEmptyBrick(brick) ? 0.0f : cursor.fetch(brick)[offset];
+        }
+
+        float interpolatedDensity(BrickCursor& cursor, const P& p) const;
+        bool positionToIndex(const P& p, int& i, int& j, int& k) const;
+        void center(int i, int j, int k, P& center) const;
+        int emptySteps(int i, int j, int k, const glm::vec3& G, const glm::vec3& dG) const;
+        float shadow(BrickCursor& cursor, float step, int iterations, const P& X, const V& N, float epsilon) const;
+        void prefetch(const P& start, const P& end) const;
+
+    public:
+        StreamedVolume(std::shared_ptr<VolumeFile> file, std::shared_ptr<Material> material, size_t budget);
+        virtual ~StreamedVolume();
+
+        // Sets up the cache for the context's number of threads
+        virtual void prepare(const RenderContext& ctx);
+
+        virtual bool intersects(const Ray& ray, const RenderContext& ctx, Hit& hit);
+
+        BrickCacheStats getCacheStats() const;
+
+        std::string getTypeName() const { return "StreamedVolume"; };
+};
+
+#endif
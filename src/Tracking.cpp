@@ -0,0 +1,185 @@
+#include <cmath>
+#include "BitmapTexture.h"
+#include "DDAMarch.h"
+#include "Tracking.h"
+#include "Utils.h"
+
+/******************************************************************************/
+
+using namespace std;
+using namespace Utils;
+using namespace glm;
+
+/*******************************************************************************
+ * Unbiased stochastic estimates of the march, for renders with tracking on.
+ * Rather than stepping through the volume, these draw tentative collisions
+ * against a majorant, the largest density of each macrocell: sparse regions
+ * are crossed in a few long strides and empty macrocells are never sampled.
+ * A tentative collision is real with probability density / majorant, so the
+ * expected cost follows the optical thickness along the ray, not its length
+ * over the step size. Every random number comes from the stream passed in
+ ******************************************************************************/
+
+/**
+ * Density the tracking estimators see at X, or 0 off the grid
+ */
+static inline float trackedDensity(const VoxelBuffer& vb, const P& X, bool interpolate)
+{
+    int i = -1;
+    int j = -1;
+    int k = -1;
+
+    if (!vb.positionToIndex(X, i, j, k)) {
+        return 0.0f;
+    }
+
+    return interpolate ? vb.getInterpolatedDensity(X) : vb(i, j, k);
+}
+
+/**
+ * Draws tentative collisions along the segment from X, for the given
+ * distance along N, with exponentially distributed free paths against the
+ * majorant extinction of each macrocell crossed. f(s, majorant) is called
+ * for each with its distance along the segment, until f returns false or
+ * the segment ends
+ */
+template<typename F>
+static inline void trackCollisions(const VoxelBuffer& vb
+                                  ,const P& X
+                                  ,const V& N
+                                  ,float distance
+                                  ,RandomStream& random
+                                  ,F f)
+{
+    walkCells(vb, MACROCELL_SIZE, X, N, distance, [&](int i, int j, int k, float s, float length) {
+
+        float majorant = KAPPA * vb.getMacrocell(i * MACROCELL_SIZE, j * MACROCELL_SIZE, k * MACROCELL_SIZE).maxDensity;
+        float exit     = s + length;
+
+        if (majorant <= 0.0f) {
+            return true;
+        }
+
+        // Free paths are memoryless, so one that runs past the cell simply
+        // starts over from the next cell's boundary:
+        while (true) {
+
+            s -= log(1.0f - random.next()) / majorant;
+
+            if (s >= exit) {
+                return true;
+            }
+            if (!f(s, majorant)) {
+                return false;
+            }
+        }
+    });
+}
+
+/**
+ * Ratio tracking estimate of the transmittance from X towards the point to,
+ * or to where that path leaves the volume: every tentative collision scales
+ * it by the probability that the collision is not real. Once it falls below
+ * the shadow epsilon, Russian roulette ends the walk with probability
+ * 1 - T/epsilon, and reweights it otherwise. Like Q(), it reads the
+ * nearest voxel's density whatever the interpolation mode. samples counts
+ * the density lookups made
+ */
+float ratioTrack(const MarchParams& params
+                ,const VoxelBuffer& vb
+                ,const P& X
+                ,const P& to
+                ,RandomStream& random
+                ,int& samples)
+{
+    V N            = to - X;
+    float distance = glm::length(N);
+    float T        = 1.0f;
+    float epsilon  = params.shadowEpsilon;
+
+    if (distance <= 0.0f) {
+        return T;
+    }
+
+    N /= distance;
+
+    trackCollisions(vb, X, N, distance, random, [&](float s, float majorant) {
+
+        samples++;
+        T *= 1.0f - ((KAPPA * trackedDensity(vb, X + (N * s), false)) / majorant);
+
+        if (T < epsilon) {
+
+            if (random.next() * epsilon < T) {
+                T = epsilon;
+                return true;
+            }
+
+            T = 0.0f;
+            return false;
+        }
+
+        return true;
+    });
+
+    return T;
+}
+
+/**
+ * Delta tracking estimate of the march from start to end. The ray either
+ * passes through, with transmittance 1 and no color, or stops at a real
+ * collision, drawn with probability proportional to transmittance times
+ * extinction. It then has transmittance 0 and the color of the light
+ * reaching that point, over kappa; averaged over many estimates, this is
+ * the same integral the march kernels step through
+ */
+RayMarch deltaTrack(const MarchParams& params
+                   ,const VoxelBuffer& vb
+                   ,const P& start
+                   ,const P& end
+                   ,RandomStream& random)
+{
+    V N            = end - start;
+    float distance = glm::length(N);
+    int samples    = 0;
+    bool collided  = false;
+    P X;
+
+    if (distance <= 0.0f) {
+        return RayMarch(Color(0.0f, 0.0f, 0.0f), 1.0f);
+    }
+
+    N /= distance;
+
+    trackCollisions(vb, start, N, distance, random, [&](float s, float majorant) {
+
+        X = start + (N * s);
+        samples++;
+        collided = random.next() * majorant < KAPPA * trackedDensity(vb, X, params.interpolate);
+
+        return !collided;
+    });
+
+    if (!collided) {
+        return RayMarch(Color(0.0f, 0.0f, 0.0f), 1.0f, samples);
+    }
+
+    float accum[3] = { 0.0f, 0.0f, 0.0f };
+    Color texel(1.0f, 1.0f, 1.0f);
+
+    if (params.texture != nullptr) {
+        texel = params.texture->BitmapTexture::colorAt(X, params.origin);
+    }
+
+    for (int k=0; k<params.lightCount; k++) {
+
+        float lightT   = ratioTrack(params, vb, X, params.lightPosition[k], random, samples) / KAPPA;
+        const Color& c = params.lightColor[k];
+
+        accum[0] += c.fR() * texel.fR() * lightT;
+        accum[1] += c.fG() * texel.fG() * lightT;
+        accum[2] += c.fB() * texel.fB() * lightT;
+    }
+
+    return RayMarch(Color(accum[0], accum[1], accum[2]), 0.0f, samples);
+}
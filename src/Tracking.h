@@ -0,0 +1,28 @@
+#ifndef _TRACKING_H
+#define _TRACKING_H
+
+#include "R3.h"
+#include "Utils.h"
+#include "Voxel.h"
+
+/*******************************************************************************
+ * Delta and ratio tracking: unbiased stochastic estimates of the march, for
+ * renders with tracking on, against the majorants of a buffer's macrocells.
+ * They read the march parameters selectMarchKernel() fills in, and need no
+ * state of their own
+ ******************************************************************************/
+
+float ratioTrack(const MarchParams& params
+                ,const VoxelBuffer& vb
+                ,const P& X
+                ,const P& to
+                ,Utils::RandomStream& random
+                ,int& samples);
+
+RayMarch deltaTrack(const MarchParams& params
+                   ,const VoxelBuffer& vb
+                   ,const P& start
+                   ,const P& end
+                   ,Utils::RandomStream& random);
+
+#endif
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <sstream>
 #include <cmath>
+#include <cstring>
 #include <stdexcept>
 #include "R3.h"
 #include "Utils.h"
@@ -103,3 +104,28 @@ float Utils::trilerp(float xd, float yd, float zd
     float c1  = lerp(c01, c11, yd);
     return lerp(c0, c1, zd);
 }
+
+// 32-bit integer mixing function from https://nullprogram.com/blog/2018/07/31/
+static unsigned int mix(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+
+float Utils::unitHash(const P& p, unsigned int n)
+{
+    unsigned int bits[3];
+    memcpy(bits, &p.p[0], sizeof(bits));
+
+    unsigned int h = mix(n);
+    h = mix(h ^ bits[0]);
+    h = mix(h ^ bits[1]);
+    h = mix(h ^ bits[2]);
+
+    // Top 24 bits, so the result is exactly representable and < 1
+    return static_cast<float>(h >> 8) / 16777216.0f;
+}
@@ -1,6 +1,7 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <cstdint>
 #include <sstream>
 #include "R3.h"
 
@@ -42,6 +43,45 @@ namespace Utils {
                         ,float v100, float v101
                         ,float v110, float v111);
 
+    // Hashes a position and an integer to a number uniformly distributed in
+    // [0,1). The same inputs always give the same number
+    extern float unitHash(const P& p, unsigned int n);
+
+    /**
+     * A stream of uniformly distributed random numbers (PCG32). The stream
+     * is fixed by the pixel and sample it is made for, so a render comes
+     * out the same whatever the thread count or the order tiles finish in
+     */
+    class RandomStream
+    {
+        protected:
+            uint64_t state;
+            uint64_t increment;
+
+            uint32_t nextBits()
+            {
+                uint64_t old    = this->state;
+                this->state     = (old * 6364136223846793005ULL) + this->increment;
+                uint32_t shift  = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+                uint32_t rotate = static_cast<uint32_t>(old >> 59);
+                return (shift >> rotate) | (shift << ((32 - rotate) & 31));
+            }
+
+        public:
+            RandomStream(uint32_t pixel, uint32_t sample)
+            {
+                this->state     = 0;
+                this->increment = (static_cast<uint64_t>(pixel) << 1) | 1;
+                this->nextBits();
+                this->state += (static_cast<uint64_t>(sample) << 32) ^ 0x853c49e6748fea9bULL;
+                this->nextBits();
+            };
+
+            // Next number in [0,1). Only the top 24 bits are used, so the
+            // result is exactly representable and never rounds up to 1
+            float next() { return static_cast<float>(this->nextBits() >> 8) / 16777216.0f; }
+    };
+
     /**
      * Converts the given string to a number
      */
@@ -0,0 +1,59 @@
+#include <cstring>
+#include <stdexcept>
+#include "VolumeFile.h"
+
+/******************************************************************************/
+
+using namespace std;
+
+/******************************************************************************/
+
+/**
+ * Maps the given file and checks its header
+ */
+VolumeFile::VolumeFile(const string& _filename) :
+    MappedFile(_filename)
+{
+    if (this->length < sizeof(VolumeHeader)) {
+        throw runtime_error("Not a volume file: " + _filename);
+    }
+
+    const VolumeHeader& header = this->getHeader();
+    const VolumeSection* sections[] = { &header.scene
+                                      , &header.ranges
+                                      , &header.nodes
+                                      , &header.bricks
+                                      , &header.origins
+                                      , &header.macrocells
+                                      , &header.data };
+
+    if (memcmp(header.magic, VOLUME_MAGIC, sizeof(header.magic)) != 0) {
+        throw runtime_error("Not a volume file: " + _filename);
+    } else if (header.byteOrder != VOLUME_BYTE_ORDER) {
+        throw runtime_error("Volume file was written with the other byte order: " + _filename);
+    } else if (header.version != VOLUME_VERSION) {
+        throw runtime_error("Unsupported volume file version " + to_string(header.version) + ": " + _filename);
+    } else if (header.data.offset % VOLUME_ALIGNMENT != 0) {
+        throw runtime_error("Volume file data is misaligned: " + _filename);
+    }
+
+    for (auto section : sections) {
+        if (section->offset > this->length || section->bytes > this->length - section->offset) {
+            throw runtime_error("Volume file is truncated: " + _filename);
+        }
+    }
+}
+
+string VolumeFile::getScene() const
+{
+    const VolumeSection& scene = this->getHeader().scene;
+    return string(reinterpret_cast<const char*>(this->at(scene)), scene.bytes);
+}
+
+bool VolumeFile::isVolumeFile(const string& filename)
+{
+    size_t n = strlen(VOLUME_EXTENSION);
+    return filename.size() > n && filename.compare(filename.size() - n, n, VOLUME_EXTENSION) == 0;
+}
+
+/******************************************************************************/
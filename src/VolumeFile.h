@@ -0,0 +1,114 @@
+#ifndef _VOLUME_FILE_H
+#define _VOLUME_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "MappedFile.h"
+
+/******************************************************************************/
+
+// First eight bytes of every volume file
+#define VOLUME_MAGIC "VRVOLUME"
+
+#define VOLUME_VERSION 1
+
+// Written as a 32-bit integer, so files saved on a machine of the other byte
+// order are recognized and refused rather than misread
+#define VOLUME_BYTE_ORDER 0x01020304u
+
+// Alignment of the voxel data within the file, so it can be mapped and read
+// in place: a page on every system we build on
+#define VOLUME_ALIGNMENT 4096
+
+// Extension that marks a file as a volume file rather than a text scene
+#define VOLUME_EXTENSION ".vol"
+
+/*******************************************************************************
+ * Volume file format
+ *
+ * A fixed size header, followed by sections it points to:
+ *
+ * scene      - the scene header in the text format (STEP, XYZC, RESO, ...)
+ * ranges     - QuantRange of every brick, or of the volume, if quantized
+ * nodes      - the sparse layout's tree, if sparse: node table, child
+ * bricks       tables and the linear index of every stored brick
+ * origins
+ * macrocells - the buffer's macrocells, so loading doesn't have to scan it
+ * data       - the voxel storage exactly as a VoxelBuffer holds it in the
+ *              given layout and format, apron included, starting on a
+ *              VOLUME_ALIGNMENT boundary
+ *
+ * Everything is in native byte order. The small sections are copied on
+ * loading; the voxel data is mapped and sampled straight from the file
+ ******************************************************************************/
+
+typedef struct VolumeSection
+{
+    uint64_t offset;
+    uint64_t bytes;
+
+} VolumeSection;
+
+typedef struct VolumeHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int32_t dim[3];
+    float bounds[6];        // Corners p1 and p2 of the bounding box
+    uint32_t layout;        // VoxelLayout
+    uint32_t format;        // VoxelFormat
+    int32_t quantShift;
+    float quantMaxError;
+    float quantRMSError;
+    uint32_t reserved;
+    VolumeSection scene;
+    VolumeSection ranges;
+    VolumeSection nodes;
+    VolumeSection bricks;
+    VolumeSection origins;
+    VolumeSection macrocells;
+    VolumeSection data;
+
+} VolumeHeader;
+
+/*******************************************************************************
+ * A volume file, mapped whole. The header and every section are checked
+ * against the file's size when it is opened
+ ******************************************************************************/
+
+class VolumeFile : public MappedFile
+{
+    public:
+        VolumeFile(const std::string& filename);
+
+        const VolumeHeader& getHeader() const { return *reinterpret_cast<const VolumeHeader*>(this->bytes); }
+        std::string getScene() const;
+
+        // Start of a section in memory
+        const uint8_t* at(const VolumeSection& section) const { return this->bytes + section.offset; }
+
+        // Copy of a section as an array of T
+        template <typename T>
+        std::vector<T> read(const VolumeSection& section) const
+        {
+            if (section.bytes % sizeof(T) != 0) {
+                throw std::runtime_error("Volume file section has a partial entry: " + this->filename);
+            }
+
+            std::vector<T> entries(section.bytes / sizeof(T));
+            if (!entries.empty()) {
+                std::memcpy(entries.data(), this->at(section), section.bytes);
+            }
+
+            return entries;
+        }
+
+        // True if the file name has the volume file extension
+        static bool isVolumeFile(const std::string& filename);
+};
+
+#endif
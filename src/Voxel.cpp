@@ -1,21 +1,32 @@
 #include <cassert>
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <limits>
 #include <list>
+#include "BitmapTexture.h"
 #include "Ray.h"
 #include "Context.h"
 #include "Color.h"
+#include "DDAMarch.h"
 #include "Light.h"
+#include "MarchPolicy.h"
 #include "Primitive.h"
+#include "Scheduler.h"
+#include "Tracking.h"
 #include "Utils.h"
+#include "VolumeFile.h"
 #include "Voxel.h"
 
 /******************************************************************************/
 
-#define MARCH_EPSILON 1.0e-4f
+// Number of voxels handed to a worker at a time while baking lights
+#define BAKE_GRAIN 1024
+
+// Slack, in steps, when deciding which samples lie inside an empty macrocell
+#define MACROCELL_EPSILON 1.0e-3f
 
 /******************************************************************************/
 
@@ -29,82 +40,129 @@ using namespace glm;
 
 /******************************************************************************/
 
-ostream& operator<<(ostream &s, const Voxel &v)
-{
-    return s << "{ light = " << v.light  << ", density = " << v.density << " }";
-}
-
-/******************************************************************************/
-
-Voxel::Voxel(float _density) :
-    density(_density)
-{ 
-    fill(this->light, this->light + MAX_LIGHTS, -1.0f);
-}
-
-Voxel::Voxel(const Voxel& other) :
-    density(other.density)
-{
-    for (int i = 0; i < MAX_LIGHTS; i++) {
-        this->light[i] = other.light[i];
-    }
-}
-
-Voxel& Voxel::operator=(const Voxel& other)
+/**
+ *
+ */
+VoxelBuffer::VoxelBuffer(ivec3 _dim
+                        ,const BoundingBox& _bounds
+                        ,std::shared_ptr<Material> _material
+                        ,VoxelLayout _layout) :
+    Primitive(_dim, _bounds, _material),
+    padded(true),
+    layout(_layout),
+    macrocellDim(0, 0, 0),
+    macrocellsDirty(true),
+    marchKernel(nullptr)
 {
-    if (this == &other) {
-        return *this;
-    }
+    this->updateGrid();
 
-    this->density = other.density;
-    for (int i = 0; i < MAX_LIGHTS; i++) {
-        this->light[i] = other.light[i];
+    if (this->getLayout() == LAYOUT_SPARSE) {
+        this->clearSparse();
+    } else {
+        this->storage.setDensities(make_shared<vector<float> >(this->layout.storageSize(), 0.0f));
     }
-
-    return *this;
 }
 
-/******************************************************************************/
-
 /**
  *
  */
 VoxelBuffer::VoxelBuffer(ivec3 _dim
+                        ,shared_ptr<vector<float> > _densities
                         ,const BoundingBox& _bounds
                         ,std::shared_ptr<Material> _material) :
-    Primitive(_dim, _bounds, _material)
+    Primitive(_dim, _bounds, _material),
+    storage(_densities),
+    padded(false),
+    layout(LAYOUT_LINEAR),
+    macrocellDim(0, 0, 0),
+    macrocellsDirty(true),
+    marchKernel(nullptr)
 {
-    this->buffer = make_shared<vector<Voxel> >();
-    this->buffer->resize(this->gridDim.x * this->gridDim.y * this->gridDim.z);
+    this->setDimensions(_dim);
 }
 
 /**
  *
  */
-VoxelBuffer::VoxelBuffer(ivec3 _dim
-                        ,shared_ptr<vector<Voxel> > _buffer
+VoxelBuffer::VoxelBuffer(shared_ptr<vector<float> > _densities
                         ,const BoundingBox& _bounds
                         ,std::shared_ptr<Material> _material) :
-    Primitive(_dim, _bounds, _material)
+    Primitive(_bounds, _material),
+    storage(_densities),
+    padded(false),
+    layout(LAYOUT_LINEAR),
+    macrocellDim(0, 0, 0),
+    macrocellsDirty(true),
+    marchKernel(nullptr)
 {
-    assert(_buffer);
+
 }
 
 /**
- *
+ * Samples the voxels of the given volume file where they lie in its mapping.
+ * Macrocells saved with the file are used as they are
  */
-VoxelBuffer::VoxelBuffer(shared_ptr<vector<Voxel> > _buffer
-                        ,const BoundingBox& _bounds
+VoxelBuffer::VoxelBuffer(shared_ptr<VolumeFile> file
                         ,std::shared_ptr<Material> _material) :
-    Primitive(_bounds, _material)
+    Primitive(ivec3(file->getHeader().dim[0], file->getHeader().dim[1], file->getHeader().dim[2])
+             ,BoundingBox(P(file->getHeader().bounds[0], file->getHeader().bounds[1], file->getHeader().bounds[2])
+                         ,P(file->getHeader().bounds[3], file->getHeader().bounds[4], file->getHeader().bounds[5]))
+             ,_material),
+    storage(file),
+    padded(true),
+    layout(static_cast<VoxelLayout>(file->getHeader().layout)),
+    macrocellDim(0, 0, 0),
+    macrocellsDirty(true),
+    marchKernel(nullptr)
 {
-    assert(_buffer);
-    this->buffer = _buffer;
+    const VolumeHeader& header = file->getHeader();
+
+    if (header.layout > LAYOUT_SPARSE) {
+        throw runtime_error("Unknown voxel layout in volume file: " + file->getFilename());
+    }
+
+    this->updateGrid();
+
+    // Every index the samplers will follow has to land in the file:
+    vector<int> origins = file->read<int>(header.origins);
+    bool invalid        = !this->layout.setTree(file->read<int>(header.nodes), file->read<int>(header.bricks), origins, static_cast<int>(origins.size())) || 
+                          !this->checkBufferSize() || 
+                          !this->storage.hasRanges();
+
+    if (invalid) {
+        throw runtime_error("Volume file size does not match its dimensions: " + file->getFilename());
+    }
+
+    this->macrocells = file->read<Macrocell>(header.macrocells);
+
+    if (this->macrocells.empty()) {
+        this->updateMacrocells();
+    } else {
+        ivec3 cells = (this->gridDim + (MACROCELL_SIZE - 1)) / MACROCELL_SIZE;
+        if (this->macrocells.size() != static_cast<size_t>(cells.x * cells.y * cells.z)) {
+            throw runtime_error("Volume file macrocells do not match its dimensions: " + file->getFilename());
+        }
+        this->macrocellDim    = cells;
+        this->macrocellsDirty = false;
+    }
 }
 
 VoxelBuffer::VoxelBuffer(const VoxelBuffer& other) :
     Primitive(other),
-    buffer(other.buffer)
+    storage(other.storage),
+    padded(other.padded),
+    layout(other.layout),
+    gridScale(other.gridScale),
+    interpScale(other.interpScale),
+    interpMax(other.interpMax),
+    lightPlanes(other.lightPlanes),
+    macrocells(other.macrocells),
+    macrocellDim(other.macrocellDim),
+    macrocellsDirty(other.macrocellsDirty),
+    mipmaps(other.mipmaps),
+    marchPolicy(other.marchPolicy),
+    marchParams(other.marchParams),
+    marchKernel(other.marchKernel)
 {
 
 }
@@ -119,35 +177,668 @@ VoxelBuffer::~VoxelBuffer()
  ******************************************************************************/
 
 /**
- *
+ * Tests if storage holds as many voxels as the layout addresses
+ */
+bool VoxelBuffer::checkBufferSize() const
+{
+    return this->layout.storageSize() == this->storage.size();
+}
+
+/**
+ * Recomputes the storage layout and the world to grid scales for the
+ * current dimensions and bounds
+ */
+void VoxelBuffer::updateGrid()
+{
+    this->layout.setDimensions(this->gridDim);
+
+    vec3 dim    = vec3(this->gridDim);
+    vec3 extent = this->bounds.getP2().p - this->bounds.getP1().p;
+
+    this->gridScale   = (dim - this->voxelDim) / extent;
+    this->interpScale = (dim - 1.0f) / extent;
+    this->interpMax   = vec3(nextafter(dim.x, 0.0f), nextafter(dim.y, 0.0f), nextafter(dim.z, 0.0f));
+}
+
+/**
+ * Sets the grid dimensions. Densities the buffer was constructed with are
+ * taken to be in linear order and are copied into padded storage; otherwise
+ * the contents are cleared, unless the dimensions are unchanged. Sparse
+ * buffers pack their input by way of linear storage
+ */
+void VoxelBuffer::setDimensions(ivec3 dim)
+{
+    // Setting the dimensions a buffer already has keeps its contents:
+    bool keep = this->padded && this->hasLoadedDimensions() && dim == this->gridDim;
+
+    if (keep && this->isMapped()) {
+        return;
+    }
+
+    Primitive::setDimensions(dim);
+    this->updateGrid();
+
+    if (keep) {
+        this->updateMacrocells();
+        return;
+    }
+
+    if (this->getFormat() != FORMAT_FLOAT) {
+        throw runtime_error("Quantized voxel buffers can't be resized");
+    }
+
+    this->storage.detach();
+
+    VoxelLayout layout = this->getLayout();
+
+    if (layout == LAYOUT_SPARSE) {
+
+        if (this->padded) {
+            this->clearSparse();
+            this->lightPlanes.clear();
+            this->updateMacrocells();
+            return;
+        }
+
+        this->layout = GridLayout(LAYOUT_LINEAR, dim);
+    }
+
+    int count = dim.x * dim.y * dim.z;
+    auto source = this->storage.getDensities();
+    auto target = make_shared<vector<float> >(this->layout.storageSize(), 0.0f);
+
+    if (!this->padded) {
+
+        if (static_cast<int>(source->size()) != count) {
+            throw runtime_error("Expected " + to_string(count) + " densities for the given dimensions, but read " + to_string(source->size()));
+        }
+
+        parallelFor(dim.z, 1, [&](int begin, int end) {
+            for (int k=begin; k<end; k++) {
+                for (int j=0; j<dim.y; j++) {
+                    for (int i=0; i<dim.x; i++) {
+                        (*target)[this->sub2ind(i, j, k)] = (*source)[i + (j * dim.x) + (k * dim.x * dim.y)];
+                    }
+                }
+            }
+        });
+    }
+
+    this->storage.setDensities(target);
+    this->padded = true;
+    this->lightPlanes.clear();
+
+    if (layout == LAYOUT_SPARSE) {
+        this->setLayout(LAYOUT_SPARSE);
+    }
+
+    this->updateMacrocells();
+}
+
+/**
+ * Reorders the densities into the given layout. Light baked in the old
+ * layout is dropped, so prepare() needs to run afterwards
  */
-bool VoxelBuffer::checkBufferSize(const glm::ivec3& dim, std::shared_ptr<std::vector<Voxel> > buffer) const
+void VoxelBuffer::setLayout(VoxelLayout layout)
 {
-    return static_cast<unsigned int>(dim.x * dim.y * dim.z) == buffer->size();
+    assert(this->hasLoadedDimensions());
+
+    if (layout == this->getLayout()) {
+        return;
+    }
+
+    if (this->getFormat() != FORMAT_FLOAT) {
+        throw runtime_error("Voxel buffers must be laid out before they are quantized");
+    }
+
+    if (!this->checkBufferSize()) {
+        throw runtime_error("Voxel buffer size does not match its dimensions");
+    }
+
+    this->storage.detach();
+    this->lightPlanes.clear();
+
+    if (layout == LAYOUT_SPARSE) {
+        this->packSparse();
+        return;
+    }
+
+    GridLayout from(this->layout);
+    GridLayout to(layout, this->gridDim);
+    auto source = this->storage.getDensities();
+    auto target = make_shared<vector<float> >(to.storageSize(), 0.0f);
+
+    parallelFor(this->gridDim.z, 1, [&](int begin, int end) {
+        for (int k=begin; k<end; k++) {
+            for (int j=0; j<this->gridDim.y; j++) {
+                for (int i=0; i<this->gridDim.x; i++) {
+                    (*target)[to.sub2ind(i, j, k)] = (*source)[from.sub2ind(i, j, k)];
+                }
+            }
+        }
+    });
+
+    this->storage.setDensities(target);
+    this->layout = to;
+}
+
+/**
+ * Bytes held by the densities and the sparse layout's tree. The voxels of a
+ * mapped buffer count too, though they live in the page cache
+ */
+size_t VoxelBuffer::storageBytes() const
+{
+    return this->storage.bytes() + this->layout.treeBytes();
+}
+
+/*******************************************************************************
+ * Sparse layout
+ ******************************************************************************/
+
+// The tree marks empty macrocells by their bricks:
+static_assert(MACROCELL_SIZE == BRICK_SIZE, "Sparse bricks must line up with macrocells");
+
+/**
+ * Empties the tree for the current dimensions, leaving only the shared empty
+ * brick
+ */
+void VoxelBuffer::clearSparse()
+{
+    this->layout.clear();
+    this->storage.setDensities(make_shared<vector<float> >(BRICK_VOXELS, 0.0f));
+}
+
+/**
+ * Converts the densities from the current layout to the sparse one. A brick
+ * is stored if it or the one voxel border around it has any density, the
+ * same test that decides whether a macrocell is empty, so the tree marks
+ * exactly the empty macrocells
+ */
+void VoxelBuffer::packSparse()
+{
+    assert(this->getLayout() != LAYOUT_SPARSE);
+
+    GridLayout from(this->layout);
+    GridLayout to(LAYOUT_SPARSE, this->gridDim);
+    auto source = this->storage.getDensities();
+    ivec3 sd    = to.getSparseDimensions();
+    int count   = sd.x * sd.y * sd.z;
+    vector<char> used(count, 0);
+
+    parallelFor(count, 1, [&](int begin, int end) {
+
+        for (int b=begin; b<end; b++) {
+
+            ivec3 brick(b % sd.x, (b / sd.x) % sd.y, b / (sd.x * sd.y));
+            ivec3 lo = glm::max(((brick - 1) * BRICK_SIZE) - 1, ivec3(0));
+            ivec3 hi = glm::min((brick * BRICK_SIZE) + 1, this->gridDim);
+
+            for (int k=lo.z; k<hi.z && !used[b]; k++) {
+                for (int j=lo.y; j<hi.y && !used[b]; j++) {
+                    for (int i=lo.x; i<hi.x; i++) {
+                        if ((*source)[from.sub2ind(i, j, k)] != 0.0f) {
+                            used[b] = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    to.clear();
+
+    for (int b=0; b<count; b++) {
+        if (used[b]) {
+            to.allocateBrick(b % sd.x, (b / sd.x) % sd.y, b / (sd.x * sd.y));
+        }
+    }
+
+    auto target = make_shared<vector<float> >(to.storageSize(), 0.0f);
+    int stored  = static_cast<int>(to.storedBricks());
+
+    // Brick 0 is the shared empty one:
+    parallelFor(stored - 1, 1, [&](int begin, int end) {
+
+        for (int n=begin; n<end; n++) {
+
+            ivec3 brick = to.getOrigin(n + 1);
+            ivec3 lo    = glm::max((brick - 1) * BRICK_SIZE, ivec3(0));
+            ivec3 hi    = glm::min(brick * BRICK_SIZE, this->gridDim);
+
+            for (int k=lo.z; k<hi.z; k++) {
+                for (int j=lo.y; j<hi.y; j++) {
+                    for (int i=lo.x; i<hi.x; i++) {
+                        (*target)[to.sub2ind(i, j, k)] = (*source)[from.sub2ind(i, j, k)];
+                    }
+                }
+            }
+        }
+    });
+
+    this->storage.setDensities(target);
+    this->layout = to;
+}
+
+/*******************************************************************************
+ * Quantization
+ ******************************************************************************/
+
+/**
+ * Converts the densities to the given precision, with a range for each brick,
+ * or for the whole volume in the linear layout. Bricks are aligned in
+ * storage, so a storage index shifted right by the bits of a brick's voxel
+ * count is its brick
+ */
+void VoxelBuffer::setFormat(VoxelFormat format)
+{
+    assert(this->hasLoadedDimensions());
+
+    if (format == this->getFormat()) {
+        return;
+    }
+
+    // Codes are always made from floats:
+    this->storage.setFormat(FORMAT_FLOAT);
+
+    if (format == FORMAT_FLOAT) {
+        return;
+    }
+
+    auto source = this->storage.getDensities();
+
+    this->storage.setFormat(format, this->getLayout() == LAYOUT_LINEAR ? 31 : 3 * BRICK_SHIFT);
+
+    // Error over the voxels of the grid, a slice at a time:
+    vector<double> sliceSum(this->gridDim.z, 0.0);
+    vector<float> sliceMax(this->gridDim.z, 0.0f);
+
+    parallelFor(this->gridDim.z, 1, [&](int begin, int end) {
+        for (int k=begin; k<end; k++) {
+            for (int j=0; j<this->gridDim.y; j++) {
+                for (int i=0; i<this->gridDim.x; i++) {
+                    int w       = this->sub2ind(i, j, k);
+                    float error = std::abs(this->storage.value(w) - (*source)[w]);
+                    sliceMax[k]  = std::max(sliceMax[k], error);
+                    sliceSum[k] += static_cast<double>(error) * static_cast<double>(error);
+                }
+            }
+        }
+    });
+
+    double sum     = 0.0;
+    double size    = static_cast<double>(this->gridDim.x) * this->gridDim.y * this->gridDim.z;
+    float maxError = 0.0f;
+
+    for (int k=0; k<this->gridDim.z; k++) {
+        sum     += sliceSum[k];
+        maxError = std::max(maxError, sliceMax[k]);
+    }
+
+    this->storage.setQuantizationError(maxError, static_cast<float>(std::sqrt(sum / size)));
+    this->lightPlanes.clear();
+    this->updateMacrocells();
+}
+
+/*******************************************************************************
+ * Volume files
+ ******************************************************************************/
+
+// Storage is saved and mapped as it is:
+static_assert(sizeof(int) == sizeof(int32_t), "Sparse tables are saved as 32-bit integers");
+static_assert(sizeof(Macrocell) == 2 * sizeof(float), "Macrocells are saved as pairs of floats");
+
+/**
+ * Writes the buffer to the given stream as a volume file: the header, the
+ * scene header text and tables, then the voxel storage, padded out to start
+ * on a VOLUME_ALIGNMENT boundary so it can be mapped in place
+ */
+void VoxelBuffer::save(ostream& os, const string& scene) const
+{
+    if (!this->hasLoadedDimensions() || !this->padded) {
+        throw runtime_error("Voxel buffers need their dimensions before they can be saved");
+    }
+
+    VolumeHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VOLUME_MAGIC, sizeof(header.magic));
+
+    header.version       = VOLUME_VERSION;
+    header.byteOrder     = VOLUME_BYTE_ORDER;
+    header.layout        = static_cast<uint32_t>(this->getLayout());
+    header.format        = static_cast<uint32_t>(this->getFormat());
+    header.quantShift    = this->storage.getShift();
+
+    this->storage.getQuantizationError(header.quantMaxError, header.quantRMSError);
+
+    for (int a=0; a<3; a++) {
+        header.dim[a]        = this->gridDim[a];
+        header.bounds[a]     = this->bounds.getP1().p[a];
+        header.bounds[a + 3] = this->bounds.getP2().p[a];
+    }
+
+    // Sections in the order they are written, and what goes in them:
+    VolumeSection* sections[] = { &header.scene
+                                , &header.ranges
+                                , &header.nodes
+                                , &header.bricks
+                                , &header.origins
+                                , &header.macrocells
+                                , &header.data };
+    const void* contents[]    = { scene.data()
+                                , this->storage.getRanges().data()
+                                , this->layout.getNodes().data()
+                                , this->layout.getBricks().data()
+                                , this->layout.getOrigins().data()
+                                , this->macrocells.data()
+                                , this->storage.getData() };
+    size_t sizes[]            = { scene.size()
+                                , this->storage.getRanges().size() * sizeof(QuantRange)
+                                , this->layout.getNodes().size() * sizeof(int)
+                                , this->layout.getBricks().size() * sizeof(int)
+                                , this->layout.getOrigins().size() * sizeof(int)
+                                , this->hasMacrocells() ? this->macrocells.size() * sizeof(Macrocell) : 0
+                                , static_cast<size_t>(this->storage.size()) * this->storage.voxelBytes() };
+    int count                 = static_cast<int>(sizeof(sizes) / sizeof(sizes[0]));
+    uint64_t offset           = sizeof(VolumeHeader);
+
+    for (int s=0; s<count; s++) {
+        if (s == count - 1) {
+            offset = (offset + VOLUME_ALIGNMENT - 1) / VOLUME_ALIGNMENT * VOLUME_ALIGNMENT;
+        }
+        sections[s]->offset = offset;
+        sections[s]->bytes  = sizes[s];
+        offset += sizes[s];
+    }
+
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    uint64_t written = sizeof(VolumeHeader);
+    const vector<char> zeros(VOLUME_ALIGNMENT, 0);
+
+    for (int s=0; s<count; s++) {
+        os.write(zeros.data(), static_cast<streamsize>(sections[s]->offset - written));
+        os.write(static_cast<const char*>(contents[s]), static_cast<streamsize>(sizes[s]));
+        written = sections[s]->offset + sizes[s];
+    }
+
+    if (!os) {
+        throw runtime_error("Couldn't write volume file");
+    }
 }
 
 /*******************************************************************************
  * Indexing and assignment operations
  ******************************************************************************/
 
-Voxel VoxelBuffer::operator()(int i, int j, int k) const 
+float& VoxelBuffer::operator()(int i, int j, int k)
 {
-    return (*this->buffer)[sub2ind(i, j, k)];
+    if (this->getFormat() != FORMAT_FLOAT) {
+        throw runtime_error("Quantized voxel buffers are read-only");
+    }
+
+    this->storage.detach();
+    this->macrocellsDirty = true;
+
+    if (this->getLayout() == LAYOUT_SPARSE) {
+
+        int added = this->layout.allocateAround(i, j, k);
+
+        // New bricks are zero, and stored after all the others:
+        if (added > 0) {
+            this->storage.grow(added * BRICK_VOXELS);
+            this->lightPlanes.clear();
+        }
+    }
+
+    return (*this->storage.getDensities())[sub2ind(i, j, k)];
 }
 
-Voxel& VoxelBuffer::operator()(int i, int j, int k)
+float& VoxelBuffer::operator()(int w)
+{
+    if (this->getFormat() != FORMAT_FLOAT) {
+        throw runtime_error("Quantized voxel buffers are read-only");
+    }
+
+    this->storage.detach();
+    this->macrocellsDirty = true;
+    return (*this->storage.getDensities())[w];
+}
+
+const vector<float>& VoxelBuffer::getDensities() const
+{
+    if (this->getFormat() != FORMAT_FLOAT) {
+        throw runtime_error("Quantized voxel buffers have no float densities");
+    }
+
+    if (this->isMapped()) {
+        throw runtime_error("Mapped voxel buffers keep their densities in the volume file");
+    }
+
+    return *this->storage.getDensities();
+}
+
+/*******************************************************************************
+ * Empty space skipping
+ ******************************************************************************/
+
+/**
+ * Recomputes the min/max density of every macrocell. Each cell also covers a
+ * one voxel border around its own voxels, since that is how far a trilinear
+ * lookup made from inside the cell can reach. In the sparse layout, cells
+ * whose brick isn't stored are known to be empty without reading them
+ */
+void VoxelBuffer::updateMacrocells()
+{
+    this->macrocells.clear();
+    this->macrocellsDirty = true;
+
+    if (!this->hasLoadedDimensions() || !this->checkBufferSize()) {
+        return;
+    }
+
+    this->macrocellDim = (this->gridDim + (MACROCELL_SIZE - 1)) / MACROCELL_SIZE;
+
+    int mx    = this->macrocellDim.x;
+    int my    = this->macrocellDim.y;
+    int count = mx * my * this->macrocellDim.z;
+
+    this->macrocells.resize(count);
+
+    parallelFor(count, 1, [&](int begin, int end) {
+
+        for (int c=begin; c<end; c++) {
+
+            ivec3 cell(c % mx, (c / mx) % my, c / (mx * my));
+            ivec3 lo = glm::max((cell * MACROCELL_SIZE) - 1, ivec3(0, 0, 0));
+            ivec3 hi = glm::min(((cell + 1) * MACROCELL_SIZE) + 1, this->gridDim);
+
+            if (!this->layout.isStored(cell.x * MACROCELL_SIZE, cell.y * MACROCELL_SIZE, cell.z * MACROCELL_SIZE)) {
+                this->macrocells[c] = Macrocell(0.0f, 0.0f);
+                continue;
+            }
+
+            float minDensity = numeric_limits<float>::infinity();
+            float maxDensity = -numeric_limits<float>::infinity();
+
+            for (int k=lo.z; k<hi.z; k++) {
+                for (int j=lo.y; j<hi.y; j++) {
+                    for (int i=lo.x; i<hi.x; i++) {
+                        float density = this->storage.value(this->sub2ind(i, j, k));
+                        minDensity = std::min(minDensity, density);
+                        maxDensity = std::max(maxDensity, density);
+                    }
+                }
+            }
+
+            this->macrocells[c] = Macrocell(minDensity, maxDensity);
+        }
+    });
+
+    this->macrocellsDirty = false;
+}
+
+/**
+ * Returns the macrocell containing voxel (i,j,k)
+ */
+const Macrocell& VoxelBuffer::getMacrocell(int i, int j, int k) const
+{
+    assert(this->hasMacrocells());
+
+    return this->macrocells[(i / MACROCELL_SIZE) + 
+                            (j / MACROCELL_SIZE) * this->macrocellDim.x + 
+                            (k / MACROCELL_SIZE) * this->macrocellDim.x * this->macrocellDim.y];
+}
+
+/**
+ * Number of steps of dG it takes to get from G to the first position past the
+ * box [lo, hi) in grid space, at least 1
+ */
+static inline int exitSteps(const vec3& lo, const vec3& hi, const vec3& G, const vec3& dG)
+{
+    // Steps until the ray crosses the nearest of the box's exit planes:
+    float t = static_cast<float>(numeric_limits<int>::max() / 2);
+
+    for (int a=0; a<3; a++) {
+        if (dG[a] > 0.0f) {
+            t = std::min(t, (hi[a] - G[a]) / dG[a]);
+        } else if (dG[a] < 0.0f) {
+            t = std::min(t, (lo[a] - G[a]) / dG[a]);
+        }
+    }
+
+    return std::max(1, static_cast<int>(ceil(t - MACROCELL_EPSILON)));
+}
+
+/**
+ * If voxel (i,j,k) lies in a macrocell with no density, returns the number of
+ * steps of dG it takes to get from G to the first position past that cell (at
+ * least 1), otherwise returns 0. In the sparse layout, a cell in a node of
+ * the tree without any bricks skips to the end of the whole node instead. G
+ * and dG are in the grid space given by positionToGrid() and directionToGrid()
+ */
+int VoxelBuffer::emptySteps(int i, int j, int k, const vec3& G, const vec3& dG) const
+{
+    if (this->getMacrocell(i, j, k).maxDensity > 0.0f) {
+        return 0;
+    }
+
+    vec3 lo(static_cast<float>((i / MACROCELL_SIZE) * MACROCELL_SIZE)
+           ,static_cast<float>((j / MACROCELL_SIZE) * MACROCELL_SIZE)
+           ,static_cast<float>((k / MACROCELL_SIZE) * MACROCELL_SIZE));
+    vec3 hi = lo + static_cast<float>(MACROCELL_SIZE);
+
+    this->layout.emptyNode(i, j, k, lo, hi);
+
+    return exitSteps(lo, hi, G, dG);
+}
+
+/**
+ * Number of steps of dG it takes to get from G to the first position past the
+ * macrocell voxel (i,j,k) lies in, at least 1, whether it is empty or not
+ */
+int VoxelBuffer::cellSteps(int i, int j, int k, const vec3& G, const vec3& dG) const
+{
+    vec3 lo(static_cast<float>((i / MACROCELL_SIZE) * MACROCELL_SIZE)
+           ,static_cast<float>((j / MACROCELL_SIZE) * MACROCELL_SIZE)
+           ,static_cast<float>((k / MACROCELL_SIZE) * MACROCELL_SIZE));
+
+    return exitSteps(lo, lo + static_cast<float>(MACROCELL_SIZE), G, dG);
+}
+
+/*******************************************************************************
+ * Lighting
+ ******************************************************************************/
+
+/**
+ * Precomputes the transmittance from the center of every voxel to every light
+ * in the context, storing it in one light plane per light so rayMarch() only
+ * has to look it up. Voxels whose whole neighborhood is empty can never contribute light and
+ * are left unbaked; rayMarch() falls back to computing those on demand.
+ * Shadow rays are marched the way the shadow buffer's march policy marches
+ * them. Buffers with mipmaps march shadow rays through level 1
+ */
+void VoxelBuffer::bakeLights(const RenderContext& context)
 {
-    return (*this->buffer)[sub2ind(i, j, k)];
+    assert(this->hasLoadedDimensions());
+
+    float epsilon = context.getShadowEpsilon();
+    auto& lights  = context.getLights();
+    int count     = this->storage.size();
+
+    // Shadows are smooth enough to march through the next coarser level,
+    // with the policy it was prepared with, or the one prepare() would give
+    // it, with steps scaled to match:
+    const VoxelBuffer& shadows = this->mipmaps.empty() ? *this : this->mipmaps.getLevel(1);
+    shared_ptr<MarchPolicy> unprepared;
+
+    if (shadows.getMarchPolicy() == nullptr) {
+        RenderContext shadowContext(context);
+        shadowContext.setStep(context.getStep() * (shadows.voxelSize() / this->voxelSize()));
+        unprepared = makeMarchPolicy(shadowContext, shadows);
+    }
+
+    const MarchPolicy& policy = unprepared != nullptr ? *unprepared : *shadows.getMarchPolicy();
+
+    assert(lights.size() <= MAX_LIGHTS);
+
+    this->lightPlanes.assign(lights.size(), vector<float>(count, -1.0f));
+
+    parallelFor(count, BAKE_GRAIN, [&](int begin, int end) {
+
+        for (int w=begin; w<end; w++) {
+
+            int i, j, k;
+            this->ind2sub(w, i, j, k);
+
+            // Bricks along the far faces of the grid have unused voxels:
+            if (!this->valid(i, j, k) || this->isEmptyNeighborhood(i, j, k)) {
+                continue;
+            }
+
+            P center;
+            this->center(i, j, k, center);
+
+            float jitter = context.getJitter(i, j, k);
+            auto li      = lights.begin();
+
+            for (int l=0; li != lights.end(); li++, l++) {
+
+                this->lightPlanes[l][w] = policy.shadow(shadows, center, li->position, jitter, epsilon);
+            }
+        }
+
+    }, context.getThreads());
 }
 
-Voxel VoxelBuffer::operator[](int i) const
+/**
+ * Everything prepare() does but lighting: empty space skipping, the march
+ * policy, and the march kernel composed from it
+ */
+void VoxelBuffer::prepareMarch(const RenderContext& context)
 {
-    return (*this->buffer)[i];
+    if (this->macrocellsDirty) {
+        this->updateMacrocells();
+    }
+
+    this->marchPolicy = makeMarchPolicy(context, *this);
+    this->marchKernel = selectMarchKernel(context, *this, this->marchParams);
 }
 
-Voxel& VoxelBuffer::operator()(int i)
+void VoxelBuffer::prepare(const RenderContext& context)
 {
-    return (*this->buffer)[i];
+    this->mipmaps.prepare(*this, context);
+    this->prepareMarch(context);
+
+    // Tracking estimates its own shadows, unless the buffer marches anyway:
+    if (context.getTracking() && this->marchKernel != genericKernel) {
+        this->lightPlanes.clear();
+    } else {
+        this->bakeLights(context);
+    }
+
+    this->mipmaps.filterLights(*this);
 }
 
 /*******************************************************************************
@@ -166,13 +857,110 @@ bool VoxelBuffer::intersects(const Ray& ray, const RenderContext& context, Hit&
         return false;
     }
 
-    RayMarch rm       = rayMarch(context, *this, entered, exited);
+    RayMarch rm = this->march(context, entered, exited);
+
     hit.color         = rm.color;
     hit.transmittance = rm.transmittance;
+    hit.samples       = rm.samples;
+    hit.samplesSaved  = rm.samplesSaved;
 
     return true;
 }
 
+/**
+ * Packet version of intersects(): marches the lanes of packet in mask that hit
+ * the bounding box, filling in their entries of hits, and returns the mask of
+ * lanes that were hit. transmittance and jitter, if given, are per lane, as
+ * in march()
+ */
+int VoxelBuffer::intersects(const RayPacket& packet
+                           ,int mask
+                           ,const RenderContext& context
+                           ,Hit hits[PACKET_SIZE]
+                           ,const float transmittance[PACKET_SIZE]
+                           ,const float jitter[PACKET_SIZE])
+{
+    assert(this->hasLoadedDimensions());
+
+    __m128 tNear, tFar;
+    int hitMask = intersectBounds(this->bounds, packet, tNear, tFar) & mask;
+
+    if (!hitMask) {
+        return 0;
+    }
+
+    // One level for the whole packet, fine enough for its nearest lane:
+    if (context.getLOD() && !this->mipmaps.empty()) {
+
+        alignas(16) float near[PACKET_SIZE];
+        _mm_store_ps(near, tNear);
+
+        float footprint = numeric_limits<float>::max();
+
+        for (int l=0; l<PACKET_SIZE; l++) {
+            if (hitMask & (1 << l)) {
+                const Ray& ray = packet.rays[l];
+                footprint      = std::min(footprint, context.getFootprint(ray.origin + (ray.direction * near[l])));
+            }
+        }
+
+        int level = this->mipmaps.levelFor(footprint);
+
+        if (level > 0) {
+            return rayMarchPacket(this->mipmaps.getContext(level)
+                                 ,this->mipmaps.getLevel(level)
+                                 ,packet
+                                 ,hitMask
+                                 ,tNear
+                                 ,tFar
+                                 ,hits
+                                 ,transmittance
+                                 ,jitter);
+        }
+    }
+
+    return rayMarchPacket(context, *this, packet, hitMask, tNear, tFar, hits, transmittance, jitter);
+}
+
+bool VoxelBuffer::isSpecialized() const
+{
+    return this->marchKernel != nullptr && this->marchKernel != genericKernel;
+}
+
+RayMarch VoxelBuffer::march(const RenderContext& context
+                           ,const P& entered
+                           ,const P& exited
+                           ,float transmittance
+                           ,float jitter) const
+{
+    if (this->marchKernel == nullptr) {
+        return rayMarch(context, *this, entered, exited);
+    }
+
+    if (context.getLOD() && !this->mipmaps.empty()) {
+
+        int level = this->mipmaps.levelFor(context.getFootprint(entered));
+
+        if (level > 0) {
+            return this->mipmaps.getLevel(level).march(this->mipmaps.getContext(level), entered, exited, transmittance, jitter);
+        }
+    }
+
+    if (transmittance >= 1.0f && jitter == 0.0f) {
+        return this->marchKernel(this->marchParams, *this, entered, exited);
+    }
+
+    // Stop once the transmittance of the whole ray drops below the cutoff:
+    MarchParams params = this->marchParams;
+    params.jitter      = jitter;
+
+    if (transmittance < 1.0f) {
+        params.cutoff /= transmittance;
+    }
+
+    return this->marchKernel(params, *this, entered, exited);
+}
+
 /**
  * Sets center to the center point of the voxel the point p falls within. 
  * If this method returns false, point o does not fall within a voxel
@@ -239,30 +1027,12 @@ bool VoxelBuffer::positionToIndex(const P& p, int& i, int& j, int& k) const
 {
     assert(this->hasLoadedDimensions());
 
-    auto p1  = this->bounds.getP1();
-    auto p2  = this->bounds.getP2();
-    float dx = unitRange(x(p), x(p1), x(p2));
-    float dy = unitRange(y(p), y(p1), y(p2));
-    float dz = unitRange(z(p), z(p1), z(p2));
-
-    // Needed for rounding errors: if the number is smaller than the threshold,
-    // it just becomes 0.0f
-    if (fabs(dx) < MARCH_EPSILON) {
-        dx = 0.0f;
-    }
-    if (fabs(dy) < MARCH_EPSILON) {
-        dy = 0.0f;
-    }
-    if (fabs(dz) < MARCH_EPSILON) {
-        dz = 0.0f;
-    }
-
-    float xLoc  = dx * ((static_cast<float>(this->gridDim.x)) - this->getVoxelWidth());
-    float yLoc  = dy * ((static_cast<float>(this->gridDim.y)) - this->getVoxelHeight());
-    float zLoc  = dz * ((static_cast<float>(this->gridDim.z)) - this->getVoxelDepth());
-    float xCell = static_cast<int>(xLoc);
-    float yCell = static_cast<int>(yLoc);
-    float zCell = static_cast<int>(zLoc);
+    // Truncation maps positions within rounding error below the grid to
+    // index 0 as well:
+    vec3 G    = this->positionToGrid(p);
+    int xCell = static_cast<int>(G.x);
+    int yCell = static_cast<int>(G.y);
+    int zCell = static_cast<int>(G.z);
 
     if (!this->valid(xCell, yCell, zCell)) {
         return false;
@@ -276,91 +1046,87 @@ bool VoxelBuffer::positionToIndex(const P& p, int& i, int& j, int& k) const
 }
 
 /**
- * Gets the trilinearly interpolated density for the given position
+ * Returns the continuous grid-space location of point p, scaled the same way
+ * as in positionToIndex(), so that truncating each component gives the
+ * (i,j,k) index of the voxel p falls within
  */
-float VoxelBuffer::getInterpolatedDensity(const P& p) const
+vec3 VoxelBuffer::positionToGrid(const P& p) const
 {
-    assert(this->hasLoadedDimensions());
-
-    auto p1  = this->bounds.getP1();
-    auto p2  = this->bounds.getP2();
-    float dx = unitRange(x(p), x(p1), x(p2));
-    float dy = unitRange(y(p), y(p1), y(p2));
-    float dz = unitRange(z(p), z(p1), z(p2));
-
-    float xLoc = dx * ((float)this->gridDim.x - 1);
-    float xWeight = xLoc - floor(xLoc); 
-    int x1 = static_cast<int>(xLoc);
-    int x2 = static_cast<int>(ceil(xLoc));
-
-    float yLoc = dy * ((float)this->gridDim.y - 1);
-    float yWeight = yLoc - floor(yLoc); 
-    int y1 = static_cast<int>(yLoc);
-    int y2 = static_cast<int>(ceil(yLoc));    
-
-    float zLoc = dz * ((float)this->gridDim.z - 1);
-    float zWeight = zLoc - floor(zLoc); 
-    int z1 = static_cast<int>(zLoc);
-    int z2 = static_cast<int>(ceil(zLoc));
-
-    float x1y1z1D = 0.0f;
-    float x1y1z2D = 0.0f;
-    float x1y2z1D = 0.0f;
-    float x1y2z2D = 0.0f;
-    float x2y1z1D = 0.0f;
-    float x2y1z2D = 0.0f;
-    float x2y2z1D = 0.0f;
-    float x2y2z2D = 0.0f;
+    return (p.p - this->bounds.getP1().p) * this->gridScale;
+}
 
-    if (this->valid(x1,y1,z1)) {
-        x1y1z1D = (*this)(x1,y1,z1).density;
-    }
-    if (this->valid(x1,y1,z2)) {
-        x1y1z2D = (*this)(x1,y1,z2).density;
-    }
-    if (this->valid(x1,y2,z1)) {
-        x1y2z1D = (*this)(x1,y2,z1).density;
-    }
-    if (this->valid(x1,y2,z2)) {
-        x1y2z2D = (*this)(x1,y2,z2).density;
-    }
-    if (this->valid(x2,y1,z1)) {
-        x2y1z1D = (*this)(x2,y1,z1).density;
-    }
-    if (this->valid(x2,y1,z2)) {
-        x2y1z2D = (*this)(x2,y1,z2).density;
-    }
-    if (this->valid(x2,y2,z1)) {
-        x2y2z1D = (*this)(x2,y2,z1).density;
-    }
-    if (this->valid(x2,y2,z2)) {
-        x2y2z2D = (*this)(x2,y2,z2).density;
-    }
+/**
+ * Returns vector v scaled into the grid space used by positionToGrid()
+ */
+vec3 VoxelBuffer::directionToGrid(const V& v) const
+{
+    return v * this->gridScale;
+}
 
-    return trilerp(xWeight, yWeight, zWeight, x1y1z1D, x1y1z2D, x1y2z1D,
-                   x1y2z2D, x2y1z1D, x2y1z2D, x2y2z1D, x2y2z2D) / 3.0f;
+// Same order of operations as Utils::lerp(), but visible to the optimizer
+static inline float lerpDensity(float v1, float v2, float t)
+{
+    return ((1.0f - t) * v1) + (t * v2);
 }
 
 /**
- * Convert a 3D index to a linear index
+ * Largest density stored in the buffer
  */
-int VoxelBuffer::sub2ind(int i, int j, int k) const
+float VoxelBuffer::getMaxDensity() const
 {
-    assert(this->hasLoadedDimensions());
+    float maxDensity = 0.0f;
+    int count        = this->storage.size();
 
-    return i + (j * this->gridDim.x) + k * (this->gridDim.x * this->gridDim.y);
+    for (int w=0; w<count; w++) {
+        maxDensity = std::max(maxDensity, this->storage.value(w));
+    }
+
+    return maxDensity;
 }
 
-/** 
- * Convert a linear index to a 3D index
+/**
+ * Gets the trilinearly interpolated density for the given position, which
+ * must lie within a voxel of the grid (see positionToIndex()). Corners past
+ * the far faces of the grid land in the apron, so all eight are read without
+ * bounds checks. In the brick layouts, cells that don't straddle a brick
+ * boundary are read from one brick without looking it up eight times.
+ *
+ * Since the weights add up to one, codes from a single range are
+ * interpolated first and dequantized once
  */
-void VoxelBuffer::ind2sub(int w, int& i, int& j, int& k) const
+float VoxelBuffer::getInterpolatedDensity(const P& p) const
 {
-    assert(this->hasLoadedDimensions());
+    vec3 loc  = glm::min(glm::max((p.p - this->bounds.getP1().p) * this->interpScale, vec3(0.0f)), this->interpMax);
+    vec3 cell = glm::floor(loc);
+    vec3 w    = loc - cell;
+    int i     = static_cast<int>(cell.x);
+    int j     = static_cast<int>(cell.y);
+    int k     = static_cast<int>(cell.z);
+
+    float v[8];
+    float scale  = 1.0f;
+    float offset = 0.0f;
+
+    if (this->getLayout() == LAYOUT_LINEAR) {
+        const ivec3& stride = this->layout.getStride();
+        this->storage.gatherCell(this->sub2ind(i, j, k), stride.y, stride.z, v, scale, offset);
+    } else if (this->layout.inOneBrick(i, j, k)) {
+        this->storage.gatherCell(this->sub2ind(i, j, k), BRICK_SIZE, BRICK_SIZE * BRICK_SIZE, v, scale, offset);
+    } else {
+        for (int c=0; c<8; c++) {
+            v[c] = this->storage.value(this->sub2ind(i + (c >> 2), j + ((c >> 1) & 1), k + (c & 1)));
+        }
+    }
 
-    i = w % this->gridDim.x;
-    j = (w / this->gridDim.x) % this->gridDim.y;
-    k = w / (this->gridDim.y * this->gridDim.x); 
+    // Same order of operations as Utils::trilerp():
+    float c00 = lerpDensity(v[0], v[4], w.x);
+    float c10 = lerpDensity(v[2], v[6], w.x);
+    float c01 = lerpDensity(v[1], v[5], w.x);
+    float c11 = lerpDensity(v[3], v[7], w.x);
+    float c0  = lerpDensity(c00, c10, w.y);
+    float c1  = lerpDensity(c01, c11, w.y);
+
+    return (offset + (scale * lerpDensity(c0, c1, w.z))) * (1.0f / 3.0f);
 }
 
 /**
@@ -375,6 +1141,26 @@ bool VoxelBuffer::valid(int i, int j, int k) const
            (k >= 0 && k < this->gridDim.z);
 }
 
+/**
+ * Tests if the voxel at (i,j,k) and all of its immediate neighbors have zero
+ * density
+ */
+bool VoxelBuffer::isEmptyNeighborhood(int i, int j, int k) const
+{
+    // Neighbors off the grid are in the apron, and so empty:
+    for (int kk = k - 1; kk <= k + 1; kk++) {
+        for (int jj = j - 1; jj <= j + 1; jj++) {
+            for (int ii = i - 1; ii <= i + 1; ii++) {
+                if ((*this)(ii, jj, kk) != 0.0f) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
 ostream& operator<<(ostream &s, const VoxelBuffer &vb)
 {
     s << "VoxelBuffer[" << vb.gridDim.x << "]"   <<
@@ -390,8 +1176,11 @@ ostream& operator<<(ostream &s, const VoxelBuffer &vb)
                 vb.ind2sub(w, ii, jj, kk);
                 s << q++ << "\t[(" << i << "," << j << "," << k << ")" 
                          <<  " => (" << ii << "," << jj << "," << kk <<")"
-                         << " => " << (*vb.buffer)[w] 
-                  << endl;
+                         << " => { density = " << vb.storage.value(w);
+                for (size_t l=0; l<vb.lightPlanes.size(); l++) {
+                    s << ", light[" << l << "] = " << vb.lightPlanes[l][w];
+                }
+                s << " }" << endl;
             }
         }
     }
@@ -402,48 +1191,107 @@ ostream& operator<<(ostream &s, const VoxelBuffer &vb)
  * Raymarching implementation using Beer's law for transmittance
  ******************************************************************************/
 
+/**
+ * Transmittance along the shadow ray starting at X and advancing by N for at
+ * most the given number of iterations, or until it leaves the volume. The
+ * optical depth is accumulated in grid space, so each step is a single vector
+ * add, and exp() is taken once at the end. If epsilon > 0, the march stops as
+ * soon as the transmittance is known to be below epsilon
+ */
 float Q(const VoxelBuffer& vb
        ,float kappa
        ,float step
        ,int iterations
        ,const P& X
-       ,const V& N)
+       ,const V& N
+       ,float epsilon)
 {
     assert(vb.hasLoadedDimensions());
 
-    int i = -1;
-    int j = -1;
-    int k = -1;
+    auto& dim      = vb.getDimensions();
+    vec3 G         = vb.positionToGrid(X);
+    vec3 dG        = vb.directionToGrid(N);
+    float tau      = 0.0f;
+    bool skipEmpty = vb.hasMacrocells();
+
+    // exp(-kappa * step * tau) < epsilon <=> tau > maxTau
+    float maxTau = epsilon > 0.0f 
+        ? -log(epsilon) / (kappa * step) 
+        : numeric_limits<float>::infinity();
+
+    for (int n=0; n<iterations; n++, G += dG) {
+
+        // Truncation (not floor) matches positionToIndex():
+        int i = static_cast<int>(G.x);
+        int j = static_cast<int>(G.y);
+        int k = static_cast<int>(G.z);
+
+        // Outside of the volume
+        if (i < 0 || i >= dim.x || j < 0 || j >= dim.y || k < 0 || k >= dim.z) {
+            break;
+        }
+
+        // Samples inside an empty macrocell add nothing, so jump to the first
+        // one past it:
+        int skip = skipEmpty ? vb.emptySteps(i, j, k, G, dG) : 0;
 
-    // Done or outside of the volume
-    if (!vb.positionToIndex(X, i, j, k) || iterations <= 0) {
-        return 1.0f;
+        if (skip > 0) {
+            n += skip - 1;
+            G += dG * static_cast<float>(skip - 1);
+            continue;
+        }
+
+        tau += vb(i, j, k);
+
+        if (tau > maxTau) {
+            break;
+        }
     }
 
-    return exp(-kappa * step * vb(i, j, k).density) * 
-           Q(vb, kappa, step, iterations - 1, X + N, N);
+    return exp(-kappa * step * tau);
 }
 
-RayMarch rayMarch(const RenderContext& context
-                 ,const VoxelBuffer& vb
-                 ,const P& start
-                 ,const P& end
-                 ,float (*densityFunction)(const Voxel& voxel, const P& X, void* densityData)
-                 ,void* densityData)
+/*******************************************************************************
+ * Ray march kernels
+ *
+ * rayMarchGeneric() handles any material and an optional density function,
+ * reading everything through the context and the material's virtual
+ * colorAt(). The specialized kernels below are instantiated for every
+ * combination of interpolation mode, material kind and light count, so their
+ * per-sample loops have no virtual calls, list walks or shared_ptr copies.
+ * selectMarchKernel() picks one per primitive
+ ******************************************************************************/
+
+static RayMarch rayMarchGeneric(const RenderContext& context
+                               ,const VoxelBuffer& vb
+                               ,const P& start
+                               ,const P& end
+                               ,float cutoff
+                               ,float jitter
+                               ,float (*densityFunction)(float density, const P& X, void* densityData)
+                               ,void* densityData)
 {
     float step        = context.getStep();
-    float kappa       = 1.0f;
+    float kappa       = KAPPA;
     float T           = 1.0f;
+    bool roulette     = context.getRoulette();
+    int samples       = 0;
+    int samplesSaved  = 0;
     bool interpolate  = context.getInterpolation();
-    auto material     = vb.getMaterial();
-    auto lights       = context.getLights();
+    auto material     = vb.getMaterial().get();
+    auto& lights      = context.getLights();
     auto accumColor   = Color(0.0f, 0.0f, 0.0f);
 
     P X;
     V N;
-    int iterations = traverse(step, MARCH_EPSILON, start, end, X, N);
+    int iterations = traverse(step, MARCH_EPSILON + (jitter * step), start, end, X, N);
 
-    for (int i=0; i<iterations; i++, X += N) {
+    // Empty space skipping only holds for the voxel densities themselves:
+    bool skipEmpty = densityFunction == nullptr && vb.hasMacrocells();
+    vec3 G         = vb.positionToGrid(X);
+    vec3 dG        = vb.directionToGrid(N);
+
+    for (int i=0; i<iterations; i++, X += N, G += dG) {
 
         int vi = -1;
         int vj = -1;
@@ -453,12 +1301,21 @@ RayMarch rayMarch(const RenderContext& context
             break;
         }
 
-        auto voxel = vb(vi, vj, vk);
+        // Samples inside an empty macrocell have no density, and so neither
+        // attenuate nor add color. Jump to the first one past the cell:
+        int skip = skipEmpty ? vb.emptySteps(vi, vj, vk, G, dG) : 0;
+
+        if (skip > 0) {
+            i += skip - 1;
+            X += N * static_cast<float>(skip - 1);
+            G += dG * static_cast<float>(skip - 1);
+            continue;
+        }
 
         // If the density function is provided, use it
         float density = densityFunction == nullptr 
-            ? voxel.density 
-            : densityFunction(voxel, X, densityData);
+            ? vb(vi, vj, vk) 
+            : densityFunction(vb(vi, vj, vk), X, densityData);
         
         if (interpolate) {
             density = vb.getInterpolatedDensity(X);
@@ -481,23 +1338,330 @@ RayMarch rayMarch(const RenderContext& context
 
         for (int k=0; li != lights.end(); li++, k++) {
 
-            auto light = *li;
-
-            int stepsToLight = traverse(step, offset, center, light->getPosition(), LX, LN);
+            // Use the transmittance baked by VoxelBuffer::bakeLights(), if
+            // there is one:
+            float lightT = vb.light(k, vi, vj, vk);
 
-            if (voxel.light[k] < 0.0f) {
-                voxel.light[k] = Q(vb, kappa, step, stepsToLight, LX, LN);
+            if (lightT < 0.0f) {
+                int stepsToLight = traverse(step, offset + (context.getJitter(vi, vj, vk) * step), center, li->position, LX, LN);
+                lightT = Q(vb, kappa, step, stepsToLight, LX, LN, context.getShadowEpsilon());
             }
 
-            accumColor += light->getColor() * 
+            accumColor += li->color * 
                           material->colorAt(X, vb.getBoundingBox().center()) * 
                           attenuation * 
                           T * 
-                          voxel.light[k];
+                          lightT;
+        }
+
+        samples++;
+
+        // Early ray termination: nothing behind this point can contribute 
+        // more than the cutoff. With Russian roulette, the ray survives with 
+        // probability T/cutoff and is reweighted to stay unbiased:
+        if (T < cutoff) {
+
+            if (roulette && unitHash(X, i) * cutoff < T) {
+                T = cutoff;
+                continue;
+            }
+
+            if (roulette) {
+                T = 0.0f;
+            }
+
+            samplesSaved = iterations - (i + 1);
+            break;
         }
     }
 
-    return RayMarch(accumColor, T);
+    return RayMarch(accumColor, T, samples, samplesSaved);
+}
+
+/**
+ * Kernel for any other material, or more lights than there are
+ * specializations for
+ */
+RayMarch genericKernel(const MarchParams& params
+                      ,const VoxelBuffer& vb
+                      ,const P& start
+                      ,const P& end)
+{
+    return rayMarchGeneric(*params.context, vb, start, end, params.cutoff, params.jitter, nullptr, nullptr);
+}
+
+/**
+ * Fills in params from the context and the voxel buffer's material, and
+ * returns the kernel specialized for them
+ */
+MarchKernel selectMarchKernel(const RenderContext& context
+                             ,const VoxelBuffer& vb
+                             ,MarchParams& params)
+{
+    auto& lights     = context.getLights();
+    auto material    = vb.getMaterial().get();
+    auto color       = dynamic_cast<Color*>(material);
+    auto texture     = dynamic_cast<BitmapTexture*>(material);
+    bool interpolate = context.getInterpolation();
+
+    params               = MarchParams();
+    params.context       = &context;
+    params.step          = context.getStep();
+    params.interpolate   = interpolate;
+    params.cutoff        = context.getCutoff();
+    params.shadowEpsilon = context.getShadowEpsilon();
+    params.roulette      = context.getRoulette();
+    params.origin        = vb.getBoundingBox().center();
+    params.texture       = texture;
+    params.lightCount    = static_cast<int>(lights.size());
+
+    if (params.lightCount > MAX_LIGHTS || (color == nullptr && texture == nullptr)) {
+        return genericKernel;
+    }
+
+    auto li = lights.begin();
+
+    for (int k=0; li != lights.end(); li++, k++) {
+        params.lightPosition[k] = li->position;
+        params.lightColor[k]    = color != nullptr ? li->color * (*color) : li->color;
+    }
+
+    // The buffer's march policy, or one that needs no state if it has not
+    // been prepared:
+    params.policy = vb.getMarchPolicy();
+
+    if (params.policy == nullptr) {
+        return context.getDDA()
+            ? DDAMarch().kernel(interpolate, texture != nullptr, params.lightCount)
+            : FixedStepMarch(params.step).kernel(interpolate, texture != nullptr, params.lightCount);
+    }
+
+    return params.policy->kernel(interpolate, texture != nullptr, params.lightCount);
+}
+
+/**
+ * Marches from start to end through vb. Without a density function this
+ * picks a specialized kernel for the call; VoxelBuffer::intersects() uses the
+ * one picked once by prepare() instead
+ */
+RayMarch rayMarch(const RenderContext& context
+                 ,const VoxelBuffer& vb
+                 ,const P& start
+                 ,const P& end
+                 ,float (*densityFunction)(float density, const P& X, void* densityData)
+                 ,void* densityData)
+{
+    if (densityFunction != nullptr) {
+        return rayMarchGeneric(context, vb, start, end, context.getCutoff(), 0.0f, densityFunction, densityData);
+    }
+
+    MarchParams params;
+    MarchKernel kernel = selectMarchKernel(context, vb, params);
+
+    return kernel(params, vb, start, end);
+}
+
+/*******************************************************************************
+ * Overlapping volumes
+ ******************************************************************************/
+
+/**
+ * Adds the light vb scatters at X toward the ray, per unit of density, to
+ * lit. Specialized buffers have their lights and material folded into their
+ * march parameters already; the others read them through the context
+ */
+static inline void overlapLight(const RenderContext& context
+                               ,const VoxelBuffer& vb
+                               ,const P& X
+                               ,int vi
+                               ,int vj
+                               ,int vk
+                               ,float density
+                               ,float lit[3])
+{
+    const MarchParams& params = vb.getMarchParams();
+    auto& lights              = context.getLights();
+    float step                = context.getStep();
+    float offset              = (2.0f * step) + MARCH_EPSILON;
+    bool specialized          = vb.isSpecialized();
+    auto li                   = lights.begin();
+
+    // The material color, unless it is folded into the light colors:
+    Color shade;
+
+    if (!specialized) {
+        shade = vb.getMaterial()->colorAt(X, vb.getBoundingBox().center());
+    } else if (params.texture != nullptr) {
+        shade = TextureShading::at(params, X);
+    }
+
+    auto scatter = [&](const Color& c, float lightT) {
+        lit[0] += c.fR() * density * lightT;
+        lit[1] += c.fG() * density * lightT;
+        lit[2] += c.fB() * density * lightT;
+    };
+
+    for (int k=0; li != lights.end(); li++, k++) {
+
+        float lightT = vb.light(k, vi, vj, vk);
+
+        if (lightT < 0.0f) {
+            P center, LX;
+            V LN;
+            vb.center(X, center);
+            int stepsToLight = traverse(step, offset + (context.getJitter(vi, vj, vk) * step), center, li->position, LX, LN);
+            lightT = Q(vb, KAPPA, step, stepsToLight, LX, LN, context.getShadowEpsilon());
+        }
+
+        if (!specialized) {
+            scatter(li->color * shade, lightT);
+        } else if (params.texture != nullptr) {
+            scatter(TextureShading::light(params, shade, k), lightT);
+        } else {
+            scatter(params.lightColor[k], lightT);
+        }
+    }
+}
+
+/**
+ * Marches a ray through voxel buffers whose bounding boxes overlap along it
+ * as if they were a single medium. hits are the buffers, as returned by
+ * BVH::intersect(). Each step samples every buffer the sample point falls
+ * in: their densities add up to attenuate a single transmittance, and each
+ * buffer adds its own lit color in proportion to its share of the density.
+ * Steps are skipped for as long as every buffer is either empty there, by
+ * its macrocells, or not reached yet. transmittance is what is left of the
+ * ray when it reaches the first buffer
+ */
+RayMarch rayMarchOverlap(const RenderContext& context
+                        ,const Ray& ray
+                        ,const BVHHit* hits
+                        ,int count
+                        ,float transmittance
+                        ,float jitter)
+{
+    auto& objects     = context.getObjects();
+    float step        = context.getStep();
+    float kappa       = KAPPA;
+    float cutoff      = transmittance < 1.0f ? context.getCutoff() / transmittance : context.getCutoff();
+    bool roulette     = context.getRoulette();
+    bool interpolate  = context.getInterpolation();
+    float speed       = glm::length(ray.direction);
+    float T           = 1.0f;
+    int samples       = 0;
+    int samplesSaved  = 0;
+    float accum[3]    = { 0.0f, 0.0f, 0.0f };
+    float tNear       = hits[0].tNear;
+    float tFar        = hits[0].tFar;
+
+    for (int h=1; h<count; h++) {
+        tNear = std::min(tNear, hits[h].tNear);
+        tFar  = std::max(tFar, hits[h].tFar);
+    }
+
+    P X;
+    V N;
+    int iterations = traverse(step
+                             ,MARCH_EPSILON + (jitter * step)
+                             ,ray.origin + (ray.direction * tNear)
+                             ,ray.origin + (ray.direction * tFar)
+                             ,X
+                             ,N);
+
+    for (int i=0; i<iterations; i++, X += N) {
+
+        float total   = 0.0f;
+        float lit[3]  = { 0.0f, 0.0f, 0.0f };
+        int skip      = iterations - i;
+
+        for (int h=0; h<count; h++) {
+
+            const VoxelBuffer& vb = *objects[hits[h].object].volume;
+
+            int vi = -1;
+            int vj = -1;
+            int vk = -1;
+
+            if (!vb.positionToIndex(X, vi, vj, vk)) {
+
+                // Whole steps until the ray reaches the buffer, if it hasn't:
+                float ahead = ((hits[h].tNear - tNear) * speed) - (MARCH_EPSILON + ((jitter + static_cast<float>(i)) * step));
+                skip        = std::min(skip, std::max(static_cast<int>(ahead / step), 0));
+                continue;
+            }
+
+            int empty = vb.hasMacrocells() ? vb.emptySteps(vi, vj, vk, vb.positionToGrid(X), vb.directionToGrid(N)) : 0;
+            skip      = std::min(skip, empty);
+
+            if (empty > 0) {
+                continue;
+            }
+
+            float density = interpolate ? vb.getInterpolatedDensity(X) : vb(vi, vj, vk);
+
+            if (density <= 0.0f) {
+                continue;
+            }
+
+            total += density;
+            overlapLight(context, vb, X, vi, vj, vk, density, lit);
+        }
+
+        if (skip > 0) {
+            i += skip - 1;
+            X += N * static_cast<float>(skip - 1);
+            continue;
+        }
+
+        samples++;
+
+        if (total <= 0.0f) {
+            continue;
+        }
+
+        float deltaT      = exp(-kappa * step * total);
+        float attenuation = (1.0f - deltaT) / kappa;
+
+        T *= deltaT;
+
+        // Each buffer's share of the light scattered at this step:
+        float weight = (attenuation * T) / total;
+
+        for (int c=0; c<3; c++) {
+            accum[c] = std::min(accum[c] + (lit[c] * weight), 1.0f);
+        }
+
+        if (T < cutoff) {
+
+            if (roulette && unitHash(X, i) * cutoff < T) {
+                T = cutoff;
+                continue;
+            }
+
+            if (roulette) {
+                T = 0.0f;
+            }
+
+            samplesSaved = iterations - (i + 1);
+            break;
+        }
+    }
+
+    return RayMarch(Color(accum[0], accum[1], accum[2]), T, samples, samplesSaved);
+}
+
+RayMarch VoxelBuffer::track(const RenderContext& context
+                           ,const P& entered
+                           ,const P& exited
+                           ,RandomStream& random) const
+{
+    // The estimators need a specialized kernel's parameters and the
+    // macrocells as majorants:
+    if (!this->canTrack()) {
+        return this->march(context, entered, exited);
+    }
+
+    return deltaTrack(this->marchParams, *this, entered, exited, random);
 }
 
 /******************************************************************************/
@@ -2,110 +2,341 @@
 #define _VOXEL
 
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 #include <memory>
 #include <glm/glm.hpp>
 #include "Context.h"
 #include "Color.h"
+#include "DensityStorage.h"
+#include "GridLayout.h"
+#include "MipPyramid.h"
+#include "Packet.h"
 #include "Primitive.h"
 
 /******************************************************************************/
 
+// Most lights a voxel buffer will bake transmittance for
 #define MAX_LIGHTS 5
 
+#define MARCH_EPSILON 1.0e-4f
+
+// Extinction coefficient used by Beer's law
+#define KAPPA 1.0f
+
+// Width, height and depth of a macrocell, in voxels
+#define MACROCELL_SIZE 8
+
 /*******************************************************************************
- * Individual voxel
+ * Density range over a block of MACROCELL_SIZE^3 voxels, widened by one voxel
+ * on every side so it also bounds trilinearly interpolated densities
  ******************************************************************************/
 
-class Voxel
+typedef struct Macrocell
 {
-    public:
-        float light[MAX_LIGHTS];
-        float density;
+    float minDensity;
+    float maxDensity;
 
-    public:
-        Voxel(float density = 0.0f);
-        Voxel(const Voxel& other);
-        Voxel& operator=(const Voxel& other);
+    Macrocell() : minDensity(0.0f), maxDensity(0.0f) { };
+    Macrocell(float _min, float _max) : minDensity(_min), maxDensity(_max) { };
 
-        friend std::ostream& operator<<(std::ostream &s, const Voxel &v);
-};
+} Macrocell;
 
+/*******************************************************************************
+ * Result of marching a ray through a voxel buffer
+ ******************************************************************************/
+
+typedef struct RayMarch {
+
+    Color color;
+    float transmittance;
+    int samples;      // Samples evaluated
+    int samplesSaved; // Samples left untaken by early ray termination
+
+    RayMarch() : 
+        transmittance(0.0f),
+        samples(0),
+        samplesSaved(0)
+    { };
+    RayMarch(Color _color, float _transmittance, int _samples = 0, int _samplesSaved = 0) : 
+        color(_color), 
+        transmittance(_transmittance),
+        samples(_samples),
+        samplesSaved(_samplesSaved)
+    { };
+
+} RayMarch;
+
+/*******************************************************************************
+ * Everything a march kernel reads that stays fixed over a render, gathered
+ * once per primitive by selectMarchKernel() so the per-sample loop touches
+ * neither the context's light list nor the material through a shared_ptr
+ ******************************************************************************/
+
+// Forward declarations:
+class BitmapTexture;
+class MarchPolicy;
+class VolumeFile;
+class VoxelBuffer;
+
+typedef struct MarchParams
+{
+    const RenderContext* context; // Read by the generic kernel, and for shadow jitter
+    const MarchPolicy* policy;    // The buffer's, for kernels that read its state
+    float step;
+    float jitter;                 // Fraction of a step the first sample is moved along by
+    bool interpolate;
+    float cutoff;
+    float shadowEpsilon;
+    bool roulette;
+    P origin;                     // Texture mapping origin: the center of the bounds
+    BitmapTexture* texture;       // The material, if it is a bitmap texture
+    int lightCount;
+    P lightPosition[MAX_LIGHTS];
+    Color lightColor[MAX_LIGHTS]; // Times the material color, if that is constant
+
+    MarchParams() : 
+        context(nullptr),
+        policy(nullptr),
+        step(0.0f),
+        jitter(0.0f),
+        interpolate(false),
+        cutoff(0.0f),
+        shadowEpsilon(0.0f),
+        roulette(false),
+        texture(nullptr),
+        lightCount(0)
+    { };
+
+} MarchParams;
+
+typedef RayMarch (*MarchKernel)(const MarchParams& params
+                               ,const VoxelBuffer& vb
+                               ,const P& start
+                               ,const P& end);
 
 /*******************************************************************************
  * Voxel buffer
+ *
+ * Voxel data is kept as a structure of arrays: the densities, which are all
+ * the ray marchers read per sample, sit in one contiguous float array, and
+ * the light transmittances baked by bakeLights() live in separate planes,
+ * one per light in the scene.
+ *
+ * Storage also covers a one voxel apron of zero density around the grid, so
+ * voxels -1 and gridDim can be read along every axis without a bounds check
  ******************************************************************************/
 
 class VoxelBuffer : public Primitive
 {
     private:
-        int sub2ind(int i, int j, int k) const;
-        void ind2sub(int w, int& i, int& j, int& k) const;
+        int sub2ind(int i, int j, int k) const { return this->layout.sub2ind(i, j, k); }
+        void ind2sub(int w, int& i, int& j, int& k) const { this->layout.ind2sub(w, i, j, k); }
         bool valid(int i, int j, int k) const;
-        bool checkBufferSize(const glm::ivec3& dim, std::shared_ptr<std::vector<Voxel> > buffer) const;
+        bool isEmptyNeighborhood(int i, int j, int k) const;
+        bool checkBufferSize() const;
+        void updateGrid();
 
     protected:
-        std::shared_ptr<std::vector<Voxel> > buffer;
+        // Densities by storage index, in the buffer's format
+        DensityStorage storage;
+        bool padded;         // False while the densities still hold unpadded input
+
+        // Where each voxel is stored. The sparse layout stores bricks as
+        // they are written to, growing the densities to match
+        GridLayout layout;
+
+        void clearSparse();
+        void packSparse();
+
+        // Precomputed scales from world space to the grid spaces used by
+        // positionToIndex() and getInterpolatedDensity(), and the largest
+        // interpolation coordinate whose cell still lies within storage
+        glm::vec3 gridScale;
+        glm::vec3 interpScale;
+        glm::vec3 interpMax;
         std::shared_ptr<Material> material;
 
+        // Baked transmittance from every voxel to each light, indexed like
+        // densities. Planes only exist for lights that have been baked, and a
+        // negative entry marks a voxel that was skipped
+        std::vector<std::vector<float> > lightPlanes;
+
+        // Coarse min/max grid used to skip empty space. It is rebuilt when the
+        // dimensions change, and by prepare() after voxels have been written
+        // through one of the non-const accessors
+        std::vector<Macrocell> macrocells;
+        glm::ivec3 macrocellDim;
+        bool macrocellsDirty;
+
+        void updateMacrocells();
+
+        // Mip pyramid built by buildMipmaps(). The buffer bakes its shadows
+        // through level 1
+        MipPyramid mipmaps;
+
+        void prepareMarch(const RenderContext& ctx);
+
+        // March policy built by prepare() for the context it was given, and
+        // the kernel composed from it
+        std::shared_ptr<MarchPolicy> marchPolicy;
+        MarchParams marchParams;
+        MarchKernel marchKernel;
+
     public:
-        VoxelBuffer(glm::ivec3 dim, const BoundingBox& bounds, std::shared_ptr<Material> material);
-        VoxelBuffer(glm::ivec3 dim, std::shared_ptr<std::vector<Voxel> > voxels, const BoundingBox& bounds, std::shared_ptr<Material> material);
-        VoxelBuffer(std::shared_ptr<std::vector<Voxel> > voxels, const BoundingBox& bounds, std::shared_ptr<Material> material);
+        VoxelBuffer(glm::ivec3 dim, const BoundingBox& bounds, std::shared_ptr<Material> material, VoxelLayout layout = LAYOUT_LINEAR);
+        VoxelBuffer(glm::ivec3 dim, std::shared_ptr<std::vector<float> > densities, const BoundingBox& bounds, std::shared_ptr<Material> material);
+        VoxelBuffer(std::shared_ptr<std::vector<float> > densities, const BoundingBox& bounds, std::shared_ptr<Material> material);
+        VoxelBuffer(std::shared_ptr<VolumeFile> file, std::shared_ptr<Material> material);
         VoxelBuffer(const VoxelBuffer& other);
         virtual ~VoxelBuffer();
 
         bool center(const P& p, P& center) const;
         bool center(int i, int j, int k, P& center) const;
         bool positionToIndex(const P& p, int& i, int& j, int& k) const;
+        glm::vec3 positionToGrid(const P& p) const;
+        glm::vec3 directionToGrid(const V& v) const;
+        const glm::vec3& getInterpolationScale() const { return this->interpScale; }
+        const glm::vec3& getInterpolationLimit() const { return this->interpMax; }
+        float voxelSize() const { return std::min(this->voxelDim.x, std::min(this->voxelDim.y, this->voxelDim.z)); }
+        virtual void setDimensions(glm::ivec3 dim);
+
+        // Storage order. Densities are always supplied in linear order, so
+        // the layout should be changed once the dimensions are final. Buffers
+        // that fill themselves in can be built sparse from the start
+
+        VoxelLayout getLayout() const { return this->layout.getType(); }
+        void setLayout(VoxelLayout layout);
+
+        // Bytes taken up by the densities and, in the sparse layout, its tree
+        size_t storageBytes() const;
+
+        // Density precision. Quantizing should come after the layout is set,
+        // and leaves the buffer read-only; going back to floats keeps the
+        // error. The error is measured over the voxels of the grid
+
+        VoxelFormat getFormat() const { return this->storage.getFormat(); }
+        void setFormat(VoxelFormat format);
+        void getQuantizationError(float& maxError, float& rmsError) const { this->storage.getQuantizationError(maxError, rmsError); }
+
+        // Volume files. A buffer built from one samples the file's voxels in
+        // place, and only copies them once it is written to, resized or
+        // converted. Saving stores the buffer as it is, in its layout and
+        // format, along with the given scene header
+
+        bool isMapped() const { return this->storage.isMapped(); }
+        void save(std::ostream& os, const std::string& scene) const;
+
+        // Empty space skipping
+
+        bool hasMacrocells() const { return !this->macrocellsDirty && !this->macrocells.empty(); }
+        const Macrocell& getMacrocell(int i, int j, int k) const;
+        const glm::ivec3& getMacrocellDimensions() const { return this->macrocellDim; }
+        int emptySteps(int i, int j, int k, const glm::vec3& G, const glm::vec3& dG) const;
+        int cellSteps(int i, int j, int k, const glm::vec3& G, const glm::vec3& dG) const;
+
+        // March policy picked by prepare(), if it has been prepared
+
+        const MarchPolicy* getMarchPolicy() const { return this->marchPolicy.get(); }
+
+        // Parameters of the kernel prepare() picked. Unless the kernel is a
+        // specialized one, they hold neither the lights nor the material
+
+        const MarchParams& getMarchParams() const { return this->marchParams; }
+        bool isSpecialized() const;
+
+        // Level of detail. Mipmaps are built from the current densities, so
+        // they need rebuilding after those change
+
+        void buildMipmaps(MipFilter filter) { this->mipmaps.build(*this, filter); }
+        int getMipLevels() const { return this->mipmaps.getLevels(); }
+
+        float getMaxDensity() const;
         float getInterpolatedDensity(const P& p) const;
 
-        // Indexing and assignment operations
+        // Indexing and assignment operations. These all address the density
+        // of a voxel; writing through the non-const ones invalidates the
+        // macrocells. In the sparse layout, the non-const (i,j,k) accessor
+        // first stores the bricks around the voxel, which can move the
+        // densities in memory and drops baked light; it must not be used
+        // concurrently. The const ones dequantize; the non-const ones throw
+        // on quantized buffers, as does getDensities(), which also throws on
+        // mapped ones
 
-        Voxel operator() (int i, int j, int k) const;
-        Voxel& operator() (int i, int j, int k);
-        Voxel operator[](int i) const;
-        Voxel& operator()(int i);
+        float operator() (int i, int j, int k) const { return this->storage.value(this->sub2ind(i, j, k)); }
+        float& operator() (int i, int j, int k);
+        float operator[](int w) const                { return this->storage.value(w); }
+        float& operator()(int w);
+        const std::vector<float>& getDensities() const;
+
+        // Baked transmittance from voxel (i,j,k) to light l, or a negative
+        // value if there is none
+
+        float light(int l, int i, int j, int k) const
+        {
+            return l < static_cast<int>(this->lightPlanes.size()) ? this->lightPlanes[l][this->sub2ind(i, j, k)] : -1.0f;
+        }
+
+        // Lighting
+
+        void bakeLights(const RenderContext& ctx);
+        virtual void prepare(const RenderContext& ctx);
 
         // Intersection
 
         virtual bool intersects(const Ray& ray, const RenderContext& ctx, Hit& hit);
+        int intersects(const RayPacket& packet
+                      ,int mask
+                      ,const RenderContext& ctx
+                      ,Hit hits[PACKET_SIZE]
+                      ,const float transmittance[PACKET_SIZE] = nullptr
+                      ,const float jitter[PACKET_SIZE] = nullptr);
+
+        // Marches from entered to exited with the kernel picked by prepare().
+        // transmittance is what is left of the ray when it gets here, so
+        // early termination applies to the ray as a whole. jitter moves the
+        // first sample along by that fraction of a step
+        RayMarch march(const RenderContext& ctx, const P& entered, const P& exited, float transmittance = 1.0f, float jitter = 0.0f) const;
+
+        // Delta tracking estimate of the same, with shadows estimated by
+        // ratio tracking. Buffers that can't be tracked, having no
+        // specialized kernel or no macrocells, march instead
+        bool canTrack() const { return this->isSpecialized() && this->hasMacrocells(); }
+        RayMarch track(const RenderContext& ctx, const P& entered, const P& exited, Utils::RandomStream& random) const;
 
         std::string getTypeName() const { return "VoxelBuffer"; };
 
+        friend class MipPyramid;
         friend std::ostream& operator<<(std::ostream &s, const VoxelBuffer& b);
 };
 
 /******************************************************************************/
 
-typedef struct RayMarch {
-
-    Color color;
-    float transmittance;
-
-    RayMarch() : 
-        transmittance(0.0f)
-    { };
-    RayMarch(Color _color, float _transmittance) : 
-        color(_color), 
-        transmittance(_transmittance)
-    { };
-
-} RayMarch;
+MarchKernel selectMarchKernel(const RenderContext& ctx
+                             ,const VoxelBuffer& vb
+                             ,MarchParams& params);
 
 float Q(const VoxelBuffer& vb
        ,float kappa
        ,float step
        ,int iterations
        ,const P& X
-       ,const V& N);
+       ,const V& N
+       ,float epsilon = 0.0f);
 
 RayMarch rayMarch(const RenderContext& ctx
                  ,const VoxelBuffer& vb
                  ,const P& startPosition
                  ,const P& endPosition
-                 ,float (*densityFunction)(const Voxel& voxel, const P& X, void* densityData) = NULL
+                 ,float (*densityFunction)(float density, const P& X, void* densityData) = NULL
                  ,void* densityData = NULL);
 
+RayMarch rayMarchOverlap(const RenderContext& ctx
+                        ,const Ray& ray
+                        ,const BVHHit* hits
+                        ,int count
+                        ,float transmittance = 1.0f
+                        ,float jitter = 0.0f);
+
 #endif
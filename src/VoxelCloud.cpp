@@ -13,8 +13,9 @@ VoxelCloud::VoxelCloud(float radius
                       ,int seed
                       ,int octaves
                       ,float freq
-                      ,float amp) :
-    VoxelBuffer(dim, bounds, material)
+                      ,float amp
+                      ,VoxelLayout layout) :
+    VoxelBuffer(dim, bounds, material, layout)
 {
     this->radius = radius;
     this->scale  = scale;
@@ -38,7 +39,11 @@ VoxelCloud::VoxelCloud(float radius
                 float factor  = (1.0f - (glm::length(cloudCenter - voxelCenter) / this->radius));
                 float density = std::max(0.0f, (fbm + factor) * this->scale);
 
-                (*this)(i, j, k) = Voxel(density);
+                // The buffer starts out empty, and sparse storage only
+                // grows where density is written:
+                if (density != 0.0f) {
+                    (*this)(i, j, k) = density;
+                }
             }
         }
     }
@@ -13,8 +13,9 @@ VoxelPyroclastic::VoxelPyroclastic(float radius
                                   ,int seed
                                   ,int octaves
                                   ,float freq
-                                  ,float amp) :
-    VoxelBuffer(dim, bounds, material)
+                                  ,float amp
+                                  ,VoxelLayout layout) :
+    VoxelBuffer(dim, bounds, material, layout)
 {
     this->radius = radius;
     this->scale  = scale;
@@ -38,7 +39,9 @@ VoxelPyroclastic::VoxelPyroclastic(float radius
                 float factor  = glm::length(cloudCenter - voxelCenter) / this->radius;
                 float density = std::max(0.0f, this->radius - factor + std::fabs(fbm)) * this->scale;
 
-                (*this)(i, j, k) = Voxel(density);
+                if (density != 0.0f) {
+                    (*this)(i, j, k) = density;
+                }
             }
         }
     }
@@ -17,7 +17,8 @@ class VoxelPyroclastic : public VoxelBuffer
                         ,int seed
                         ,int octaves
                         ,float freq
-                        ,float amp);
+                        ,float amp
+                        ,VoxelLayout layout = LAYOUT_LINEAR);
 
         float getScale()  { return this->scale; };
         float getRadius() { return this->radius; };
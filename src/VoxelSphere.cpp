@@ -5,8 +5,9 @@ VoxelSphere::VoxelSphere(float radius
                         ,float scale
                         ,glm::ivec3 dim
                         ,const BoundingBox& bounds
-                        ,std::shared_ptr<Material> material) :
-VoxelBuffer(dim, bounds, material)
+                        ,std::shared_ptr<Material> material
+                        ,VoxelLayout layout) :
+VoxelBuffer(dim, bounds, material, layout)
 { 
     this->radius = radius;
     this->scale  = scale;
@@ -32,7 +33,9 @@ VoxelBuffer(dim, bounds, material)
                     //density = ((this->radius - d) / this->radius) * this->scale; 
                 }
 
-                (*this)(i, j, k) = Voxel(density);
+                if (density != 0.0f) {
+                    (*this)(i, j, k) = density;
+                }
             }
         }
     }
@@ -14,7 +14,8 @@ class VoxelSphere : public VoxelBuffer
                    ,float scale
                    ,glm::ivec3 dim
                    ,const BoundingBox& bounds
-                   ,std::shared_ptr<Material> material);
+                   ,std::shared_ptr<Material> material
+                   ,VoxelLayout layout = LAYOUT_LINEAR);
 
         float getScale()  { return this->scale; };
         float getRadius() { return this->radius; };
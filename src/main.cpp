@@ -1,3 +1,4 @@
+#include <chrono>
 #include <cstdlib>
 #define _USE_MATH_DEFINES
 #include <cmath>
@@ -6,9 +7,11 @@
 #include <list>
 #include <string>
 #include <memory>
+#include <stdexcept>
 #include <glm/glm.hpp>
 #include <optionparser.h>
 #include <CImg.h>
+#include "Allocations.h"
 #include "R3.h"
 #include "Utils.h"
 #include "Color.h"
@@ -17,6 +20,10 @@
 #include "Light.h"
 #include "Config.h"
 #include "Context.h"
+#include "Scene.h"
+#include "Scheduler.h"
+#include "StreamedVolume.h"
+#include "VolumeFile.h"
 #include "Voxel.h"
 
 /******************************************************************************/
@@ -46,6 +53,22 @@ enum OptionIndex {
   ,OUTPUT_FILENAME
   ,NO_INPUT_HEADER
   ,TRILINEAR_INTERPOLATION
+  ,TILE_SIZE
+  ,THREADS
+  ,SHADOW_EPSILON
+  ,CUTOFF
+  ,ROULETTE
+  ,PACKETS
+  ,LAYOUT
+  ,DDA
+  ,TOLERANCE
+  ,TRACKING
+  ,JITTER
+  ,PREINTEGRATE
+  ,MIP
+  ,QUANTIZE
+  ,CONVERT
+  ,STREAM
 };
 
 const option::Descriptor usage[] =
@@ -122,6 +145,134 @@ const option::Descriptor usage[] =
     ,option::Arg::None
     ,"  -I/--interpolation \t\tEnable trilinear interpolation"
   },
+  {
+     TILE_SIZE
+    ,0
+    ,"T"
+    ,"tile"
+    ,option::Arg::Optional
+    ,"  -T/--tile \t\tRender tile width and height, in pixels (int)"
+  },
+  {
+     THREADS
+    ,0
+    ,"j"
+    ,"threads"
+    ,option::Arg::Optional
+    ,"  -j/--threads \t\tNumber of render threads (int)"
+  },
+  {
+     SHADOW_EPSILON
+    ,0
+    ,"E"
+    ,"shadow-epsilon"
+    ,option::Arg::Optional
+    ,"  -E/--shadow-epsilon \t\tStop shadow rays once their transmittance drops below this; 0 disables (float)"
+  },
+  {
+     CUTOFF
+    ,0
+    ,"C"
+    ,"cutoff"
+    ,option::Arg::Optional
+    ,"  -C/--cutoff \t\tStop primary rays once their transmittance drops below this; 0 disables (float)"
+  },
+  {
+     ROULETTE
+    ,0
+    ,"R"
+    ,"roulette"
+    ,option::Arg::None
+    ,"  -R/--roulette \t\tUse unbiased Russian roulette at the -C/--cutoff threshold instead of stopping"
+  },
+  {
+     PACKETS
+    ,0
+    ,"P"
+    ,"packets"
+    ,option::Arg::None
+    ,"  -P/--packets \t\tTrace primary rays in 2x2 SSE packets"
+  },
+  {
+     LAYOUT
+    ,0
+    ,"L"
+    ,"layout"
+    ,option::Arg::Optional
+    ,"  -L/--layout \t\tVoxel storage order: linear (default), bricked or sparse (string)"
+  },
+  {
+     DDA
+    ,0
+    ,"G"
+    ,"dda"
+    ,option::Arg::None
+    ,"  -G/--dda \t\tWalk the exact voxels each ray crosses instead of stepping by -S/--step; samples the nearest voxel"
+  },
+  {
+     TOLERANCE
+    ,0
+    ,"A"
+    ,"tolerance"
+    ,option::Arg::Optional
+    ,"  -A/--tolerance \t\tAdaptive steps: largest error allowed per step, between 1/16 of a voxel and one voxel, in place of -S/--step; 0 disables (float)"
+  },
+  {
+     TRACKING
+    ,0
+    ,"K"
+    ,"tracking"
+    ,option::Arg::Optional
+    ,"  -K/--tracking \t\tEstimate volumes by delta tracking, with shadows by ratio tracking, averaging this many samples per pixel; overlapping volumes and ones that can't be tracked are marched once per pixel (int, default 16)"
+  },
+  {
+     JITTER
+    ,0
+    ,"J"
+    ,"jitter"
+    ,option::Arg::None
+    ,"  -J/--jitter \t\tStart every march at a blue-noise offset within the first step, seeded by SEED, trading banding for fine noise"
+  },
+  {
+     PREINTEGRATE
+    ,0
+    ,"B"
+    ,"preintegrate"
+    ,option::Arg::None
+    ,"  -B/--preintegrate \t\tIntegrate each step exactly with density changing linearly across it, and shadows exactly, for larger steps at the same quality"
+  },
+  {
+     MIP
+    ,0
+    ,"M"
+    ,"mip"
+    ,option::Arg::Optional
+    ,"  -M/--mip \t\tBuild density mipmaps with the given filter, box (default) or gaussian, and march each ray at the level its pixel footprint needs (string)"
+  },
+  {
+     QUANTIZE
+    ,0
+    ,"Q"
+    ,"quantize"
+    ,option::Arg::Optional
+    ,"  -Q/--quantize \t\tStore densities as 8 (default) or 16-bit codes, scaled per brick in the brick layouts and per volume otherwise (int)"
+  },
+  {
+     CONVERT
+    ,0
+    ,"V"
+    ,"convert"
+    ,option::Arg::Optional
+    ,"  -V/--convert \t\tSave the scene's voxel buffer, in the chosen layout and format, to the given " VOLUME_EXTENSION " volume file instead of rendering; volume files are loaded by mapping them (string)"
+  },
+  {
+     STREAM
+    ,0
+    ,"Z"
+    ,"stream"
+    ,option::Arg::Optional
+    ,"  -Z/--stream \t\tRead a bricked or sparse " VOLUME_EXTENSION " volume file from disk as it is rendered, keeping at most this many MB of bricks in memory, 256 by default (int)"
+  },
   {
      UNKNOWN
     ,0
@@ -138,14 +289,30 @@ const option::Descriptor usage[] =
 
 /******************************************************************************/
 
+/**
+ * Reads the given configuration file; version 0 detects the format, and
+ * version 3 is a volume file. Objects are built in the given voxel layout;
+ * volume files are streamed through a cache of stream MB if that is set
+ */
 static shared_ptr<Configuration> readConfig(string filename
-	                                       ,int version = 1
-	                                       ,bool skipHeader = false)
+	                                       ,int version = 0
+	                                       ,bool skipHeader = false
+	                                       ,VoxelLayout layout = LAYOUT_LINEAR
+	                                       ,int stream = 0)
 {
 	ifstream configFile(filename.c_str());
 	shared_ptr<Configuration> config(nullptr);
 
+	if (version == 0) {
+		version = VolumeFile::isVolumeFile(filename) ? 3 : Configuration::detectVersion(filename);
+	}
+
 	switch (version) {
+		case 3:
+			{
+				config = make_shared<BinaryConfigurationReader>(filename);
+			}
+			break;
 		case 2:
 			{
 				config = make_shared<NewConfigurationReader>();
@@ -154,11 +321,13 @@ static shared_ptr<Configuration> readConfig(string filename
 		case 1:
 		default:
 			{
-				config = make_shared<OldConfigurationReader>();
+				config = make_shared<OldConfigurationReader>(filename);
 			}
 			break;
 	}
 
+	config->LAYOUT = layout;
+	config->STREAM = stream;
 	config->read(configFile, skipHeader);
 	configFile.close();
 
@@ -179,53 +348,523 @@ void intializeCamera(shared_ptr<Configuration> config, Camera& camera)
 
 /******************************************************************************/
 
-void render(CImg<unsigned char>& output
-	         ,ivec2 resolution
-	         ,const Camera& camera
-	         ,const RenderContext& context)
+/**
+ * Runs the per-object precomputation (light baking, etc.) for every object in
+ * the scene before any rays are cast
+ */
+void prepare(const RenderContext& context)
+{
+	auto& objects = context.getObjects();
+	auto start    = chrono::steady_clock::now();
+
+	for (auto oi = objects.begin(); oi != objects.end(); oi++) {
+		oi->primitive->prepare(context);
+	}
+
+	clog << "Prepared " << objects.size() << " object(s) in " 
+	     << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s" 
+	     << endl;
+}
+
+/*******************************************************************************
+ * Sample counts gathered while rendering, used to tune the early ray 
+ * termination cutoff
+ ******************************************************************************/
+
+typedef struct RenderStats
+{
+	long long samples;        // Samples evaluated
+	long long samplesSaved;   // Samples left untaken by early ray termination
+	long long objectsSkipped; // Objects never marched, since the pixel was already opaque
+	long long allocations;    // Heap allocations made while rendering tiles; see Allocations.h
+
+	RenderStats() : samples(0), samplesSaved(0), objectsSkipped(0), allocations(0) { };
+
+	RenderStats& operator+=(const RenderStats& other)
+	{
+		this->samples        += other.samples;
+		this->samplesSaved   += other.samplesSaved;
+		this->objectsSkipped += other.objectsSkipped;
+		this->allocations    += other.allocations;
+		return *this;
+	}
+
+} RenderStats;
+
+ostream& operator<<(ostream& s, const RenderStats& stats)
+{
+	long long total = stats.samples + stats.samplesSaved;
+
+	s << "RenderStats {" << endl
+	  << "  samples         = " << stats.samples << endl
+	  << "  samples saved   = " << stats.samplesSaved 
+	  << " (" << (total > 0 ? (100.0 * stats.samplesSaved) / total : 0.0) << "%)" << endl
+	  << "  objects skipped = " << stats.objectsSkipped << endl;
+
+	if (Allocations::enabled()) {
+		s << "  allocations     = " << stats.allocations << endl;
+	}
+
+	return s << "}";
+}
+
+/******************************************************************************/
+
+/**
+ * Number of candidates, starting at first, whose intervals along the ray
+ * overlap one another (directly or through others in the run)
+ */
+static int overlapping(const BVHHit* candidates, int first, int count)
 {
-	auto objects = context.getObjects();
+	float tFar = candidates[first].tFar;
+	int last   = first + 1;
+
+	while (last < count && candidates[last].tNear <= tFar) {
+		tFar = std::max(tFar, candidates[last].tFar);
+		last++;
+	}
+
+	return last - first;
+}
+
+/**
+ * What traceRay() found for a run of candidates it didn't track. Marches,
+ * overlaps and other primitives come out the same every time the ray gets
+ * to them with the same transmittance, so the estimates of a pixel share them
+ */
+typedef struct TracedRun
+{
+	RayMarch rm;
+	float transmittance; // Of the ray reaching the run
+	bool hit;
+	bool done;
+} TracedRun;
+
+/**
+ * Traces a primary ray through the candidates it passes through, in front to
+ * back order, and returns the pixel color. The ray carries one transmittance
+ * from object to object, so each object's color is attenuated by everything
+ * in front of it, and marching stops wherever the ray as a whole becomes
+ * (nearly) opaque. Voxel buffers whose intervals overlap are marched together
+ * by rayMarchOverlap(). With a random stream, volumes that can be are delta
+ * tracked; runs, indexed like candidates, then keep whatever isn't tracked
+ * for the next estimate of the same ray to reuse
+ */
+static Color traceRay(const Ray& ray
+	                 ,const P& pixel
+	                 ,const RenderContext& context
+	                 ,const BVHHit* candidates
+	                 ,int count
+	                 ,RenderStats& stats
+	                 ,RandomStream* random = nullptr
+	                 ,TracedRun* runs = nullptr)
+{
+	auto& objects = context.getObjects();
+	float cutoff  = context.getCutoff();
+	bool roulette = context.getRoulette();
+	float jitter  = context.getJitter(static_cast<int>(x(pixel)), static_cast<int>(y(pixel)));
+
+	Color accumColor(0,0,0);
+	float accumTransmittance = 1.0f;
+	int n = 0;
+
+	while (n < count) {
+
+		int run  = overlapping(candidates, n, count);
+		bool hit = true;
+		RayMarch rm;
+
+		for (int k=n; k<n+run; k++) {
+			if (objects[candidates[k].object].volume == nullptr) {
+				run = 1;
+			}
+		}
+
+		auto& candidate = candidates[n];
+		auto& object    = objects[candidate.object];
+		bool tracked    = run == 1 && random != nullptr && object.volume != nullptr && object.volume->canTrack();
+		bool reused     = !tracked && runs != nullptr && runs[n].done && runs[n].transmittance == accumTransmittance;
+
+		if (reused) {
+			rm  = runs[n].rm;
+			hit = runs[n].hit;
+		} else if (run > 1) {
+			rm = rayMarchOverlap(context, ray, candidates + n, run, accumTransmittance, jitter);
+		} else if (tracked) {
+			rm = object.volume->track(context
+			                         ,ray.origin + (ray.direction * candidate.tNear)
+			                         ,ray.origin + (ray.direction * candidate.tFar)
+			                         ,*random);
+		} else if (object.volume != nullptr) {
+			rm = object.volume->march(context
+			                         ,ray.origin + (ray.direction * candidate.tNear)
+			                         ,ray.origin + (ray.direction * candidate.tFar)
+			                         ,accumTransmittance
+			                         ,jitter);
+		} else {
+			Hit h;
+			hit = object.primitive->intersects(ray, context, h);
+			rm  = RayMarch(h.color, h.transmittance, h.samples, h.samplesSaved);
+		}
+
+		if (runs != nullptr && !tracked && !reused) {
+			runs[n].rm            = rm;
+			runs[n].transmittance = accumTransmittance;
+			runs[n].hit           = hit;
+			runs[n].done          = true;
+		}
+
+		n += run;
+
+		if (hit) {
+			accumColor         += rm.color * accumTransmittance;
+			accumTransmittance *= rm.transmittance;
+		}
+
+		// Samples are counted when they are taken:
+		if (hit && !reused) {
+			stats.samples      += rm.samples;
+			stats.samplesSaved += rm.samplesSaved;
+		}
+
+		// Once the pixel is (nearly) opaque, the remaining objects can't show
+		// through. Russian roulette keeps going with probability T/cutoff,
+		// reweighting T to stay unbiased:
+		if (accumTransmittance < cutoff && n < count) {
+
+			if (roulette && unitHash(pixel, n) * cutoff < accumTransmittance) {
+				accumTransmittance = cutoff;
+				continue;
+			}
+
+			if (roulette) {
+				accumTransmittance = 0.0f;
+			}
+
+			stats.objectsSkipped += count - n;
+			break;
+		}
+	}
+
+	return accumColor + (context.getBackground() * accumTransmittance);
+}
+
+/**
+ * Renders a tile in 2x2 pixel blocks, one SSE packet of primary rays per
+ * block. Objects that are voxel buffers are marched a packet at a time; any
+ * other primitive falls back to one scalar intersection test per lane. Lanes
+ * drop out of the packet individually once they are (nearly) opaque. Blocks
+ * whose rays pass through overlapping objects are traced one ray at a time
+ * with traceRay(). candidates is scratch space with room for every object
+ * in the scene
+ */
+static void renderPackets(CImg<unsigned char>& output
+	                     ,ivec2 resolution
+	                     ,const Camera& camera
+	                     ,const RenderContext& context
+	                     ,const Tile& tile
+	                     ,BVHHit* candidates
+	                     ,RenderStats& stats)
+{
+	auto& objects = context.getObjects();
+	auto& bvh     = context.getBVH();
+	float cutoff  = context.getCutoff();
+
+	for (int j=tile.y0; j<tile.y1; j+=2) {
+
+		for (int i=tile.x0; i<tile.x1; i+=2) {
+
+			Ray rays[PACKET_SIZE];
+			float jitter[PACKET_SIZE] = { 0.0f, 0.0f, 0.0f, 0.0f };
+			int mask = 0;
+
+			// Lane l covers pixel (i + l % 2, j + l / 2):
+			for (int l=0; l<PACKET_SIZE; l++) {
+				int pi = i + (l % 2);
+				int pj = j + (l / 2);
+				if (pi < tile.x1 && pj < tile.y1) {
+					rays[l]   = camera.spawnRay(pi, pj, resolution.x, resolution.y);
+					jitter[l] = context.getJitter(pi, pj);
+					mask     |= 1 << l;
+				}
+			}
+
+			RayPacket packet(rays, mask);
+			Hit hits[PACKET_SIZE];
+			Color accumColor[PACKET_SIZE];
+			float accumTransmittance[PACKET_SIZE] = { 1.0f, 1.0f, 1.0f, 1.0f };
+			int live = mask;
+
+			// Only the objects some lane passes through, nearest first:
+			int count = bvh.intersect(packet, mask, candidates);
+
+			bool overlaps = false;
+
+			for (int n=0, run=0; n<count; n+=run) {
+				run       = overlapping(candidates, n, count);
+				overlaps |= run > 1;
+			}
+
+			if (overlaps) {
+
+				for (int l=0; l<PACKET_SIZE; l++) {
+
+					if (!(mask & (1 << l))) {
+						continue;
+					}
+
+					int pi        = i + (l % 2);
+					int pj        = j + (l / 2);
+					int laneCount = bvh.intersect(rays[l], candidates);
+					Color screenPixel = traceRay(rays[l], P(pi, pj, 0), context, candidates, laneCount, stats);
+
+					output(pi, pj, 0, 0) = static_cast<unsigned char>(screenPixel.iR());
+					output(pi, pj, 0, 1) = static_cast<unsigned char>(screenPixel.iG());
+					output(pi, pj, 0, 2) = static_cast<unsigned char>(screenPixel.iB());
+				}
+
+				continue;
+			}
+
+			for (int n=0; n<count && live; n++) {
+
+				auto& object = objects[candidates[n].object];
+				int lanes    = live & candidates[n].mask;
+				int hitMask  = 0;
+
+				if (object.volume != nullptr) {
+					hitMask = object.volume->intersects(packet, lanes, context, hits, accumTransmittance, jitter);
+				} else {
+					for (int l=0; l<PACKET_SIZE; l++) {
+						if ((lanes & (1 << l)) && object.primitive->intersects(rays[l], context, hits[l])) {
+							hitMask |= 1 << l;
+						}
+					}
+				}
+
+				for (int l=0; l<PACKET_SIZE; l++) {
+
+					if (!(live & (1 << l))) {
+						continue;
+					}
+
+					if (hitMask & (1 << l)) {
+						accumColor[l]         += hits[l].color * accumTransmittance[l];
+						accumTransmittance[l] *= hits[l].transmittance;
+						stats.samples         += hits[l].samples;
+						stats.samplesSaved    += hits[l].samplesSaved;
+					}
+
+					if (accumTransmittance[l] < cutoff && n + 1 < count) {
+						stats.objectsSkipped += count - (n + 1);
+						live &= ~(1 << l);
+					}
+				}
+			}
+
+			// Set the pixel colors:
+			for (int l=0; l<PACKET_SIZE; l++) {
+
+				if (!(mask & (1 << l))) {
+					continue;
+				}
+
+				Color screenPixel = accumColor[l] + (context.getBackground() * accumTransmittance[l]);
+				int pi = i + (l % 2);
+				int pj = j + (l / 2);
+
+				output(pi, pj, 0, 0) = static_cast<unsigned char>(screenPixel.iR());
+				output(pi, pj, 0, 1) = static_cast<unsigned char>(screenPixel.iG());
+				output(pi, pj, 0, 2) = static_cast<unsigned char>(screenPixel.iB());
+			}
+		}
+	}
+}
+
+/******************************************************************************/
+
+/**
+ * Renders the scene into output, returning the totals of every worker's
+ * RenderStats
+ */
+RenderStats render(CImg<unsigned char>& output
+	              ,ivec2 resolution
+	              ,const Camera& camera
+	              ,const RenderContext& context)
+{
+	auto& objects = context.getObjects();
+	auto& bvh     = context.getBVH();
+	int spp       = context.getSamplesPerPixel();
 
 	if (context.getInterpolation()) {
 		cout << "*** USING TRILINEAR INTERPOLATION ***" << endl;
 	}	
 
-  #ifdef ENABLE_OPENMP
-  #pragma omp parallel for collapse(2)
-  #endif
-	for(int i=0; i<resolution.x; i++) {
+	TileScheduler scheduler(resolution
+	                       ,ivec2(context.getTileSize(), context.getTileSize())
+	                       ,context.getThreads());
+
+	vector<RenderStats> workerStats(scheduler.getThreadCount());
+
+	// Room for the objects a ray passes through, set aside up front for every
+	// worker so that tiles never allocate:
+	vector<vector<BVHHit>> workerCandidates(scheduler.getThreadCount(), vector<BVHHit>(objects.size()));
+	vector<vector<TracedRun>> workerRuns(scheduler.getThreadCount(), vector<TracedRun>(spp > 0 ? objects.size() : 0));
+
+	if (context.getPackets()) {
+		cout << "*** USING " << PACKET_SIZE << "-WIDE RAY PACKETS ***" << endl;
+	}
+
+	if (context.getTracking()) {
+		cout << "*** USING DELTA TRACKING, " << context.getSamplesPerPixel() << " SAMPLES PER PIXEL ***" << endl;
+	} else if (context.getDDA()) {
+		cout << "*** USING EXACT VOXEL TRAVERSAL ***" << endl;
+	} else if (context.getTolerance() > 0.0f) {
+		cout << "*** USING ADAPTIVE STEPS, TOLERANCE " << context.getTolerance() << " ***" << endl;
+	} else if (context.getPreIntegration()) {
+		cout << "*** USING PRE-INTEGRATED STEPS ***" << endl;
+	}
+
+	if (context.getLOD()) {
+		cout << "*** USING MIP-MAPPED DENSITIES ***" << endl;
+	}
+
+	if (context.getBlueNoise() != nullptr && !context.getTracking() && !context.getDDA()) {
+		cout << "*** USING BLUE-NOISE JITTER ***" << endl;
+	}
+
+	scheduler.run([&](const Tile& tile, int worker) {
+
+		RenderStats stats;
+
+		// Anything allocated from here on is per-tile work; the scheduler's
+		// own bookkeeping happens outside of this function:
+		long long allocated = Allocations::allocated();
+		BVHHit* candidates  = workerCandidates[worker].data();
+		TracedRun* runs     = workerRuns[worker].data();
+
+		if (context.getPackets()) {
+			renderPackets(output, resolution, camera, context, tile, candidates, stats);
+			stats.allocations   = Allocations::allocated() - allocated;
+			workerStats[worker] += stats;
+			return;
+		}
+
+		for (int j=tile.y0; j<tile.y1; j++) {
+
+			for (int i=tile.x0; i<tile.x1; i++) {
 
-		for (int j=0; j<resolution.y; j++) {
+				Ray ray = camera.spawnRay(i, j, resolution.x, resolution.y);
 
-			Ray ray = camera.spawnRay(i, j, resolution.x, resolution.y);
-			Hit hit;
+				// Only the objects the ray passes through, nearest first:
+				int count = bvh.intersect(ray, candidates);
 
-			Color accumColor(0,0,0);
-			float accumTransmittance = 1.0f;
+				// Set the pixel color:
+				Color screenPixel;
 
-			for (auto oi = objects.begin(); oi != objects.end(); oi++) {
-				if ((*oi)->intersects(ray, context, hit)) {
-					accumColor += hit.color;
-					accumTransmittance *= hit.transmittance;
+				if (spp > 0) {
+
+					// The mean of independent estimates, each drawing from
+					// its own stream. What isn't tracked is only computed
+					// once:
+					float sum[3] = { 0.0f, 0.0f, 0.0f };
+
+					for (int c=0; c<count; c++) {
+						runs[c].done = false;
+					}
+
+					for (int s=0; s<spp; s++) {
+						RandomStream random(static_cast<uint32_t>((j * resolution.x) + i), static_cast<uint32_t>(s));
+						Color estimate = traceRay(ray, P(i, j, 0), context, candidates, count, stats, &random, runs);
+						sum[0] += estimate.fR();
+						sum[1] += estimate.fG();
+						sum[2] += estimate.fB();
+					}
+
+					screenPixel = Color(sum[0] / spp, sum[1] / spp, sum[2] / spp);
+
+				} else {
+					screenPixel = traceRay(ray, P(i, j, 0), context, candidates, count, stats);
 				}
+
+				output(i, j, 0, 0) = static_cast<unsigned char>(screenPixel.iR());
+				output(i, j, 0, 1) = static_cast<unsigned char>(screenPixel.iG());
+				output(i, j, 0, 2) = static_cast<unsigned char>(screenPixel.iB());
 			}
+		}
 
-			// Set the pixel color:
-			Color screenPixel  = accumColor + (context.getBackground() * accumTransmittance);
+		stats.allocations    = Allocations::allocated() - allocated;
+		workerStats[worker] += stats;
+	});
 
-			output(i, j, 0, 0) = static_cast<unsigned char>(screenPixel.iR());
-			output(i, j, 0, 1) = static_cast<unsigned char>(screenPixel.iG());
-			output(i, j, 0, 2) = static_cast<unsigned char>(screenPixel.iB());
-		}
+	RenderStats totals;
 
-		//clog << "Rendering line: " << i << "\r";
-	}	
+	for (auto si = workerStats.begin(); si != workerStats.end(); si++) {
+		totals += *si;
+	}
+
+	clog << scheduler << endl;
+	clog << totals << endl;
+
+	for (auto oi = objects.begin(); oi != objects.end(); oi++) {
+		auto streamed = dynamic_cast<StreamedVolume*>(oi->primitive);
+		if (streamed != nullptr) {
+			clog << streamed->getCacheStats() << endl;
+		}
+	}
 
 	clog << endl << "Done!" << endl;
+
+	return totals;
 }
 
 /******************************************************************************/
 
+/**
+ * Megabytes of bricks the stream option allows, or 0 to map volume files
+ */
+static int readStream(option::Option* options)
+{
+    if (options[STREAM].count() == 0) {
+        return 0;
+    }
+
+    if (options[STREAM].first()->arg == nullptr) {
+        return 256;
+    }
+
+    bool success  = false;
+    int megabytes = toNumber<int>(options[STREAM].first()->arg, success);
+
+    if (!success || megabytes <= 0) {
+        throw runtime_error("The brick cache needs a size in MB greater than 0");
+    }
+
+    return megabytes;
+}
+
+/**
+ * Voxel storage order named by the layout option
+ */
+static VoxelLayout readLayout(option::Option* options)
+{
+    if (options[LAYOUT].count() == 0 || options[LAYOUT].first()->arg == nullptr) {
+        return LAYOUT_LINEAR;
+    }
+
+    string name = string(options[LAYOUT].first()->arg);
+
+    if (name == "linear") {
+        return LAYOUT_LINEAR;
+    } else if (name == "bricked") {
+        return LAYOUT_BRICKED;
+    } else if (name == "sparse") {
+        return LAYOUT_SPARSE;
+    }
+
+    throw runtime_error("Unknown voxel layout: " + name);
+}
+
 static void updateConfiguration(shared_ptr<Configuration> config
                                ,option::Option* options
                                ,bool skipHeader = false)
@@ -287,6 +926,205 @@ static void updateConfiguration(shared_ptr<Configuration> config
         (*i)->setDimensions(config->XYZC);
       }
     }
+
+    // Voxel storage order, applied once every object has its dimensions.
+    // Generated objects are already built in it:
+    if (options[LAYOUT].count() > 0 && options[LAYOUT].first()->arg != nullptr) {
+
+        VoxelLayout layout = readLayout(options);
+
+        for (auto i = objects.begin(); i != objects.end(); i++) {
+            auto vb = dynamic_cast<VoxelBuffer*>(*i);
+            if (vb != nullptr) {
+                vb->setLayout(layout);
+                if (layout == LAYOUT_SPARSE) {
+                    cout << "Sparse voxel storage: " << (vb->storageBytes() >> 10) << " KB" << endl;
+                }
+            }
+        }
+    }
+
+    // Quantized densities, from the final layout. Mipmaps are filtered from
+    // the quantized densities and quantized the same way:
+    if (options[QUANTIZE].count() > 0) {
+
+        int bits = 8;
+
+        if (options[QUANTIZE].first()->arg != nullptr) {
+            bits = toNumber<int>(options[QUANTIZE].first()->arg, success);
+            if (!success || (bits != 8 && bits != 16)) {
+                throw runtime_error("Densities can only be quantized to 8 or 16 bits");
+            }
+        }
+
+        for (auto i = objects.begin(); i != objects.end(); i++) {
+            auto vb = dynamic_cast<VoxelBuffer*>(*i);
+            if (vb != nullptr) {
+
+                float maxError, rmsError;
+
+                vb->setFormat(bits == 8 ? FORMAT_UINT8 : FORMAT_UINT16);
+                vb->getQuantizationError(maxError, rmsError);
+
+                cout << "Quantized densities to " << bits << " bits: max error " << maxError 
+                     << ", RMS error " << rmsError 
+                     << ", " << (vb->storageBytes() >> 10) << " KB" << endl;
+            }
+        }
+    }
+
+    // Mipmaps, built in the final layout and format:
+    if (options[MIP].count() > 0) {
+
+        string name = options[MIP].first()->arg != nullptr ? string(options[MIP].first()->arg) : "box";
+        MipFilter filter;
+
+        if (name == "box") {
+            filter = MIP_BOX;
+        } else if (name == "gaussian") {
+            filter = MIP_GAUSSIAN;
+        } else {
+            throw runtime_error("Unknown mipmap filter: " + name);
+        }
+
+        for (auto i = objects.begin(); i != objects.end(); i++) {
+            auto vb = dynamic_cast<VoxelBuffer*>(*i);
+            if (vb != nullptr) {
+                vb->buildMipmaps(filter);
+            }
+        }
+    }
+}
+
+/**
+ * Saves the scene's one voxel buffer to the volume file named by the convert
+ * option, along with the scene header
+ */
+static void convert(shared_ptr<Configuration> config, option::Option* options)
+{
+    if (options[CONVERT].first()->arg == nullptr) {
+        throw runtime_error("No volume file to convert to");
+    }
+
+    string filename = string(options[CONVERT].first()->arg);
+    auto objects    = config->getObjects();
+
+    if (objects.size() != 1 || dynamic_cast<VoxelBuffer*>(objects.front()) == nullptr) {
+        throw runtime_error("Only scenes of a single voxel buffer can be saved as volume files");
+    }
+
+    auto vb = dynamic_cast<VoxelBuffer*>(objects.front());
+    ofstream file(filename.c_str(), ios::binary);
+    ostringstream scene;
+
+    config->writeHeader(scene);
+    vb->save(file, scene.str());
+    file.close();
+
+    if (!file) {
+        throw runtime_error("Couldn't write volume file: " + filename);
+    }
+
+    cout << "Saved " << filename << ": " << (vb->storageBytes() >> 10) << " KB of voxels" << endl;
+}
+
+/**
+ * Applies command line options that affect how, rather than what, is rendered
+ */
+static void updateContext(RenderContext& context, option::Option* options)
+{
+    bool success = false;
+
+    // Tile size
+    if (options[TILE_SIZE].count() > 0 && options[TILE_SIZE].first()->arg != nullptr) {
+        int tileSize = toNumber<int>(options[TILE_SIZE].first()->arg, success);
+        if (success && tileSize > 0) {
+            context.setTileSize(tileSize);
+        }
+    }
+
+    // Render threads
+    if (options[THREADS].count() > 0 && options[THREADS].first()->arg != nullptr) {
+        int threads = toNumber<int>(options[THREADS].first()->arg, success);
+        if (success && threads > 0) {
+            context.setThreads(threads);
+        }
+    }
+
+    // Shadow ray cutoff
+    if (options[SHADOW_EPSILON].count() > 0 && options[SHADOW_EPSILON].first()->arg != nullptr) {
+        float epsilon = toNumber<float>(options[SHADOW_EPSILON].first()->arg, success);
+        if (success && epsilon >= 0.0f) {
+            context.setShadowEpsilon(epsilon);
+        }
+    }
+
+    // Primary ray cutoff
+    if (options[CUTOFF].count() > 0 && options[CUTOFF].first()->arg != nullptr) {
+        float cutoff = toNumber<float>(options[CUTOFF].first()->arg, success);
+        if (success && cutoff >= 0.0f) {
+            context.setCutoff(cutoff);
+        }
+    }
+
+    // Adaptive step error tolerance
+    if (options[TOLERANCE].count() > 0 && options[TOLERANCE].first()->arg != nullptr) {
+        float tolerance = toNumber<float>(options[TOLERANCE].first()->arg, success);
+        if (success && tolerance >= 0.0f) {
+            context.setTolerance(tolerance);
+        }
+        if (context.getTolerance() > 0.0f && options[STEP_SIZE].count() > 0) {
+            cerr << "-A/--tolerance picks its own steps; -S/--step only applies where volumes overlap or are streamed" << endl;
+        }
+    }
+
+    // Delta tracking, and its samples per pixel
+    if (options[TRACKING].count() > 0) {
+        int samples = 16;
+        if (options[TRACKING].first()->arg != nullptr) {
+            samples = toNumber<int>(options[TRACKING].first()->arg, success);
+        }
+        context.setSamplesPerPixel(std::max(samples, 0));
+    }
+
+    context.setRoulette(options[ROULETTE].count() > 0);
+
+    // Exact traversal integrates whole voxels, which only holds for their
+    // nearest-voxel densities:
+    if (options[DDA].count() > 0) {
+        context.setDDA(true);
+        context.setInterpolation(false);
+    }
+
+    // Pre-integration is built for one fixed step length:
+    if (options[PREINTEGRATE].count() > 0) {
+        if (context.getDDA()) {
+            cerr << "-B/--preintegrate has no effect with -G/--dda, which is exact already" << endl;
+        } else if (context.getTolerance() > 0.0f) {
+            cerr << "-B/--preintegrate does not support -A/--tolerance; ignoring it" << endl;
+        } else if (context.getTracking()) {
+            cerr << "-B/--preintegrate has no effect with -K/--tracking" << endl;
+        } else {
+            context.setPreIntegration(true);
+        }
+    }
+
+    // Packets terminate lanes with a hard cutoff only, and take fixed steps:
+    if (options[PACKETS].count() > 0) {
+        if (context.getRoulette()) {
+            cerr << "-P/--packets does not support -R/--roulette; tracing rays one at a time" << endl;
+        } else if (context.getDDA()) {
+            cerr << "-P/--packets does not support -G/--dda; tracing rays one at a time" << endl;
+        } else if (context.getTolerance() > 0.0f) {
+            cerr << "-P/--packets does not support -A/--tolerance; tracing rays one at a time" << endl;
+        } else if (context.getTracking()) {
+            cerr << "-P/--packets does not support -K/--tracking; tracing rays one at a time" << endl;
+        } else if (context.getPreIntegration()) {
+            cerr << "-P/--packets does not support -B/--preintegrate; tracing rays one at a time" << endl;
+        } else {
+            context.setPackets(true);
+        }
+    }
 }
 
 /******************************************************************************/
@@ -314,12 +1152,21 @@ int main(int argc, char** argv)
   bool noHeader = options[NO_INPUT_HEADER].count() > 0;
 	Camera camera;
 
-	auto config = readConfig(argv[argc-1], 1, noHeader);
+	auto config = readConfig(argv[argc-1], 0, noHeader, readLayout(options), readStream(options));
+
+  if (options[STREAM].count() > 0 && !VolumeFile::isVolumeFile(argv[argc-1])) {
+      cerr << "-Z/--stream only applies to " VOLUME_EXTENSION " volume files; loading the scene whole" << endl;
+  }
 
   // Merge in and override what's in the configuration with options from
   // the command line:
   updateConfiguration(config, options);
 
+  if (options[CONVERT].count() > 0) {
+      convert(config, options);
+      return 0;
+  }
+
 	intializeCamera(config, camera);
 
   // Dump all the values used in the render:
@@ -329,14 +1176,39 @@ int main(int argc, char** argv)
   // What we'll write to:
 	CImg<unsigned char> output(config->RESO.x, config->RESO.y, 1, 3, 0);
 
-	RenderContext context(config->STEP, config->getObjects(), config->getLights(), Color(config->BRGB));
+  // Flatten the scene into the arrays the renderer reads from:
+	RenderScene scene(*config);
+	RenderContext context(config->STEP, scene);
 
 	context.setInterpolation(true);
 
-	render(output, config->RESO, camera, context);
+  updateContext(context, options);
+
+  // Pick mip levels by how wide primary rays get:
+	if (options[MIP].count() > 0) {
+		context.setLOD(camera.getPosition(), camera.getPixelSpread(static_cast<float>(config->RESO.y)));
+	}
+
+  // Blue-noise start offsets; the mask is seeded so renders are repeatable:
+	BlueNoise blueNoise;
+
+	if (options[JITTER].count() > 0) {
+		blueNoise = BlueNoise(BLUE_NOISE_SIZE, config->SEED);
+		context.setBlueNoise(&blueNoise);
+	}
+
+	prepare(context);
+
+	RenderStats totals = render(output, config->RESO, camera, context);
 
 	output.save(config->FILE.c_str());
 
+  // Rendering must never touch the heap; see Allocations.h:
+	if (totals.allocations > 0) {
+		cerr << "*** " << totals.allocations << " heap allocation(s) made while rendering ***" << endl;
+		return EXIT_FAILURE;
+	}
+
 	return 0;
 }
 
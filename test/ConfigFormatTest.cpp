@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "Config.h"
+
+/*******************************************************************************
+ * Configuration format test
+ *
+ * Checks that Configuration::detectVersion() picks the format a sample is
+ * written in, and that the sample reads with that format's reader. Version 1
+ * samples are then read exactly as the renderer always read its input before
+ * the format was detected.
+ *
+ * USAGE: ConfigFormatTest <format> <input-file> [-N]
+ ******************************************************************************/
+
+using namespace std;
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        cerr << "USAGE: ConfigFormatTest <format> <input-file> [-N]" << endl;
+        return EXIT_FAILURE;
+    }
+
+    int expected    = atoi(argv[1]);
+    string filename = string(argv[2]);
+    bool noHeader   = argc > 3 && strcmp(argv[3], "-N") == 0;
+    int detected    = Configuration::detectVersion(filename);
+
+    if (detected != expected) {
+        cerr << filename << ": detected format " << detected << ", expected " << expected << endl;
+        return EXIT_FAILURE;
+    }
+
+    shared_ptr<Configuration> config(nullptr);
+
+    if (expected == 2) {
+        config = make_shared<NewConfigurationReader>();
+    } else {
+        config = make_shared<OldConfigurationReader>(filename);
+    }
+
+    ifstream configFile(filename.c_str());
+    config->read(configFile, noHeader);
+
+    cout << *config << endl;
+
+    if (config->getObjects().empty()) {
+        cerr << filename << ": no objects read" << endl;
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}